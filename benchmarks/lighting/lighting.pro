@@ -0,0 +1,18 @@
+TARGET = lighting
+CONFIG -= app_bundle
+
+include(../../opengl/opengl.pri)
+
+HEADERS += \
+    ../../opengl/x3dopenglrenderer.h \
+    ../../x3d/x3drenderer.h \
+    ../../output/qwindowoutput.h
+
+SOURCES += main.cpp \
+    ../../opengl/x3dopenglrenderer.cpp \
+    ../../output/qwindowoutput.cpp
+
+INCLUDEPATH += /usr/local/include/CyberX3D-1.0
+LIBS += -lcx3d-1.0
+
+RESOURCES += ../../x3d-compositor.qrc
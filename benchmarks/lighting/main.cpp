@@ -0,0 +1,158 @@
+// Renders a generated scene of overlapping point lights with each lighting
+// path and prints the GPU time of the lighting passes, so the paths can be
+// compared on the same machine and scene. Light volumes run with and without
+// the stencil mask, larger radii make that a fill-rate comparison.
+//
+// lighting [lights] [light radius] [frames]
+
+#include "output/qwindowoutput.h"
+#include "opengl/x3dopenglrenderer.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <QGuiApplication>
+#include <QTemporaryFile>
+#include <QTextStream>
+#include <QDir>
+
+#define CX3D_SUPPORT_OPENGL
+#include <cybergarage/x3d/CyberX3D.h>
+using namespace CyberX3D;
+
+// Timer queries are read a ring of frames late, warm up well past that
+static const size_t WARMUP_FRAMES = 30;
+
+struct LightingMode
+{
+    const char* name;
+    bool clustered;
+    bool tiled;
+    bool stencil;
+};
+
+// Quadratic attenuation fading a unit intensity light to LIGHT_THRESHOLD at
+// the radius, so every light's volume, clusters and tiles span that far
+static float get_quadratic_attenuation(float radius)
+{
+    return (1.0f / LIGHT_THRESHOLD - 1.0f) / (radius * radius);
+}
+
+// A ground plane under a grid of boxes with the lights spread over it
+static void write_scene(QTextStream& out, size_t num_lights, float radius)
+{
+    out << "<?xml version='1.0' encoding='UTF-8'?>\n"
+        << "<X3D profile='Immersive' version='3.3'>\n<Scene>\n"
+        << "<NavigationInfo headlight='false'/>\n"
+        << "<Viewpoint position='0 15 40' orientation='1 0 0 -0.35'/>\n"
+        << "<Shape><Appearance><Material/></Appearance><Box size='80 0.2 80'/></Shape>\n";
+
+    for (int x = -4; x <= 4; ++x) {
+        for (int z = -4; z <= 4; ++z) {
+            out << "<Transform translation='" << x * 8 << " 1 " << z * 8 << "'>"
+                << "<Shape><Appearance><Material diffuseColor='0.8 0.7 0.6'/></Appearance>"
+                << "<Box size='2 2 2'/></Shape></Transform>\n";
+        }
+    }
+
+    size_t side = (size_t)std::ceil(std::sqrt((float)num_lights));
+    for (size_t i = 0; i < num_lights; ++i) {
+        float x = ((float)(i % side) / side - 0.5f) * 70.0f;
+        float z = ((float)(i / side) / side - 0.5f) * 70.0f;
+        out << "<PointLight location='" << x << " 3 " << z << "' radius='" << radius
+            << "' attenuation='1 0 " << get_quadratic_attenuation(radius) << "' intensity='1"
+            << "' color='" << (i % 3 == 0) << " " << (i % 3 == 1) << " " << (i % 3 == 2) << "'/>\n";
+    }
+
+    out << "</Scene>\n</X3D>\n";
+}
+
+static void render_frame(QGuiApplication& app, X3DOpenGLRenderer& renderer, SceneGraph& scene)
+{
+    app.processEvents();
+
+    ViewpointNode *view = scene.getViewpointNode();
+    if (view == nullptr) {
+        view = scene.getDefaultViewpointNode();
+    }
+    Scalar fov = (view->getFieldOfView() / 3.14) * 180.0;
+    renderer.set_projection(fov, 1920.0f / 1080.0f, 0.1f, 10000.0f);
+    renderer.render(&scene);
+}
+
+static void run_mode(QGuiApplication& app, X3DOpenGLRenderer& renderer, SceneGraph& scene,
+                     const LightingMode& mode, size_t num_frames)
+{
+    renderer.set_clustered_lighting(mode.clustered);
+    renderer.set_tiled_lighting(mode.tiled);
+    renderer.set_stencil_light_volumes(mode.stencil);
+
+    for (size_t i = 0; i < WARMUP_FRAMES; ++i) {
+        render_frame(app, renderer, scene);
+    }
+
+    renderer.reset_lighting_stats();
+    for (size_t i = 0; i < num_frames; ++i) {
+        render_frame(app, renderer, scene);
+    }
+
+    const LightingStats& stats = renderer.get_lighting_stats();
+    double average = stats.frames ? (double)stats.gpu_time_ns / stats.frames / 1e6 : 0.0;
+    std::printf("%-12s %8.3f ms avg %8.3f ms max (%zu eyes)\n", mode.name, average,
+                stats.max_gpu_time_ns / 1e6, stats.frames);
+}
+
+int main(int argc, char *argv[])
+{
+    QGuiApplication app(argc, argv);
+
+    size_t num_lights = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 256;
+    float radius = argc > 2 ? std::strtof(argv[2], nullptr) : 12.0f;
+    size_t num_frames = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 300;
+
+    // Lights whose falloff never reaches the threshold shade nothing and
+    // every path would time empty passes
+    float light_radius = calc_light_radius(0, 1.0f, 1.0f, 0.0f, get_quadratic_attenuation(radius), radius);
+    if (!(light_radius > 0.0f)) {
+        std::fprintf(stderr, "Lights of radius %g would not reach any pixels\n", radius);
+        return 1;
+    }
+
+    QTemporaryFile file(QDir::tempPath() + "/lighting-XXXXXX.x3d");
+    if (!file.open()) {
+        std::fprintf(stderr, "Could not write the scene\n");
+        return 1;
+    }
+    {
+        QTextStream out(&file);
+        write_scene(out, num_lights, radius);
+    }
+    file.close();
+
+    SceneGraph scene;
+    if (!scene.load(file.fileName().toUtf8().constData())) {
+        std::fprintf(stderr, "Could not load the scene\n");
+        return 1;
+    }
+    scene.initialize();
+
+    QWindowOutput window;
+    window.enabled = true;
+    X3DOpenGLRenderer renderer;
+    renderer.set_viewpoint_output(0, window);
+    renderer.set_viewpoint_viewport(0, 1920, 1080);
+    window.show();
+
+    std::printf("%zu lights, radius %g, %zu frames\n", num_lights, light_radius, num_frames);
+    const LightingMode modes[] = {
+        {"volumes", false, false, true},
+        {"unmasked", false, false, false},
+        {"tiled", false, true, true},
+        {"clustered", true, false, true},
+    };
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+        run_mode(app, renderer, scene, modes[i], num_frames);
+    }
+    return 0;
+}
@@ -0,0 +1,165 @@
+// Replays an allocation trace against StreamedBuffer and reports the cost per
+// operation and how fragmented the buffer is left.
+//
+// Trace lines are "a <id> <size>" to allocate, "f <id>" to free and "n" to
+// start the next frame. Without a trace file a fixed mix of per frame uploads
+// and long lived geometry is generated so runs can be compared.
+
+#include "opengl/openglhelper.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+struct TraceOp
+{
+    char type;
+    size_t id;
+    size_t size;
+};
+
+static bool load_trace(const char* path, std::vector<TraceOp>& trace)
+{
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    std::string type;
+    while (file >> type) {
+        TraceOp op = { type[0], 0, 0 };
+        if (op.type == 'a') {
+            file >> op.id >> op.size;
+        } else if (op.type == 'f') {
+            file >> op.id;
+        }
+        trace.push_back(op);
+    }
+    return true;
+}
+
+static void generate_trace(std::vector<TraceOp>& trace, size_t num_frames)
+{
+    std::mt19937 random(1234);
+    std::uniform_int_distribution<size_t> small_size(16, 4096);
+    std::uniform_int_distribution<size_t> large_size(4096, 256 << 10);
+    std::uniform_int_distribution<int> percent(0, 99);
+
+    std::vector<size_t> live;
+    size_t next_id = 0;
+    for (size_t frame = 0; frame < num_frames; ++frame) {
+        // Per frame uploads are freed the frame they are made
+        std::vector<size_t> transient;
+        for (int i = 0; i < 64; ++i) {
+            TraceOp op = { 'a', next_id, small_size(random) };
+            transient.push_back(next_id++);
+            trace.push_back(op);
+        }
+
+        // Geometry streams in and out around a steady working set
+        for (int i = 0; i < 4; ++i) {
+            if (live.empty() || (live.size() < 512 && percent(random) < 60)) {
+                TraceOp op = { 'a', next_id, large_size(random) };
+                live.push_back(next_id++);
+                trace.push_back(op);
+            } else {
+                size_t index = random() % live.size();
+                TraceOp op = { 'f', live[index], 0 };
+                live[index] = live.back();
+                live.pop_back();
+                trace.push_back(op);
+            }
+        }
+
+        for (size_t i = 0; i < transient.size(); ++i) {
+            TraceOp op = { 'f', transient[i], 0 };
+            trace.push_back(op);
+        }
+
+        TraceOp op = { 'n', 0, 0 };
+        trace.push_back(op);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<TraceOp> trace;
+    if (argc > 1) {
+        if (!load_trace(argv[1], trace)) {
+            std::cerr << "Could not read trace " << argv[1] << std::endl;
+            return 1;
+        }
+    } else {
+        generate_trace(trace, 2000);
+    }
+
+    std::vector<char> storage(64 << 20);
+    StreamedBuffer buffer;
+    buffer.data = storage.data();
+    buffer.max_bytes = storage.size();
+    buffer.grow = [&storage](StreamedBuffer& buffer, size_t required) {
+        size_t size = storage.size();
+        while (size < required) {
+            size *= 2;
+        }
+        storage.resize(size);
+        buffer.data = storage.data();
+        buffer.max_bytes = size;
+        return true;
+    };
+
+    struct Live
+    {
+        size_t pos;
+        size_t size;
+    };
+    std::unordered_map<size_t, Live> live;
+
+    size_t num_allocs = 0;
+    size_t num_frees = 0;
+    size_t num_frames = 0;
+    size_t peak_pos = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < trace.size(); ++i) {
+        const TraceOp& op = trace[i];
+        if (op.type == 'a') {
+            Live alloc = { buffer.allocate(op.size), op.size };
+            live[op.id] = alloc;
+            ++num_allocs;
+        } else if (op.type == 'f') {
+            auto it = live.find(op.id);
+            if (it != live.end()) {
+                buffer.free(it->second.pos, it->second.size);
+                live.erase(it);
+                ++num_frees;
+            }
+        } else if (op.type == 'n') {
+            // Frames are reclaimed once the ring comes back round, as with fences
+            buffer.frame_num = (buffer.frame_num + 1) % StreamedBuffer::NUM_FRAMES;
+            buffer.advance();
+            ++num_frames;
+        }
+        peak_pos = std::max<size_t>(peak_pos, buffer.current_pos);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double elapsed_ns = std::chrono::duration<double, std::nano>(end - start).count();
+    size_t num_ops = num_allocs + num_frees;
+
+    size_t live_bytes = 0;
+    for (auto it = live.begin(); it != live.end(); ++it) {
+        live_bytes += it->second.size;
+    }
+
+    std::printf("ops %zu (allocs %zu, frees %zu, frames %zu)\n", num_ops, num_allocs, num_frees, num_frames);
+    std::printf("time %.1f ns/op\n", num_ops ? elapsed_ns / num_ops : 0.0);
+    std::printf("live %zu bytes, current_pos %zu, peak %zu, free %zu bytes\n",
+                live_bytes, (size_t)buffer.current_pos, peak_pos, buffer.get_free_bytes());
+    return 0;
+}
@@ -0,0 +1,7 @@
+TARGET = streamedbuffer
+CONFIG += console
+CONFIG -= app_bundle
+
+include(../../opengl/opengl.pri)
+
+SOURCES += main.cpp
@@ -3,6 +3,7 @@
 #include "opengl/x3dopenglrenderer.h"
 
 #include <QGuiApplication>
+#include <QCommandLineParser>
 #include <QFileInfo>
 #include <QDir>
 
@@ -10,16 +11,31 @@ int main(int argc, char *argv[])
 {
     QGuiApplication app(argc, argv);
 
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addPositionalArgument("file", "X3D scene to load.");
+    QCommandLineOption gpu_culling("gpu-culling", "Cull and build draw commands in a compute shader.");
+    parser.addOption(gpu_culling);
+    QCommandLineOption occlusion_culling("occlusion-culling", "Also cull against the last frame's depth, implies --gpu-culling.");
+    parser.addOption(occlusion_culling);
+    QCommandLineOption merged_batches("merged-batches", "Share batches between materials on the same pipeline.");
+    parser.addOption(merged_batches);
+    parser.process(app);
+
     QWindowOutput window;
     window.enabled = true;
     X3DOpenGLRenderer renderer;
     renderer.set_viewpoint_output(0, window);
     renderer.set_viewpoint_viewport(0, 1920, 1080);
+    renderer.set_gpu_culling(parser.isSet(gpu_culling) || parser.isSet(occlusion_culling));
+    renderer.set_occlusion_culling(parser.isSet(occlusion_culling));
+    renderer.set_merged_batches(parser.isSet(merged_batches));
     X3DScene scene(&renderer);
 
-    if (argc > 1)
+    const QStringList files = parser.positionalArguments();
+    if (!files.isEmpty())
     {
-        QString file = argv[1];
+        QString file = files.first();
         QFileInfo file_info(file);
         QDir::setCurrent(file_info.absoluteDir().absolutePath());
         scene.load(file);
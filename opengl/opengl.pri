@@ -0,0 +1,14 @@
+QT += gui gui-private core-private openglextensions concurrent
+CONFIG += c++11
+
+INCLUDEPATH += $$PWD/..
+
+HEADERS += \
+    $$PWD/opengloutput.h \
+    $$PWD/openglrenderer.h \
+    $$PWD/openglhelper.h
+
+SOURCES += \
+    $$PWD/opengloutput.cpp \
+    $$PWD/openglrenderer.cpp \
+    $$PWD/openglhelper.cpp
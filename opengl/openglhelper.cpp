@@ -2,6 +2,11 @@
 
 #include <thread>
 #include <iostream>
+#include <cmath>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 #include <QtGui/QOpenGLShaderProgram>
 #include <QtGui/QOpenGLVertexArrayObject>
@@ -70,6 +75,24 @@ ContextPoolContext::ContextPoolContext(QOpenGLContext* share_context, bool reser
         throw;
     }
     buffer = (QOpenGLExtension_ARB_buffer_storage)context->getProcAddress("glBufferStorage");
+    compute.glDispatchCompute = (decltype(compute.glDispatchCompute))context->getProcAddress("glDispatchCompute");
+    compute.glMemoryBarrier = (decltype(compute.glMemoryBarrier))context->getProcAddress("glMemoryBarrier");
+    compute.glClearBufferData = (decltype(compute.glClearBufferData))context->getProcAddress("glClearBufferData");
+    compute.glMultiDrawElementsIndirectCountARB = (decltype(compute.glMultiDrawElementsIndirectCountARB))
+            context->getProcAddress("glMultiDrawElementsIndirectCountARB");
+    compute.glMultiDrawArraysIndirectCountARB = (decltype(compute.glMultiDrawArraysIndirectCountARB))
+            context->getProcAddress("glMultiDrawArraysIndirectCountARB");
+    compute.glBindImageTexture = (decltype(compute.glBindImageTexture))context->getProcAddress("glBindImageTexture");
+    has_compute = context->hasExtension("GL_ARB_compute_shader")
+            && context->hasExtension("GL_ARB_shader_storage_buffer_object")
+            && context->hasExtension("GL_ARB_clear_buffer_object")
+            && compute.glDispatchCompute != nullptr && compute.glMemoryBarrier != nullptr
+            && compute.glClearBufferData != nullptr;
+    has_storage_buffer = context->hasExtension("GL_ARB_shader_storage_buffer_object");
+    has_timer_query = context->hasExtension("GL_ARB_timer_query");
+    has_indirect_parameters = context->hasExtension("GL_ARB_indirect_parameters")
+            && compute.glMultiDrawElementsIndirectCountARB != nullptr
+            && compute.glMultiDrawArraysIndirectCountARB != nullptr;
     debug = new QOpenGLExtension_ARB_debug_output();
     if (!debug->initializeOpenGLFunctions()) {
         throw;
@@ -157,15 +180,18 @@ int ContextPoolContext::get_fbo(const RenderTarget& render_target)
     }
 }
 
-int ContextPoolContext::get_pipeline(const Material& material)
+int ContextPoolContext::get_pipeline(const Material& material, bool fragment)
 {
-    MaterialPipelineMap::iterator it = pipelines.find(material);
-    if (it == pipelines.end()) {
+    MaterialPipelineMap& cache = fragment ? pipelines : vertex_pipelines;
+    MaterialPipelineMap::iterator it = cache.find(material);
+    if (it == cache.end()) {
         unsigned int pipeline = 0;
         sso->glGenProgramPipelines(1, &pipeline);
         sso->glUseProgramStages(pipeline, GL_VERTEX_SHADER_BIT, material.vert);
-        sso->glUseProgramStages(pipeline, GL_FRAGMENT_SHADER_BIT, material.frag);
-        pipelines[material] = pipeline;
+        if (fragment) {
+            sso->glUseProgramStages(pipeline, GL_FRAGMENT_SHADER_BIT, material.frag);
+        }
+        cache[material] = pipeline;
         return pipeline;
     } else {
         return it->second;
@@ -198,6 +224,29 @@ int ContextPoolContext::get_vao(const VertexFormat& format)
     }
 }
 
+unsigned int RenderTarget::get_format(size_t attachment) const
+{
+    if (layout == COMPACT_G_BUFFER) {
+        return attachment == 2 ? GL_RG16F : GL_RGBA8;
+    }
+    return GL_RGBA16F;
+}
+
+size_t RenderTarget::get_bytes_per_pixel() const
+{
+    size_t bytes = use_depth ? 4 : 0;
+    for (size_t i = 0; i < num_attachments; ++i) {
+        GLenum format = get_format(i);
+        bytes += format == GL_RGBA16F ? 8 : 4;
+    }
+    return bytes;
+}
+
+static inline GLenum get_stencil_op(int op)
+{
+    return op == ShaderPass::DISABLED ? GL_KEEP : op;
+}
+
 void ContextPoolContext::setup_for_pass(const ShaderPass &pass, const RenderOuputGroup& output)
 {
     // TODO Capture state object and bind if exists?
@@ -208,9 +257,23 @@ void ContextPoolContext::setup_for_pass(const ShaderPass &pass, const RenderOupu
             glActiveTexture(GL_TEXTURE0 + i);
             glBindTexture(GL_TEXTURE_2D, in_target.attachments[i - 1]);
         }
+        if (in_target.use_depth) {
+            glActiveTexture(GL_TEXTURE0 + RenderTarget::DEPTH_UNIT);
+            glBindTexture(GL_TEXTURE_2D, in_target.depth);
+        }
     }
 
-    gl->glBindFramebuffer(GL_FRAMEBUFFER, get_fbo(target));
+    // Looked up first, creating an fbo binds it
+    int fbo = get_fbo(target);
+    int in_fbo = pass.copy_depth && pass.in >= 0 ? get_fbo(output.get_render_target(pass.in)) : 0;
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    if (in_fbo != 0) {
+        const RenderTarget& in_target = output.get_render_target(pass.in);
+        gl->glBindFramebuffer(GL_READ_FRAMEBUFFER, in_fbo);
+        gl->glBlitFramebuffer(0, 0, in_target.width, in_target.height, 0, 0, target.width, target.height,
+                              GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        gl->glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    }
     GLenum buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
                         GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3,
                         GL_COLOR_ATTACHMENT4, GL_COLOR_ATTACHMENT5};
@@ -230,9 +293,9 @@ void ContextPoolContext::setup_for_pass(const ShaderPass &pass, const RenderOupu
     }
 
     if (pass.stencil_mask) {
-        gl->glStencilMask(GL_TRUE);
+        gl->glStencilMask(0xff);
     } else {
-        gl->glStencilMask(GL_FALSE);
+        gl->glStencilMask(0);
     }
 
     if (pass.depth_func == ShaderPass::DISABLED) {
@@ -261,9 +324,13 @@ void ContextPoolContext::setup_for_pass(const ShaderPass &pass, const RenderOupu
         gl->glDisable(GL_STENCIL_TEST);
     } else {
         gl->glEnable(GL_STENCIL_TEST);
-        gl->glStencilFunc(pass.stencil_func, 0, 0);
-        //gl->glStencilOpSeparate(GL_BACK, , , );
-        //gl->glStencilOpSeparate(GL_FRONT, , , );
+        gl->glStencilFunc(pass.stencil_func, pass.stencil_ref, 0xff);
+        gl->glStencilOpSeparate(GL_FRONT, get_stencil_op(pass.stencil_front.stencil_fail),
+                                get_stencil_op(pass.stencil_front.depth_fail),
+                                get_stencil_op(pass.stencil_front.depth_pass));
+        gl->glStencilOpSeparate(GL_BACK, get_stencil_op(pass.stencil_back.stencil_fail),
+                                get_stencil_op(pass.stencil_back.depth_fail),
+                                get_stencil_op(pass.stencil_back.depth_pass));
     }
 
     if (pass.clear != ShaderPass::DISABLED) {
@@ -309,6 +376,10 @@ ContextPoolContext& ContextPool::assign_context(int named_id)
             std::this_thread::yield();
         }
         context_pool[named_id].increment();
+        // Unnamed requests on this thread share it rather than wait for another
+        if (thread_pool_context == nullptr) {
+            thread_pool_context = &context_pool[named_id];
+        }
         return context_pool[named_id];
     }
 
@@ -375,281 +446,3193 @@ void OpenGLRenderer::create_material(const std::string& name,
 
     material.pass = pass;
 
-    QFile vert(vert_filename.c_str());
-    QFile frag(frag_filename.c_str());
+    material.vert = get_shader_program(GL_VERTEX_SHADER, vert_filename);
+    material.frag = get_shader_program(GL_FRAGMENT_SHADER, frag_filename);
 
-    if (!vert.open(QIODevice::ReadOnly) ||
-        !frag.open(QIODevice::ReadOnly)) {
-        throw;
+    material.total_objects = 0;
+
+    if (merged_batches) {
+        merge_material(material);
     }
+}
 
-    QByteArray vert_data = vert.readAll();
-    QByteArray frag_data = frag.readAll();
+unsigned int OpenGLRenderer::get_shader_program(int type, const std::string& filename)
+{
+    std::map<std::string, unsigned int>::iterator it = shader_programs.find(filename);
+    if (it != shader_programs.end()) {
+        return it->second;
+    }
 
-    if (vert_data.size() == 0 || frag_data.size() == 0) {
+    ScopedContext context(context_pool, 0);
+    QFile file(filename.c_str());
+    if (!file.open(QIODevice::ReadOnly)) {
         throw;
     }
 
-    const char* vert_list[1] = {vert_data.constData()};
-    const char* frag_list[1] = {frag_data.constData()};
-    // TODO cache shader program by filename these
-    material.vert = context.context.sso->glCreateShaderProgramv(GL_VERTEX_SHADER, 1, vert_list);
-    material.frag = context.context.sso->glCreateShaderProgramv(GL_FRAGMENT_SHADER, 1, frag_list);
-    context.context.gl->glUniformBlockBinding(material.vert, 0, 0);
-    context.context.gl->glUniformBlockBinding(material.vert, 1, 1);
-    context.context.gl->glUniformBlockBinding(material.frag, 0, 0);
-    context.context.gl->glUniformBlockBinding(material.frag, 1, 3);
+    QByteArray data = file.readAll();
+    if (data.size() == 0) {
+        throw;
+    }
 
-    // TODO convert to one ssbo?
-    context.context.gl->glGenBuffers(1, &material.frag_params);
-    context.context.gl->glBindBuffer(GL_UNIFORM_BUFFER, material.frag_params);
-    context.context.gl->glBufferData(GL_UNIFORM_BUFFER, 65536, nullptr, GL_DYNAMIC_DRAW);
+    // Defines go after the #version line, which has to come first
+    std::string source(data.constData(), data.size());
+    size_t version_end = source.find('\n') + 1;
+    std::string version = source.substr(0, version_end);
+    std::string defines;
+    if (!context.context.has_storage_buffer) {
+        defines += "#define TRANSFORM_TEXTURE_BUFFER\n";
+        defines += "#define MATERIAL_UNIFORM_BUFFER\n";
+    }
+    std::string body = source.substr(version_end);
+
+    const char* list[3] = {version.c_str(), defines.c_str(), body.c_str()};
+    unsigned int program = context.context.sso->glCreateShaderProgramv(type, 3, list);
+    // Looked up by name, blocks moved to storage buffers are not counted
+    const char* names[3] = {"GlobalParameters", "ShaderParameters", "MaterialParameters"};
+    const unsigned int bindings[3] = {0, 3, 4};
+    for (int i = 0; i < 3; ++i) {
+        unsigned int index = context.context.gl->glGetUniformBlockIndex(program, names[i]);
+        if (index != GL_INVALID_INDEX) {
+            context.context.gl->glUniformBlockBinding(program, index, bindings[i]);
+        }
+    }
 
-    material.total_objects = 0;
+    shader_programs[filename] = program;
+    return program;
 }
 
-// TODO UNIFY BUFFER CREATION
-PixelBuffer& OpenGLRenderer::get_pixel_buffer()
+void OpenGLRenderer::merge_material(Material& material)
 {
-    // TODO convert to bindless textures
-    PixelBuffer& buffer = this->textures;
-    if (buffer.buffer == 0) {
-        ScopedContext context(context_pool);
+    // Only materials with nothing referencing their batches or parameters
+    if (material.batch_material != nullptr || material.total_objects != 0 || !material.batches.empty()) {
+        return;
+    }
 
-        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
-        context.context.gl->glGenBuffers(1, &buffer.buffer);
-        context.context.gl->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer.buffer);
-        buffer.max_bytes = 400 * 1024 * 1024;
-        context.context.buffer(GL_PIXEL_UNPACK_BUFFER, buffer.max_bytes, nullptr, flags | GL_DYNAMIC_STORAGE_BIT);
-        buffer.current_pos = 0;
-        buffer.offset = 0;
-        buffer.frame_num = 0;
-        buffer.data = (char*)context.context.gl->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, buffer.max_bytes, flags);
-        context.context.gl->glGenTextures(1, &buffer.texture);
-        context.context.gl->glBindTexture(GL_TEXTURE_BUFFER, buffer.texture);
-        context.context.tex->glTexBufferARB(GL_TEXTURE_BUFFER, GL_RGBA8, buffer.buffer);
-    } else if (buffer.frame_num != frame_num) {
-        buffer.frame_num = frame_num;
-        buffer.advance();
+    for (auto it = materials.begin(); it != materials.end(); ++it) {
+        Material& other = it->second;
+        if (&other != &material && other.batch_material == nullptr
+                && other.vert == material.vert && other.frag == material.frag
+                && other.pass == material.pass) {
+            material.batch_material = &other;
+            return;
+        }
     }
-    return buffer;
 }
 
-DrawInfoBuffer& OpenGLRenderer::get_draw_info_buffer()
+static bool same_bytes(const std::vector<char>& stored, const char* data)
 {
-    DrawInfoBuffer& buffer = this->draw_info;
-    if (buffer.buffer == 0) {
-        ScopedContext context(context_pool);
+    return stored.empty() || memcmp(stored.data(), data, stored.size()) == 0;
+}
 
-        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
-        context.context.gl->glGenBuffers(1, &buffer.buffer);
-        context.context.gl->glBindBuffer(GL_ARRAY_BUFFER, buffer.buffer);
-        buffer.max_bytes = 65536;
-        context.context.buffer(GL_ARRAY_BUFFER, buffer.max_bytes, nullptr, flags | GL_DYNAMIC_STORAGE_BIT);
-        buffer.current_pos = 0;
-        buffer.offset = 0;
-        buffer.frame_num = 0;
-        buffer.data = (char*)context.context.gl->glMapBufferRange(GL_ARRAY_BUFFER, 0, buffer.max_bytes, flags);
-    } else if (buffer.frame_num != frame_num) {
-        buffer.frame_num = frame_num;
-        buffer.advance();
+DrawHandle OpenGLRenderer::find_geometry(const GeometryKey& key, const char* vertices, const char* elements,
+                                         DrawBatch& batch)
+{
+    auto it = geometry_cache.find(key);
+    if (it == geometry_cache.end()) {
+        return DrawHandle();
     }
-    return buffer;
+
+    // The hash only finds candidates, another mesh is never drawn in its place
+    GeometryEntry& entry = it->second;
+    if (!same_bytes(entry.vertices, vertices) || !same_bytes(entry.elements, elements)) {
+        ++geometry_stats.collisions;
+        return DrawHandle();
+    }
+
+    // Prefer a draw in the same batch, the geometry becomes another instance.
+    // Draws elsewhere are only reused with the same layout, offsets count in strides.
+    std::vector<DrawHandle>& draws = entry.draws;
+    DrawHandle shared;
+    for (auto draw_it = draws.begin(); draw_it != draws.end();) {
+        DrawBatch* draw_batch = draw_pool.get_batch(*draw_it);
+        if (draw_batch == nullptr) {
+            draw_it = draws.erase(draw_it);
+            continue;
+        } else if (draw_batch == &batch) {
+            shared = *draw_it;
+            break;
+        } else if (draw_batch->format == batch.format && draw_batch->format_stride == batch.format_stride) {
+            shared = *draw_it;
+        }
+        ++draw_it;
+    }
+
+    if (draws.empty()) {
+        geometry_cache.erase(it);
+        return DrawHandle();
+    } else if (shared.is_null()) {
+        return shared;
+    }
+
+    if (draw_pool.get_batch(shared) != &batch) {
+        // Other material, the uploaded data is still reused
+        size_t verts, elements, vert_offset, element_offset;
+        draw_pool.get_geometry(shared, verts, elements, vert_offset, element_offset);
+        shared = draw_pool.add_draw(batch, verts, elements, vert_offset, element_offset);
+        draws.push_back(shared);
+    }
+
+    ++geometry_stats.shared;
+    geometry_stats.bytes_saved += key.vertex_bytes + key.element_bytes;
+    return shared;
 }
 
-ShaderBuffer& OpenGLRenderer::get_transform_buffer()
+void OpenGLRenderer::add_geometry(const GeometryKey& key, const char* vertices, const char* elements, DrawHandle draw)
 {
-    ShaderBuffer& buffer = this->transform_buffer;
-    if (buffer.buffer == 0) {
-        ScopedContext context(context_pool);
+    ++geometry_stats.uploads;
+    geometry_stats.bytes_uploaded += key.vertex_bytes + key.element_bytes;
+
+    // Geometry colliding with a cached mesh is drawn but not shared
+    GeometryEntry& entry = geometry_cache[key];
+    if (entry.draws.empty()) {
+        entry.vertices.assign(vertices, vertices + key.vertex_bytes);
+        entry.elements.assign(elements, elements + key.element_bytes);
+    } else if (!same_bytes(entry.vertices, vertices) || !same_bytes(entry.elements, elements)) {
+        return;
+    }
+    entry.draws.push_back(draw);
+}
 
-        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
-        context.context.gl->glGenBuffers(1, &buffer.buffer);
-        context.context.gl->glBindBuffer(GL_UNIFORM_BUFFER, buffer.buffer);
-        buffer.max_bytes = 65536;
-        context.context.buffer(GL_UNIFORM_BUFFER, buffer.max_bytes, nullptr, flags | GL_DYNAMIC_STORAGE_BIT);
-        buffer.current_pos = 0;
-        buffer.offset = 0;
-        buffer.frame_num = 0;
-        buffer.data = (char*)context.context.gl->glMapBufferRange(GL_UNIFORM_BUFFER, 0, buffer.max_bytes, flags);
-    } else if (buffer.frame_num != frame_num) {
-        buffer.frame_num = frame_num;
-        buffer.advance();
+void OpenGLRenderer::advance_buffer(StreamedBuffer& buffer)
+{
+    // Only the first thread to see the new frame advances
+    if (buffer.frame_num.exchange(frame_num) != frame_num) {
+        // Frees stay queued on this frame if its fence has not signalled
+        if (frame_reclaimable) {
+            buffer.advance();
+        }
     }
-    return buffer;
 }
 
-DrawBuffer& OpenGLRenderer::get_draw_buffer()
+BufferManager::BufferManager(ContextPool& context_pool)
+    : context_pool(context_pool), copy_fence(nullptr)
 {
-    DrawBuffer& buffer = this->draw_calls;
-    if (buffer.buffer == 0) {
+    set_budget(VERTEX_BUFFER_USAGE, 1024 * 1024 * 20, 1024 * 1024 * 512);
+    set_budget(INDEX_BUFFER_USAGE, 1024 * 1024 * 20, 1024 * 1024 * 256);
+    set_budget(DRAW_BUFFER_USAGE, 65536, 1024 * 1024 * 16);
+    set_budget(DRAW_INFO_BUFFER_USAGE, 65536, 1024 * 1024 * 16);
+    set_budget(SHADER_BUFFER_USAGE, 65536, 1024 * 1024 * 64);
+    set_budget(PIXEL_BUFFER_USAGE, 400 * 1024 * 1024, 1024 * 1024 * 1024);
+    set_budget(PARAMETER_BUFFER_USAGE, 65536, 1024 * 1024 * 64);
+}
+
+BufferManager::~BufferManager()
+{
+
+}
+
+void BufferManager::set_budget(BufferUsage usage, size_t initial_bytes, size_t budget)
+{
+    arenas[usage].initial_bytes = align(initial_bytes, REGION_ALIGNMENT);
+    arenas[usage].budget = std::max(budget, arenas[usage].initial_bytes);
+}
+
+size_t BufferManager::get_reserved_bytes(BufferUsage usage) const
+{
+    return arenas[usage].buffer != 0 ? arenas[usage].max_bytes.load() : 0;
+}
+
+void BufferManager::create_region(BufferUsage usage, StreamedBuffer& region, size_t size)
+{
+    BufferArena& arena = arenas[usage];
+    if (arena.buffer == 0) {
         ScopedContext context(context_pool);
 
         GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
-        context.context.gl->glGenBuffers(1, &buffer.buffer);
-        context.context.gl->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer.buffer);
-        buffer.max_bytes = 65536;
-        context.context.buffer(GL_DRAW_INDIRECT_BUFFER, buffer.max_bytes, nullptr, flags | GL_DYNAMIC_STORAGE_BIT);
-        buffer.current_pos = 0;
-        buffer.offset = 0;
-        buffer.frame_num = 0;
-        buffer.data = (char*)context.context.gl->glMapBufferRange(GL_DRAW_INDIRECT_BUFFER, 0, buffer.max_bytes, flags);
-    } else if (buffer.frame_num != frame_num) {
-        buffer.frame_num = frame_num;
-        buffer.advance();
+        context.context.gl->glGenBuffers(1, &arena.buffer);
+        context.context.gl->glBindBuffer(GL_COPY_WRITE_BUFFER, arena.buffer);
+        arena.max_bytes = std::max(arena.initial_bytes, align(size, REGION_ALIGNMENT));
+        context.context.buffer(GL_COPY_WRITE_BUFFER, arena.max_bytes, nullptr, flags | GL_DYNAMIC_STORAGE_BIT);
+        arena.current_pos = 0;
+        arena.offset = 0;
+        arena.data = (char*)context.context.gl->glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, arena.max_bytes, flags);
+        arena.grow = [this](StreamedBuffer& grown, size_t required) {
+            return grow_arena((BufferArena&)grown, required);
+        };
+        arena.copy = [this](StreamedBuffer& buffer, size_t from, size_t to, size_t size) {
+            return copy_range(buffer, from, to, size);
+        };
     }
-    return buffer;
+
+    size = align(size, REGION_ALIGNMENT);
+    region.offset = arena.allocate(size);
+    region.buffer = arena.buffer;
+    region.data = arena.data + region.offset;
+    region.max_bytes = size;
+    region.current_pos = 0;
+    region.parent = &arena;
+    region.grow = [this, &arena](StreamedBuffer& grown, size_t required) {
+        return grow_region(arena, grown, required);
+    };
+    region.copy = arena.copy;
+    arena.regions.push_back(&region);
 }
 
-IndexBuffer& OpenGLRenderer::get_index_buffer()
+bool BufferManager::grow_arena(BufferArena& arena, size_t required)
 {
-    IndexBuffer& buffer = this->indices;
-    if (buffer.buffer == 0) {
-        ScopedContext context(context_pool);
+    if (required > arena.budget) {
+        return false;
+    }
 
-        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
-        context.context.gl->glGenBuffers(1, &buffer.buffer);
-        context.context.gl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer.buffer);
-        buffer.max_bytes = 1024 * 1024 * 20;
-        context.context.buffer(GL_ELEMENT_ARRAY_BUFFER, buffer.max_bytes, nullptr, flags | GL_DYNAMIC_STORAGE_BIT);
-        buffer.current_pos = 0;
-        buffer.offset = 0;
-        buffer.data = (char*)context.context.gl->glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0, buffer.max_bytes, flags);
-    } else if (buffer.frame_num != frame_num) {
-        buffer.frame_num = frame_num;
-        buffer.advance();
+    ScopedContext context(context_pool);
+    const auto gl = context.context.gl;
+
+    size_t new_size = arena.max_bytes;
+    while (new_size < required) {
+        new_size *= 2;
     }
-    return buffer;
+    new_size = std::min(new_size, arena.budget);
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    unsigned int new_buffer = 0;
+    gl->glGenBuffers(1, &new_buffer);
+    gl->glBindBuffer(GL_COPY_WRITE_BUFFER, new_buffer);
+    context.context.buffer(GL_COPY_WRITE_BUFFER, new_size, nullptr, flags | GL_DYNAMIC_STORAGE_BIT);
+    char* data = (char*)gl->glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, new_size, flags);
+    if (data == nullptr) {
+        gl->glDeleteBuffers(1, &new_buffer);
+        return false;
+    }
+
+    // Live data is copied on the GPU, the mapping is write only.
+    gl->glBindBuffer(GL_COPY_READ_BUFFER, arena.buffer);
+    gl->glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, arena.current_pos);
+
+    // Frames still in flight keep the old storage alive until they finish
+    gl->glDeleteBuffers(1, &arena.buffer);
+
+    arena.buffer = new_buffer;
+    arena.data = data;
+    arena.max_bytes = new_size;
+
+    for (auto it = arena.regions.begin(); it != arena.regions.end(); ++it) {
+        StreamedBuffer& region = **it;
+        region.buffer = arena.buffer;
+        region.data = arena.data + region.offset;
+        if (region.relocated) {
+            region.relocated(region);
+        }
+    }
+
+    finish_copies(context.context);
+    return true;
 }
 
-VertexBuffer& OpenGLRenderer::get_buffer(const VertexFormat& format)
+bool BufferManager::grow_region(BufferArena& arena, StreamedBuffer& region, size_t required)
 {
-    VertexFormatBufferMap::iterator it = buffers.find(format);
-    if (it == buffers.end()) {
-        ScopedContext context(context_pool);
-        VertexBuffer buffer;
+    size_t old_size = region.max_bytes;
+    size_t new_size = old_size;
+    while (new_size < required) {
+        new_size *= 2;
+    }
+    new_size = align(new_size, REGION_ALIGNMENT);
+
+    // The last region extends in place, so single region usages never move
+    if (arena.extend(region.offset, old_size, new_size)) {
+        region.buffer = arena.buffer;
+        region.data = arena.data + region.offset;
+        region.max_bytes = new_size;
+        if (region.relocated) {
+            region.relocated(region);
+        }
+        return true;
+    }
 
-        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
-        context.context.gl->glGenBuffers(1, &buffer.buffer);
-        context.context.gl->glBindBuffer(GL_ARRAY_BUFFER, buffer.buffer);
-        buffer.max_bytes = 1024 * 1024 * 20;
-        context.context.buffer(GL_ARRAY_BUFFER, buffer.max_bytes, nullptr, flags | GL_DYNAMIC_STORAGE_BIT);
-        buffer.current_pos = 0;
-        buffer.offset = 0;
-        buffer.data = (char*)context.context.gl->glMapBufferRange(GL_ARRAY_BUFFER, 0, buffer.max_bytes, flags);
-        buffers[format] = buffer;
-        return buffers[format];
-    } else {
-        VertexBuffer& buffer = it->second;
-        if (buffer.frame_num != frame_num) {
-            buffer.frame_num = frame_num;
-            buffer.advance();
+    size_t new_offset = 0;
+    if (!arena.try_allocate(new_size, new_offset)) {
+        return false;
+    }
+
+    ScopedContext context(context_pool);
+    const auto gl = context.context.gl;
+    gl->glBindBuffer(GL_COPY_READ_BUFFER, arena.buffer);
+    gl->glBindBuffer(GL_COPY_WRITE_BUFFER, arena.buffer);
+    gl->glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                            region.offset, new_offset, region.current_pos);
+    arena.free(region.offset, old_size);
+
+    region.offset = new_offset;
+    region.buffer = arena.buffer;
+    region.data = arena.data + region.offset;
+    region.max_bytes = new_size;
+    if (region.relocated) {
+        region.relocated(region);
+    }
+
+    finish_copies(context.context);
+    return true;
+}
+
+bool BufferManager::copy_range(StreamedBuffer& buffer, size_t from, size_t to, size_t size)
+{
+    ScopedContext context(context_pool);
+    const auto gl = context.context.gl;
+    gl->glBindBuffer(GL_COPY_READ_BUFFER, buffer.buffer);
+    gl->glBindBuffer(GL_COPY_WRITE_BUFFER, buffer.buffer);
+    gl->glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                            buffer.offset + from, buffer.offset + to, size);
+    finish_copies(context.context);
+    return true;
+}
+
+void BufferManager::advance(size_t frame_num, bool reclaim)
+{
+    for (size_t i = 0; i < NUM_BUFFER_USAGES; ++i) {
+        if (arenas[i].frame_num.exchange(frame_num) != frame_num && reclaim) {
+            arenas[i].advance();
         }
-        return it->second;
     }
 }
-// --- TODO UNIFY BUFFER CREATION
 
-void OpenGLRenderer::write_batches()
+void BufferManager::fence_copies(ContextPoolContext& context)
 {
-    DrawBuffer& draws = get_draw_buffer();
-    DrawInfoBuffer& infos = get_draw_info_buffer();
+    if (copy_fence != nullptr) {
+        context.gl->glDeleteSync(copy_fence);
+    }
+    copy_fence = context.gl->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    context.gl->glFlush();
+}
 
-    // TODO check if draw/drawbatch has any changes cascaded up.
-    // If no changes do not need to alter can use last frame's buffer.
-    for (auto material_it = materials.begin();
-         material_it != materials.end(); ++material_it) {
+void BufferManager::finish_copies(ContextPoolContext& context)
+{
+    // Callers write through the mapping as soon as a grow returns, a queued
+    // copy landing after them would overwrite the new data
+    fence_copies(context);
+    GLenum status = GL_TIMEOUT_EXPIRED;
+    while (status == GL_TIMEOUT_EXPIRED) {
+        status = context.gl->glClientWaitSync(copy_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+    }
+    if (status == GL_WAIT_FAILED) {
+        context.gl->glFinish();
+    }
+}
 
-        for (auto batch_it = material_it->second.batches.begin();
-             batch_it != material_it->second.batches.end(); ++batch_it) {
+void BufferManager::wait_for_copies(ContextPoolContext& context)
+{
+    // Copies are issued on context 0 so other contexts must wait on them
+    if (copy_fence != nullptr) {
+        context.gl->glWaitSync(copy_fence, 0, GL_TIMEOUT_IGNORED);
+    }
+}
+
+void BufferManager::release_copies(ContextPoolContext& context)
+{
+    if (copy_fence != nullptr) {
+        context.gl->glDeleteSync(copy_fence);
+        copy_fence = nullptr;
+    }
+}
+
+void UniformRing::create(ContextPoolContext& context, size_t slice_bytes, size_t alignment)
+{
+    this->alignment = alignment;
+    this->slice_bytes = align(slice_bytes, alignment);
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    size_t bytes = this->slice_bytes * StreamedBuffer::NUM_FRAMES;
+    context.gl->glGenBuffers(1, &buffer);
+    context.gl->glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    context.buffer(GL_COPY_WRITE_BUFFER, bytes, nullptr, flags);
+    data = (char*)context.gl->glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, bytes, flags);
+    if (data == nullptr) {
+        throw;
+    }
+}
+
+void UniformRing::begin_frame(ContextPoolContext& context, size_t frame_num)
+{
+    if (overflowed()) {
+        // Frames in flight keep the old storage alive until they finish
+        size_t required = std::max(pos, slice_bytes * 2);
+        context.gl->glDeleteBuffers(1, &buffer);
+        create(context, required, alignment);
+    }
+
+    slice = frame_num % StreamedBuffer::NUM_FRAMES;
+    pos = 0;
+}
+
+size_t UniformRing::write(const void* src, size_t size)
+{
+    size_t start = pos;
+    pos = align(pos + size, alignment);
+    if (start + size > slice_bytes) {
+        return NO_SPACE;
+    }
+
+    size_t offset = slice * slice_bytes + start;
+    memcpy(data + offset, src, size);
+    return offset;
+}
+
+static bool is_fragmented(StreamedBuffer& buffer)
+{
+    // Only worth compacting once a quarter of the used range is holes
+    size_t free_bytes = buffer.get_free_bytes();
+    return free_bytes * 4 >= buffer.current_pos && free_bytes > 0;
+}
+
+void OpenGLRenderer::compact_buffer(StreamedBuffer& buffer, std::vector<Relocation>& relocations, size_t& budget)
+{
+    if (budget == 0 || !is_fragmented(buffer)) {
+        return;
+    }
+
+    // Move the highest allocations down into holes, once their old ranges
+    // are reclaimed the linear region shrinks back over them.
+    std::sort(relocations.begin(), relocations.end(),
+              [](const Relocation& a, const Relocation& b) { return a.pos > b.pos; });
+
+    ScopedContext context(context_pool, 0);
+    const auto gl = context.context.gl;
+    bool moved = false;
+
+    gl->glBindBuffer(GL_COPY_READ_BUFFER, buffer.buffer);
+    gl->glBindBuffer(GL_COPY_WRITE_BUFFER, buffer.buffer);
+    for (auto it = relocations.begin(); it != relocations.end() && it->size <= budget;) {
+        // Draws sharing geometry share a range, it moves once for all of them
+        auto end = it + 1;
+        while (end != relocations.end() && end->pos == it->pos && end->size == it->size) {
+            ++end;
+        }
+
+        size_t new_pos = 0;
+        if (!buffer.allocate_free(it->size, new_pos)) {
+            break;
+        }
+
+        if (new_pos > it->pos) {
+            buffer.free(new_pos, it->size, true);
+            break;
+        }
 
-            if (batch_it->num_draws != 0) {
-                draws.free(batch_it->buffer_offset, batch_it->num_draws * batch_it->draw_stride);
-                batch_it->num_draws = 0;
+        gl->glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                                buffer.offset + it->pos, buffer.offset + new_pos, it->size);
+        buffer.free(it->pos, it->size);
+        budget -= it->size;
+        moved = true;
+
+        for (; it != end; ++it) {
+            if (it->index) {
+                it->batch->element_offset[it->draw] = new_pos / sizeof(int);
+            } else {
+                it->batch->vert_offset[it->draw] = new_pos / it->batch->format_stride;
             }
+            it->batch->mark_draw_updated(it->draw, true);
+        }
+    }
 
-            batch_it->buffer_offset = draws.allocate(batch_it->draw_stride * batch_it->draws.size());
+    if (moved) {
+        buffer_manager.fence_copies(context.context);
+    }
+}
 
-            for (auto draw_it = batch_it->draws.begin();
-                 draw_it != batch_it->draws.end(); ++draw_it) {
+void OpenGLRenderer::compact_buffers()
+{
+    bool fragmented = is_fragmented(get_index_buffer());
+    for (auto it = buffers.begin(); it != buffers.end(); ++it) {
+        fragmented |= is_fragmented(it->second);
+    }
 
-                // TODO check draw info pos
-                if (draw_it->num_instances > 0) {
-                    infos.free(draw_it->buffer_offset, draw_it->num_instances * sizeof(DrawInfoBuffer::DrawInfo));
-                    draw_it->num_instances = 0;
-                }
+    if (!fragmented) {
+        return;
+    }
 
-                draw_it->buffer_offset = infos.allocate(draw_it->instances.size() * sizeof(DrawInfoBuffer::DrawInfo));
+    std::map<VertexFormat, std::vector<Relocation>> vertex_relocations;
+    std::vector<Relocation> index_relocations;
+    for (auto material_it = materials.begin(); material_it != materials.end(); ++material_it) {
+        for (auto batch_it = material_it->second.batches.begin();
+             batch_it != material_it->second.batches.end(); ++batch_it) {
+            for (size_t draw = 0; draw < batch_it->get_num_draws(); ++draw) {
+                Relocation vertex = {&*batch_it, draw, batch_it->vert_offset[draw] * batch_it->format_stride,
+                                     batch_it->verts[draw] * batch_it->format_stride, false};
+                vertex_relocations[batch_it->format].push_back(vertex);
 
-                // Use same struct here but contents differ
-                DrawElementsIndirectCommand cmd;
                 if (batch_it->element_type != 0) {
-                    cmd = {draw_it->elements, draw_it->instances.size(),
-                           draw_it->element_offset, draw_it->vert_offset, draw_it->buffer_offset / sizeof(DrawInfoBuffer::DrawInfo)};
-                } else {
-                    cmd = {draw_it->verts, draw_it->instances.size(),
-                           draw_it->vert_offset, draw_it->buffer_offset / sizeof(DrawInfoBuffer::DrawInfo)};
+                    Relocation index = {&*batch_it, draw, batch_it->element_offset[draw] * sizeof(int),
+                                        batch_it->elements[draw] * sizeof(int), true};
+                    index_relocations.push_back(index);
                 }
+            }
+        }
+    }
+
+    size_t budget = compaction_budget;
+    for (auto it = vertex_relocations.begin(); it != vertex_relocations.end(); ++it) {
+        compact_buffer(get_buffer(it->first), it->second, budget);
+    }
+    compact_buffer(get_index_buffer(), index_relocations, budget);
+}
 
-                memcpy(draws.data + batch_it->buffer_offset
-                       + (batch_it->num_draws++ * batch_it->draw_stride),
-                       &cmd, batch_it->draw_stride);
+bool OpenGLRenderer::prepare_region(BufferUsage usage, StreamedBuffer& buffer, size_t size)
+{
+    ScopedSpinLock lock(buffers_lock);
+    if (buffer.buffer == 0) {
+        buffer_manager.create_region(usage, buffer, size);
+        return true;
+    }
 
-                for (auto instance_it = draw_it->instances.begin();
-                     instance_it != draw_it->instances.end(); ++instance_it) {
+    advance_buffer(buffer);
+    return false;
+}
 
-                    memcpy(infos.data + draw_it->buffer_offset
-                           + (draw_it->num_instances++ * sizeof(DrawInfoBuffer::DrawInfo)),
-                           &instance_it->draw_info, sizeof(DrawInfoBuffer::DrawInfo));
-                }
+PixelBuffer& OpenGLRenderer::get_pixel_buffer()
+{
+    // TODO convert to bindless textures
+    PixelBuffer& buffer = this->textures;
+    if (prepare_region(PIXEL_BUFFER_USAGE, buffer, 400 * 1024 * 1024)) {
+        buffer.relocated = [this](StreamedBuffer& moved) {
+            ScopedContext context(context_pool);
+            if (this->textures.texture == 0) {
+                context.context.gl->glGenTextures(1, &this->textures.texture);
             }
+            // Only region in its arena so it always starts at 0
+            context.context.gl->glBindTexture(GL_TEXTURE_BUFFER, this->textures.texture);
+            context.context.tex->glTexBufferARB(GL_TEXTURE_BUFFER, GL_RGBA8, moved.buffer);
+        };
+        buffer.relocated(buffer);
+    }
+    return buffer;
+}
+
+DrawInfoBuffer& OpenGLRenderer::get_draw_info_buffer()
+{
+    prepare_region(DRAW_INFO_BUFFER_USAGE, this->draw_info, 65536);
+    return this->draw_info;
+}
+
+ShaderBuffer& OpenGLRenderer::get_transform_buffer()
+{
+    // Storage buffer when supported, otherwise read through a buffer texture
+    ShaderBuffer& buffer = this->transform_buffer;
+    if (prepare_region(SHADER_BUFFER_USAGE, buffer, 65536)) {
+        ScopedContext context(context_pool, 0);
+        if (!context.context.has_storage_buffer) {
+            buffer.relocated = [this](StreamedBuffer& moved) {
+                ScopedContext context(context_pool);
+                if (this->transform_buffer.texture == 0) {
+                    context.context.gl->glGenTextures(1, &this->transform_buffer.texture);
+                }
+                // Only region in its arena so it always starts at 0
+                context.context.gl->glBindTexture(GL_TEXTURE_BUFFER, this->transform_buffer.texture);
+                context.context.tex->glTexBufferARB(GL_TEXTURE_BUFFER, GL_RGBA32F, moved.buffer);
+            };
+            buffer.relocated(buffer);
+        }
+    }
+    return buffer;
+}
+
+ShaderBuffer& OpenGLRenderer::get_parameter_buffer()
+{
+    prepare_region(PARAMETER_BUFFER_USAGE, this->parameters, 65536);
+    return this->parameters;
+}
+
+size_t OpenGLRenderer::add_parameters(const void* data, size_t size)
+{
+    // The hash only finds a candidate, the record is shared once its bytes match
+    ParameterKey key((const char*)data, size);
+    std::map<ParameterKey, size_t>::iterator it = parameter_cache.find(key);
+    if (it != parameter_cache.end()
+            && memcmp(parameter_records.data() + it->second * size, data, size) == 0) {
+        ++parameter_refs[it->second];
+        return it->second;
+    }
+
+    // Records are all one size, freed ones are handed out again once the
+    // frames that may still read them have finished
+    ShaderBuffer& buffer = get_parameter_buffer();
+    size_t index = buffer.allocate(size) / size;
+    if (index >= max_parameters) {
+        buffer.free(index * size, size);
+        return NO_PARAMETERS;
+    }
+
+    if (index >= parameter_refs.size()) {
+        parameter_refs.resize(index + 1, 0);
+        parameter_keys.resize(index + 1, key);
+        parameter_records.resize((index + 1) * size);
+    }
+    parameter_keys[index] = key;
+    memcpy(parameter_records.data() + index * size, data, size);
+
+    {
+        ScopedBufferWrite write(buffer);
+        memcpy(write.data + index * size, data, size);
+    }
+
+    // A record colliding with a cached one is used but not shared
+    parameter_refs[index] = 1;
+    if (it == parameter_cache.end()) {
+        parameter_cache[key] = index;
+    }
+    return index;
+}
+
+void OpenGLRenderer::release_parameters(size_t index)
+{
+    if (index >= parameter_refs.size() || parameter_refs[index] == 0) {
+        return;
+    }
+
+    if (--parameter_refs[index] == 0) {
+        const ParameterKey& key = parameter_keys[index];
+        std::map<ParameterKey, size_t>::iterator it = parameter_cache.find(key);
+        if (it != parameter_cache.end() && it->second == index) {
+            parameter_cache.erase(it);
         }
+        // Advanced first so the free is queued on this frame's fence
+        get_parameter_buffer().free(index * key.size, key.size);
     }
 }
 
-void DrawInstance::update(const DrawInfoBuffer::DrawInfo& draw_info)
+DrawBuffer& OpenGLRenderer::get_draw_buffer()
+{
+    prepare_region(DRAW_BUFFER_USAGE, this->draw_calls, 65536);
+    return this->draw_calls;
+}
+
+IndexBuffer& OpenGLRenderer::get_index_buffer()
 {
-    this->updated = true;
-    this->draw_info = draw_info;
+    prepare_region(INDEX_BUFFER_USAGE, this->indices, 1024 * 1024 * 20);
+    return this->indices;
 }
 
-void Draw::remove_instance(const DrawInstance& draw_id)
+VertexBuffer& OpenGLRenderer::get_buffer(const VertexFormat& format)
 {
-    this->updated = true;
-    this->instances.remove(draw_id);
+    ScopedSpinLock lock(buffers_lock);
+    VertexFormatBufferMap::iterator it = buffers.find(format);
+    if (it == buffers.end()) {
+        // Each format is a region of the shared vertex arena
+        VertexBuffer& buffer = buffers[format];
+        buffer_manager.create_region(VERTEX_BUFFER_USAGE, buffer, 1024 * 1024 * 4);
+        return buffer;
+    } else {
+        advance_buffer(it->second);
+        return it->second;
+    }
 }
 
-DrawInstance& Draw::add_instance(const DrawInfoBuffer::DrawInfo& draw_info)
+// Planes point inwards, not normalized as only the sign is tested
+static void get_frustum_planes(const glm::mat4x4& m, glm::vec4* planes)
 {
-    this->updated = true;
-    this->instances.push_back(DrawInstance(draw_info));
-    return this->instances.back();
+    glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+    glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+    glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+    glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+    planes[0] = row3 + row0;
+    planes[1] = row3 - row0;
+    planes[2] = row3 + row1;
+    planes[3] = row3 - row1;
+    planes[4] = row3 + row2;
+    planes[5] = row3 - row2;
 }
 
-void DrawBatch::remove_draw(const Draw& draw_id)
+static void write_draw_command(char* data, const DrawBatch& batch, size_t draw)
 {
-    this->updated = true;
-    this->draws.remove(draw_id);
+    // Use same struct here but contents differ
+    DrawElementsIndirectCommand cmd;
+    if (batch.element_type != 0) {
+        cmd = {batch.elements[draw], batch.visible[draw] ? batch.num_instances[draw] : 0,
+               batch.element_offset[draw], batch.vert_offset[draw],
+               batch.info_offset[draw] / sizeof(DrawInfoBuffer::DrawInfo)};
+    } else {
+        cmd = {batch.verts[draw], batch.visible[draw] ? batch.num_instances[draw] : 0,
+               batch.vert_offset[draw], batch.info_offset[draw] / sizeof(DrawInfoBuffer::DrawInfo)};
+    }
+
+    memcpy(data + batch.buffer_offset + (draw * batch.draw_stride), &cmd, batch.draw_stride);
 }
 
-Draw& DrawBatch::add_draw(size_t verts, size_t elements, size_t vert_offset, size_t element_offset)
+// Frames in flight may still read the old range so it is freed with the
+// frame and the commands go to a new one.
+static void write_draw_commands(DrawBuffer& draws, DrawBatch& batch)
 {
-    this->updated = true;
-    this->draws.push_back(Draw(verts, elements, vert_offset, element_offset));
-    return this->draws.back();
+    if (batch.num_draws != 0) {
+        draws.free(batch.buffer_offset, batch.num_draws * batch.draw_stride);
+    }
+
+    batch.num_draws = batch.get_num_draws();
+    batch.buffer_offset = draws.allocate(batch.draw_stride * batch.num_draws);
+
+    ScopedBufferWrite write(draws);
+    for (size_t draw = 0; draw < batch.get_num_draws(); ++draw) {
+        write_draw_command(write.data, batch, draw);
+    }
+}
+
+void OpenGLRenderer::write_batches()
+{
+    compact_buffers();
+
+    DrawBuffer& draws = get_draw_buffer();
+    DrawInfoBuffer& infos = get_draw_info_buffer();
+
+    // Only batches with changes cascaded up are touched, clean ones keep
+    // last frame's commands and draw info. Nothing is patched in place,
+    // changed draw info and commands are written to new ranges.
+    for (auto material_it = materials.begin();
+         material_it != materials.end(); ++material_it) {
+
+        if (!material_it->second.updated) {
+            continue;
+        }
+        material_it->second.updated = false;
+
+        for (auto batch_it = material_it->second.batches.begin();
+             batch_it != material_it->second.batches.end(); ++batch_it) {
+
+            DrawBatch& batch = *batch_it;
+            if (!batch.updated && !batch.draws_updated) {
+                continue;
+            }
+
+            for (auto freed_it = batch.freed_info.begin(); freed_it != batch.freed_info.end(); ++freed_it) {
+                infos.free(freed_it->first, freed_it->second * sizeof(DrawInfoBuffer::DrawInfo));
+            }
+            batch.freed_info.clear();
+
+            bool rewrite_commands = batch.updated;
+            for (size_t draw = 0; draw < batch.get_num_draws(); ++draw) {
+                if (!batch.draw_updated[draw] && !batch.instances_updated[draw]) {
+                    continue;
+                }
+
+                DrawBatch::Instances& instances = batch.instances[draw];
+                size_t num_instances = instances.draw_info.size();
+                if (batch.num_instances[draw] > 0) {
+                    infos.free(batch.info_offset[draw], batch.num_instances[draw] * sizeof(DrawInfoBuffer::DrawInfo));
+                }
+
+                batch.num_instances[draw] = num_instances;
+                batch.info_offset[draw] = infos.allocate(num_instances * sizeof(DrawInfoBuffer::DrawInfo));
+                {
+                    ScopedBufferWrite write(infos);
+                    memcpy(write.data + batch.info_offset[draw], instances.draw_info.data(),
+                           num_instances * sizeof(DrawInfoBuffer::DrawInfo));
+                }
+                std::fill(instances.updated.begin(), instances.updated.end(), false);
+                for (size_t i = 0; i < instances.slots.size(); ++i) {
+                    draw_pool.mark_changed(instances.slots[i]);
+                }
+
+                // Commands point at the new draw info
+                rewrite_commands = true;
+                batch.draw_updated[draw] = false;
+                batch.instances_updated[draw] = false;
+            }
+
+            if (rewrite_commands) {
+                write_draw_commands(draws, batch);
+                for (size_t draw = 0; draw < batch.slots.size(); ++draw) {
+                    draw_pool.mark_changed(batch.slots[draw]);
+                }
+            }
+
+            batch.updated = false;
+            batch.draws_updated = false;
+        }
+    }
+
+    cull_draws();
+}
+
+void OpenGLRenderer::cull_draws()
+{
+    // The GPU builds its own commands, results stay there
+    culling_stats = CullingStats();
+    if (compute_culling.enabled && compute_culling.program != 0) {
+        return;
+    }
+
+    glm::mat4x4 view_projections[2];
+    size_t num_views = 0;
+    if (frustum_culling) {
+        if (active_viewpoint.left.enabled) {
+            view_projections[num_views++] = active_viewpoint.left.view_projection;
+        }
+        if (active_viewpoint.right.enabled) {
+            view_projections[num_views++] = active_viewpoint.right.view_projection;
+        }
+    }
+
+    draw_pool.cull(view_projections, num_views);
+
+    // Draws are culled once every instance is out of view, a batch whose
+    // visibility changed gets its commands rewritten to a new range.
+    DrawBuffer& draws = get_draw_buffer();
+    for (auto material_it = materials.begin(); material_it != materials.end(); ++material_it) {
+        for (auto batch_it = material_it->second.batches.begin();
+             batch_it != material_it->second.batches.end(); ++batch_it) {
+
+            DrawBatch& batch = *batch_it;
+            bool changed = false;
+            for (size_t draw = 0; draw < batch.get_num_draws(); ++draw) {
+                const DrawBatch::Instances& instances = batch.instances[draw];
+                size_t num_visible = 0;
+                for (size_t instance = 0; instance < instances.slots.size(); ++instance) {
+                    num_visible += draw_pool.is_visible(instances.slots[instance]);
+                }
+
+                culling_stats.visible_instances += num_visible;
+                culling_stats.culled_instances += instances.slots.size() - num_visible;
+
+                bool visible = num_visible > 0;
+                if (visible) {
+                    ++culling_stats.visible_draws;
+                } else {
+                    ++culling_stats.culled_draws;
+                }
+
+                if (batch.visible[draw] != visible) {
+                    batch.visible[draw] = visible;
+                    changed = true;
+                }
+            }
+
+            if (changed) {
+                write_draw_commands(draws, batch);
+            }
+        }
+    }
+}
+
+// Draws and instances of the slot as cull.comp reads them, slots not yet
+// written by write_batches are left empty until it marks them
+static void get_cull_entries(const DrawPool& pool, uint32_t slot, CullInstance& instance, CullDraw& draw)
+{
+    instance = CullInstance();
+    instance.draw = CullInstance::NONE;
+    draw = CullDraw();
+
+    const DrawBatch* batch;
+    uint32_t index, instance_index;
+    if (!pool.get_slot_info(slot, batch, index, instance_index) || index >= (uint32_t)batch->num_draws) {
+        return;
+    }
+
+    uint32_t info_first = batch->info_offset[index] / sizeof(DrawInfoBuffer::DrawInfo);
+    if (instance_index == DrawPool::NONE) {
+        bool elements = batch->element_type != 0;
+        draw.count = elements ? batch->elements[index] : batch->verts[index];
+        draw.first = elements ? batch->element_offset[index] : batch->vert_offset[index];
+        draw.base_vertex = batch->vert_offset[index];
+        draw.info_first = info_first;
+        draw.stride = batch->draw_stride / sizeof(uint32_t);
+        draw.command = (batch->buffer_offset + index * batch->draw_stride) / sizeof(uint32_t);
+        draw.batch = batch->cull_index;
+        draw.batch_command = batch->buffer_offset / sizeof(uint32_t);
+    } else if (instance_index < batch->num_instances[index]) {
+        instance.draw = batch->slots[index];
+        instance.info = info_first + instance_index;
+        instance.bounded = pool.get_bounds(slot, instance.center, instance.extent);
+    }
+}
+
+// Entries are indexed by slot, only changed slots are uploaded unless the
+// buffers have to grow
+void OpenGLRenderer::update_culling_buffers(ContextPoolContext& context)
+{
+    const auto gl = context.gl;
+    ComputeCulling& culling = compute_culling;
+
+    // Draws of a batch that moved in the draw counts point at its new place
+    uint32_t num_batches = 0;
+    for (auto material_it = materials.begin(); material_it != materials.end(); ++material_it) {
+        for (auto batch_it = material_it->second.batches.begin();
+             batch_it != material_it->second.batches.end(); ++batch_it, ++num_batches) {
+
+            DrawBatch& batch = *batch_it;
+            if (batch.cull_index != (int)num_batches) {
+                batch.cull_index = num_batches;
+                for (size_t draw = 0; draw < batch.slots.size(); ++draw) {
+                    draw_pool.mark_changed(batch.slots[draw]);
+                }
+            }
+        }
+    }
+
+    std::vector<uint32_t>& changed = culling.changed;
+    draw_pool.take_changed(changed);
+
+    if (culling.instances == 0) {
+        gl->glGenBuffers(1, &culling.instances);
+        gl->glGenBuffers(1, &culling.draws);
+        gl->glGenBuffers(1, &culling.visibility);
+        gl->glGenBuffers(StreamedBuffer::NUM_FRAMES, culling.culled_commands);
+        gl->glGenBuffers(StreamedBuffer::NUM_FRAMES, culling.culled_info);
+        gl->glGenBuffers(StreamedBuffer::NUM_FRAMES, culling.draw_counts);
+    }
+
+    size_t num_slots = draw_pool.get_num_slots();
+    if (culling.updated || culling.capacity < num_slots) {
+        size_t capacity = std::max<size_t>(culling.capacity, 1024);
+        while (capacity < num_slots) {
+            capacity *= 2;
+        }
+
+        culling.instance_data.resize(capacity);
+        culling.draw_data.resize(capacity);
+        for (uint32_t slot = 0; slot < capacity; ++slot) {
+            get_cull_entries(draw_pool, slot, culling.instance_data[slot], culling.draw_data[slot]);
+        }
+
+        // Buffers are orphaned, the previous contents may still be in use
+        gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.instances);
+        gl->glBufferData(GL_SHADER_STORAGE_BUFFER, capacity * sizeof(CullInstance),
+                         culling.instance_data.data(), GL_DYNAMIC_DRAW);
+        gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.draws);
+        gl->glBufferData(GL_SHADER_STORAGE_BUFFER, capacity * sizeof(CullDraw),
+                         culling.draw_data.data(), GL_DYNAMIC_DRAW);
+        gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.visibility);
+        gl->glBufferData(GL_SHADER_STORAGE_BUFFER, capacity * sizeof(uint32_t), nullptr, GL_DYNAMIC_COPY);
+
+        culling.capacity = capacity;
+        culling.updated = false;
+    } else if (!changed.empty()) {
+        std::sort(changed.begin(), changed.end());
+        for (size_t i = 0; i < changed.size(); ++i) {
+            get_cull_entries(draw_pool, changed[i], culling.instance_data[changed[i]],
+                             culling.draw_data[changed[i]]);
+        }
+
+        // Runs of neighbouring slots go up together
+        for (size_t i = 0; i < changed.size();) {
+            uint32_t first = changed[i];
+            uint32_t last = first;
+            while (++i < changed.size() && changed[i] == last + 1) {
+                last = changed[i];
+            }
+
+            size_t count = last - first + 1;
+            gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.instances);
+            gl->glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(CullInstance), count * sizeof(CullInstance),
+                                &culling.instance_data[first]);
+            gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.draws);
+            gl->glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(CullDraw), count * sizeof(CullDraw),
+                                &culling.draw_data[first]);
+        }
+    }
+    changed.clear();
+
+    // Culled copies mirror the layout of the draw and draw info buffers
+    size_t command_bytes = draw_calls.max_bytes;
+    size_t info_bytes = draw_info.max_bytes;
+    for (size_t i = 0; i < StreamedBuffer::NUM_FRAMES; ++i) {
+        if (culling.command_bytes != command_bytes) {
+            gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.culled_commands[i]);
+            gl->glBufferData(GL_SHADER_STORAGE_BUFFER, command_bytes, nullptr, GL_DYNAMIC_COPY);
+        }
+        if (culling.info_bytes != info_bytes) {
+            gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.culled_info[i]);
+            gl->glBufferData(GL_SHADER_STORAGE_BUFFER, info_bytes, nullptr, GL_DYNAMIC_COPY);
+        }
+        if (culling.num_batches != num_batches) {
+            gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.draw_counts[i]);
+            gl->glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<uint32_t>(num_batches, 1) * sizeof(uint32_t),
+                             nullptr, GL_DYNAMIC_COPY);
+        }
+    }
+
+    // Late commands are never compacted, every draw keeps its place
+    OcclusionCulling& occlusion = occlusion_culling;
+    if (occlusion.enabled) {
+        if (occlusion.occluded == 0) {
+            gl->glGenBuffers(1, &occlusion.occluded);
+            gl->glGenBuffers(OcclusionCulling::NUM_EYES, occlusion.late_visibility);
+            gl->glGenBuffers(OcclusionCulling::NUM_EYES, occlusion.late_commands);
+            gl->glGenBuffers(OcclusionCulling::NUM_EYES, occlusion.late_info);
+        }
+        if (occlusion.capacity != culling.capacity) {
+            gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion.occluded);
+            gl->glBufferData(GL_SHADER_STORAGE_BUFFER, culling.capacity * sizeof(uint32_t), nullptr, GL_DYNAMIC_COPY);
+        }
+        for (size_t i = 0; i < OcclusionCulling::NUM_EYES; ++i) {
+            if (occlusion.capacity != culling.capacity) {
+                gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion.late_visibility[i]);
+                gl->glBufferData(GL_SHADER_STORAGE_BUFFER, culling.capacity * sizeof(uint32_t),
+                                 nullptr, GL_DYNAMIC_COPY);
+            }
+            if (occlusion.command_bytes != command_bytes) {
+                gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion.late_commands[i]);
+                gl->glBufferData(GL_SHADER_STORAGE_BUFFER, command_bytes, nullptr, GL_DYNAMIC_COPY);
+            }
+            if (occlusion.info_bytes != info_bytes) {
+                gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion.late_info[i]);
+                gl->glBufferData(GL_SHADER_STORAGE_BUFFER, info_bytes, nullptr, GL_DYNAMIC_COPY);
+            }
+        }
+        occlusion.capacity = culling.capacity;
+        occlusion.command_bytes = command_bytes;
+        occlusion.info_bytes = info_bytes;
+    }
+
+    culling.command_bytes = command_bytes;
+    culling.info_bytes = info_bytes;
+    culling.num_slots = num_slots;
+    culling.num_batches = num_batches;
+}
+
+bool OpenGLRenderer::dispatch_culling(ContextPoolContext& context)
+{
+    const auto gl = context.gl;
+    ComputeCulling& culling = compute_culling;
+
+    culling.active = false;
+    occlusion_culling.active = false;
+    if (!culling.enabled) {
+        return false;
+    }
+
+    if (culling.program == 0) {
+        if (!context.has_compute) {
+            // Fall back to culling on the CPU
+            culling.enabled = false;
+            return false;
+        }
+
+        culling.program = get_shader_program(GL_COMPUTE_SHADER, ":/shaders/cull.comp");
+        GLint linked = GL_FALSE;
+        gl->glGetProgramiv(culling.program, GL_LINK_STATUS, &linked);
+        if (linked != GL_TRUE) {
+            culling.program = 0;
+            culling.enabled = false;
+            return false;
+        }
+        culling.updated = true;
+    }
+
+    update_culling_buffers(context);
+    if (culling.num_slots == 0) {
+        return false;
+    }
+
+    glm::vec4 planes[12];
+    GLuint num_views = 0;
+    if (frustum_culling) {
+        if (active_viewpoint.left.enabled) {
+            get_frustum_planes(active_viewpoint.left.view_projection, &planes[num_views++ * 6]);
+        }
+        if (active_viewpoint.right.enabled) {
+            get_frustum_planes(active_viewpoint.right.view_projection, &planes[num_views++ * 6]);
+        }
+    }
+
+    // Earlier frames using this slot's commands must be done before rewriting
+    GLsync* fences = frame_fences[frame_num];
+    for (size_t i = 0; i < MAX_RENDER_CONTEXTS; ++i) {
+        if (fences[i] != nullptr) {
+            gl->glWaitSync(fences[i], 0, GL_TIMEOUT_IGNORED);
+        }
+    }
+
+    culling.compact = context.has_indirect_parameters;
+    GLuint zero = 0;
+    gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.visibility);
+    context.compute.glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.draw_counts[frame_num]);
+    context.compute.glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, culling.instances);
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, culling.draws);
+    gl->glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, draw_info.buffer, draw_info.offset, draw_info.max_bytes);
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, culling.culled_commands[frame_num]);
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, culling.visibility);
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, culling.draw_counts[frame_num]);
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, culling.culled_info[frame_num]);
+
+    // Pyramids are tested with the view they were built from, anything that
+    // has come into view since is left to the late pass
+    OcclusionCulling& occlusion = occlusion_culling;
+    const RenderOuputGroup* eyes[] = {&active_viewpoint.left, &active_viewpoint.right};
+    GLint hiz_sizes[OcclusionCulling::NUM_EYES * 3];
+    GLuint hiz_views = 0;
+    for (size_t i = 0; i < OcclusionCulling::NUM_EYES; ++i) {
+        if (occlusion.ready[i] != nullptr) {
+            gl->glWaitSync(occlusion.ready[i], 0, GL_TIMEOUT_IGNORED);
+            gl->glDeleteSync(occlusion.ready[i]);
+            occlusion.ready[i] = nullptr;
+        }
+
+        hiz_sizes[i * 3] = occlusion.width[i];
+        hiz_sizes[i * 3 + 1] = occlusion.height[i];
+        hiz_sizes[i * 3 + 2] = occlusion.levels[i];
+        if (occlusion.enabled && occlusion.occluded != 0 && occlusion.valid[i] && eyes[i]->enabled) {
+            hiz_views |= 1 << i;
+            gl->glActiveTexture(GL_TEXTURE0 + OcclusionCulling::TEXTURE_UNIT + i);
+            gl->glBindTexture(GL_TEXTURE_2D, occlusion.pyramid[i]);
+        }
+    }
+    if (hiz_views != 0) {
+        gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, occlusion.occluded);
+    }
+
+    gl->glUseProgram(culling.program);
+    context.sso->glProgramUniform4fv(culling.program, 0, 12, &planes[0][0]);
+    context.sso->glProgramUniform1ui(culling.program, 12, num_views);
+    context.sso->glProgramUniform1i(culling.program, 15, culling.compact);
+    context.sso->glProgramUniformMatrix4fv(culling.program, 16, OcclusionCulling::NUM_EYES, GL_FALSE,
+                                           &occlusion.view_projection[0][0][0]);
+    context.sso->glProgramUniform3iv(culling.program, 18, OcclusionCulling::NUM_EYES, hiz_sizes);
+    context.sso->glProgramUniform1ui(culling.program, 20, hiz_views);
+
+    // Visible instances append their draw info to their draw, then every
+    // draw's command is built from its count
+    context.sso->glProgramUniform1ui(culling.program, 13, culling.num_slots);
+    context.sso->glProgramUniform1ui(culling.program, 14, 0);
+    context.compute.glDispatchCompute((culling.num_slots + 63) / 64, 1, 1);
+    context.compute.glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    context.sso->glProgramUniform1ui(culling.program, 14, 1);
+    context.compute.glDispatchCompute((culling.num_slots + 63) / 64, 1, 1);
+    context.compute.glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    gl->glUseProgram(0);
+
+    culling.active = true;
+    occlusion.active = hiz_views != 0;
+    return true;
+}
+
+void OpenGLRenderer::build_depth_pyramid(ContextPoolContext& context, const RenderOuputGroup& output, size_t eye)
+{
+    const auto gl = context.gl;
+    OcclusionCulling& occlusion = occlusion_culling;
+    const RenderTarget& target = output.g_buffer;
+
+    // Only GPU culling reads the pyramids
+    if (!compute_culling.active || !target.use_depth || target.width == 0 || target.height == 0) {
+        return;
+    }
+
+    if (occlusion.program == 0) {
+        if (!context.has_compute || context.compute.glBindImageTexture == nullptr) {
+            occlusion.enabled = false;
+            return;
+        }
+
+        occlusion.program = get_shader_program(GL_COMPUTE_SHADER, ":/shaders/hiz.comp");
+        GLint linked = GL_FALSE;
+        gl->glGetProgramiv(occlusion.program, GL_LINK_STATUS, &linked);
+        if (linked != GL_TRUE) {
+            occlusion.program = 0;
+            occlusion.enabled = false;
+            return;
+        }
+    }
+
+    // Levels halve down to a single texel, each holding the farthest depth below it
+    size_t width = std::max<size_t>(target.width / 2, 1);
+    size_t height = std::max<size_t>(target.height / 2, 1);
+    if (occlusion.pyramid[eye] == 0 || occlusion.width[eye] != width || occlusion.height[eye] != height) {
+        if (occlusion.pyramid[eye] == 0) {
+            gl->glGenTextures(1, &occlusion.pyramid[eye]);
+        }
+
+        size_t levels = 1;
+        while ((std::max(width, height) >> levels) > 0) {
+            ++levels;
+        }
+
+        gl->glBindTexture(GL_TEXTURE_2D, occlusion.pyramid[eye]);
+        for (size_t level = 0; level < levels; ++level) {
+            gl->glTexImage2D(GL_TEXTURE_2D, level, GL_R32F, std::max<size_t>(width >> level, 1),
+                             std::max<size_t>(height >> level, 1), 0, GL_RED, GL_FLOAT, NULL);
+        }
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+
+        occlusion.width[eye] = width;
+        occlusion.height[eye] = height;
+        occlusion.levels[eye] = levels;
+    }
+
+    // Read as plain depth, the full layout's lighting compares against it
+    gl->glActiveTexture(GL_TEXTURE0 + RenderTarget::DEPTH_UNIT);
+    gl->glBindTexture(GL_TEXTURE_2D, target.depth);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+
+    gl->glUseProgram(occlusion.program);
+    for (size_t level = 0; level < occlusion.levels[eye]; ++level) {
+        GLint source_width = level == 0 ? target.width : std::max<size_t>(width >> (level - 1), 1);
+        GLint source_height = level == 0 ? target.height : std::max<size_t>(height >> (level - 1), 1);
+        GLint level_width = std::max<size_t>(width >> level, 1);
+        GLint level_height = std::max<size_t>(height >> level, 1);
+
+        if (level > 0) {
+            context.compute.glBindImageTexture(0, occlusion.pyramid[eye], level - 1, GL_FALSE, 0,
+                                               GL_READ_ONLY, GL_R32F);
+        }
+        context.compute.glBindImageTexture(1, occlusion.pyramid[eye], level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        context.sso->glProgramUniform2i(occlusion.program, 0, source_width, source_height);
+        context.sso->glProgramUniform2i(occlusion.program, 1, level_width, level_height);
+        context.sso->glProgramUniform1i(occlusion.program, 2, level == 0);
+        context.compute.glDispatchCompute((level_width + 7) / 8, (level_height + 7) / 8, 1);
+        context.compute.glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+    context.compute.glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    gl->glUseProgram(0);
+
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE,
+                        target.layout == RenderTarget::COMPACT_G_BUFFER ? GL_NONE : GL_COMPARE_R_TO_TEXTURE);
+
+    occlusion.view_projection[eye] = output.view_projection;
+    occlusion.valid[eye] = true;
+    if (occlusion.ready[eye] != nullptr) {
+        gl->glDeleteSync(occlusion.ready[eye]);
+    }
+    occlusion.ready[eye] = gl->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+bool OpenGLRenderer::dispatch_late_culling(ContextPoolContext& context, const RenderOuputGroup& output, size_t eye)
+{
+    const auto gl = context.gl;
+    const ComputeCulling& culling = compute_culling;
+    const OcclusionCulling& occlusion = occlusion_culling;
+
+    if (!occlusion.active || !occlusion.valid[eye] || culling.num_slots == 0) {
+        return false;
+    }
+
+    glm::vec4 planes[6];
+    GLuint num_views = 0;
+    if (frustum_culling) {
+        get_frustum_planes(output.view_projection, planes);
+        num_views = 1;
+    }
+
+    GLuint zero = 0;
+    gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion.late_visibility[eye]);
+    context.compute.glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, culling.instances);
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, culling.draws);
+    gl->glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, draw_info.buffer, draw_info.offset, draw_info.max_bytes);
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, occlusion.late_commands[eye]);
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, occlusion.occluded);
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, occlusion.late_visibility[eye]);
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, occlusion.late_info[eye]);
+    gl->glActiveTexture(GL_TEXTURE0 + OcclusionCulling::TEXTURE_UNIT + eye);
+    gl->glBindTexture(GL_TEXTURE_2D, occlusion.pyramid[eye]);
+
+    // This frame's view against the pyramid of this frame's early depth
+    GLint hiz_size[] = {(GLint)occlusion.width[eye], (GLint)occlusion.height[eye], (GLint)occlusion.levels[eye]};
+    gl->glUseProgram(culling.program);
+    context.sso->glProgramUniform4fv(culling.program, 0, 6, &planes[0][0]);
+    context.sso->glProgramUniform1ui(culling.program, 12, num_views);
+    context.sso->glProgramUniform1i(culling.program, 15, GL_FALSE);
+    context.sso->glProgramUniformMatrix4fv(culling.program, 16 + eye, 1, GL_FALSE, &output.view_projection[0][0]);
+    context.sso->glProgramUniform3iv(culling.program, 18 + eye, 1, hiz_size);
+    context.sso->glProgramUniform1ui(culling.program, 20, 1 << eye);
+
+    // Only the instances hidden early but in view now are drawn late
+    context.sso->glProgramUniform1ui(culling.program, 13, culling.num_slots);
+    context.sso->glProgramUniform1ui(culling.program, 14, 2);
+    context.compute.glDispatchCompute((culling.num_slots + 63) / 64, 1, 1);
+    context.compute.glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    context.sso->glProgramUniform1ui(culling.program, 14, 3);
+    context.compute.glDispatchCompute((culling.num_slots + 63) / 64, 1, 1);
+    context.compute.glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    gl->glUseProgram(0);
+    return true;
+}
+
+void OpenGLRenderer::set_occlusion_pass(ContextPoolContext& context, const ShaderPass& pass, int late)
+{
+    // Only the debug view reads it, few materials declare it so it is looked up by name
+    if (render_type != OcclusionCulling::RENDER_TYPE) {
+        return;
+    }
+
+    for (auto it = materials.begin(); it != materials.end(); ++it) {
+        const Material& material = it->second;
+        if (material.pass != pass.pass_id || material.batch_material != nullptr || material.frag == 0) {
+            continue;
+        }
+
+        GLint location = context.gl->glGetUniformLocation(material.frag, "occlusion_pass");
+        if (location >= 0) {
+            context.sso->glProgramUniform1i(material.frag, location, late);
+        }
+    }
+}
+
+void OpenGLRenderer::prepare_tiled_lighting(ContextPoolContext& context)
+{
+    TiledLighting& tiled = tiled_lighting;
+
+    tiled.active = false;
+    if (!tiled.enabled || tiled.first_pass < 0) {
+        return;
+    }
+
+    if (tiled.program == 0) {
+        if (!context.has_compute || context.compute.glBindImageTexture == nullptr) {
+            // Fall back to the pass's own draws
+            tiled.enabled = false;
+            return;
+        }
+
+        tiled.program = get_shader_program(GL_COMPUTE_SHADER, ":/shaders/tiled-light.comp");
+        GLint linked = GL_FALSE;
+        context.gl->glGetProgramiv(tiled.program, GL_LINK_STATUS, &linked);
+        if (linked != GL_TRUE) {
+            tiled.program = 0;
+            tiled.enabled = false;
+            return;
+        }
+    }
+
+    tiled.active = true;
+}
+
+void OpenGLRenderer::dispatch_tiled_lighting(ContextPoolContext& context, const ShaderPass& pass,
+                                             const RenderOuputGroup& output)
+{
+    const auto gl = context.gl;
+    const TiledLighting& tiled = tiled_lighting;
+
+    const RenderTarget& in_target = output.get_render_target(pass.in);
+    for (size_t i = 1; i <= in_target.num_attachments; ++i) {
+        gl->glActiveTexture(GL_TEXTURE0 + i);
+        gl->glBindTexture(GL_TEXTURE_2D, in_target.attachments[i - 1]);
+    }
+    if (in_target.use_depth) {
+        gl->glActiveTexture(GL_TEXTURE0 + RenderTarget::DEPTH_UNIT);
+        gl->glBindTexture(GL_TEXTURE_2D, in_target.depth);
+    }
+
+    // Every pixel is written so the target is never cleared
+    const RenderTarget& target = output.get_render_target(pass.out);
+    context.compute.glBindImageTexture(0, target.attachments[0], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+
+    GLuint num_lights = 0;
+    if (tiled.lights != nullptr && tiled.record_size != 0 && !tiled.lights->frag_params.empty()) {
+        num_lights = std::min(tiled.lights->frag_params.size() / tiled.record_size, TiledLighting::MAX_LIGHTS);
+        gl->glBindBufferRange(GL_UNIFORM_BUFFER, 3, uniforms.buffer, tiled.lights->frag_offset,
+                              tiled.lights->frag_params.size());
+    }
+
+    gl->glUseProgram(tiled.program);
+    context.sso->glProgramUniform1ui(tiled.program, 0, num_lights);
+    context.compute.glDispatchCompute((target.width + TiledLighting::TILE_SIZE - 1) / TiledLighting::TILE_SIZE,
+                                      (target.height + TiledLighting::TILE_SIZE - 1) / TiledLighting::TILE_SIZE, 1);
+    context.compute.glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+    gl->glUseProgram(0);
+}
+
+bool OpenGLRenderer::begin_lighting_timer(ContextPoolContext& context, int context_id)
+{
+    if (!context.has_timer_query) {
+        return false;
+    }
+
+    // Queries aren't shared, each context times with its own
+    const auto gl = context.gl;
+    GLuint& query = lighting_queries[frame_num][context_id];
+    if (query == 0) {
+        gl->glGenQueries(1, &query);
+    } else {
+        // Issued a whole ring of frames ago, read only once it has landed
+        GLuint available = GL_FALSE;
+        gl->glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available == GL_TRUE) {
+            GLuint elapsed = 0;
+            gl->glGetQueryObjectuiv(query, GL_QUERY_RESULT, &elapsed);
+            ++lighting_stats.frames;
+            lighting_stats.gpu_time_ns += elapsed;
+            lighting_stats.max_gpu_time_ns = std::max<uint64_t>(lighting_stats.max_gpu_time_ns, elapsed);
+        }
+    }
+
+    gl->glBeginQuery(GL_TIME_ELAPSED, query);
+    return true;
+}
+
+static inline int bit_scan_forward(uint64_t word)
+{
+    return __builtin_ctzll(word);
+}
+
+static inline int bit_scan_reverse(uint64_t word)
+{
+    return 63 - __builtin_clzll(word);
+}
+
+// Size class a free block of this size is filed under.
+static inline void tlsf_mapping(size_t size, int& fl, int& sl, int sl_log2)
+{
+    if (size < ((size_t)1 << sl_log2)) {
+        fl = 0;
+        sl = (int)size;
+    } else {
+        int bit = bit_scan_reverse(size);
+        sl = (int)(size >> (bit - sl_log2)) ^ (1 << sl_log2);
+        fl = bit - sl_log2 + 1;
+    }
+}
+
+StreamedBuffer::StreamedBuffer() : free_bytes(0), fl_bitmap(0), resizing(false), writers(0), buffer(0), offset(0),
+    max_bytes(0), current_pos(0), frame_num(0), data(nullptr), parent(nullptr)
+{
+    for (int fl = 0; fl < FL_COUNT; ++fl) {
+        sl_bitmap[fl] = 0;
+        for (int sl = 0; sl < SL_COUNT; ++sl) {
+            free_heads[fl][sl] = NO_BLOCK;
+        }
+    }
+}
+
+size_t StreamedBuffer::get_free_bytes()
+{
+    ScopedSpinLock lock(index_lock);
+    return free_bytes;
+}
+
+StreamedBuffer::ThreadCache& StreamedBuffer::get_cache()
+{
+    return caches[std::hash<std::thread::id>()(std::this_thread::get_id()) % NUM_CACHES];
+}
+
+void StreamedBuffer::link_free(size_t start, size_t size)
+{
+    uint32_t id;
+    if (!unused_blocks.empty()) {
+        id = unused_blocks.back();
+        unused_blocks.pop_back();
+    } else {
+        id = blocks.size();
+        blocks.push_back(Block());
+    }
+
+    int fl, sl;
+    tlsf_mapping(size, fl, sl, SL_LOG2);
+
+    Block& block = blocks[id];
+    block.start = start;
+    block.size = size;
+    block.prev_free = NO_BLOCK;
+    block.next_free = free_heads[fl][sl];
+    if (block.next_free != NO_BLOCK) {
+        blocks[block.next_free].prev_free = id;
+    }
+
+    free_heads[fl][sl] = id;
+    fl_bitmap |= (uint64_t)1 << fl;
+    sl_bitmap[fl] |= 1u << sl;
+
+    blocks_by_start[start] = id;
+    blocks_by_end[start + size] = id;
+    free_bytes += size;
+}
+
+void StreamedBuffer::remove_free(uint32_t id)
+{
+    Block& block = blocks[id];
+
+    int fl, sl;
+    tlsf_mapping(block.size, fl, sl, SL_LOG2);
+
+    if (block.prev_free != NO_BLOCK) {
+        blocks[block.prev_free].next_free = block.next_free;
+    } else {
+        free_heads[fl][sl] = block.next_free;
+        if (block.next_free == NO_BLOCK) {
+            sl_bitmap[fl] &= ~(1u << sl);
+            if (sl_bitmap[fl] == 0) {
+                fl_bitmap &= ~((uint64_t)1 << fl);
+            }
+        }
+    }
+
+    if (block.next_free != NO_BLOCK) {
+        blocks[block.next_free].prev_free = block.prev_free;
+    }
+
+    blocks_by_start.erase(block.start);
+    blocks_by_end.erase(block.start + block.size);
+    free_bytes -= block.size;
+    unused_blocks.push_back(id);
+}
+
+uint32_t StreamedBuffer::find_free(size_t size) const
+{
+    // Round up to the next size class so any block in the class found fits
+    if (size >= (size_t)SL_COUNT) {
+        size += ((size_t)1 << (bit_scan_reverse(size) - SL_LOG2)) - 1;
+    }
+
+    int fl, sl;
+    tlsf_mapping(size, fl, sl, SL_LOG2);
+    if (fl >= FL_COUNT) {
+        return NO_BLOCK;
+    }
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+    if (sl_map == 0) {
+        uint64_t fl_map = (fl + 1 < 64) ? fl_bitmap & (~(uint64_t)0 << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            return NO_BLOCK;
+        }
+
+        fl = bit_scan_forward(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+
+    return free_heads[fl][bit_scan_forward(sl_map)];
+}
+
+void StreamedBuffer::insert_free(size_t start, size_t size)
+{
+    size_t end = start + size;
+
+    // Coalesce with the free neighbours on either side
+    BlockMap::iterator prev = blocks_by_end.find(start);
+    if (prev != blocks_by_end.end()) {
+        uint32_t id = prev->second;
+        start = blocks[id].start;
+        remove_free(id);
+    }
+
+    BlockMap::iterator next = blocks_by_start.find(end);
+    if (next != blocks_by_start.end()) {
+        uint32_t id = next->second;
+        end = blocks[id].start + blocks[id].size;
+        remove_free(id);
+    }
+
+    // Hand the tail back to the linear region unless a bump raced past it
+    size_t tail = end;
+    if (this->current_pos.compare_exchange_strong(tail, start)) {
+        return;
+    }
+
+    link_free(start, end - start);
+}
+
+void StreamedBuffer::begin_write()
+{
+    // Growing the arena moves every region in it
+    if (parent != nullptr) {
+        parent->begin_write();
+    }
+
+    while (true) {
+        while (resizing.load()) {
+            std::this_thread::yield();
+        }
+
+        writers.fetch_add(1);
+        if (!resizing.load()) {
+            return;
+        }
+        writers.fetch_sub(1);
+    }
+}
+
+void StreamedBuffer::end_write()
+{
+    writers.fetch_sub(1);
+    if (parent != nullptr) {
+        parent->end_write();
+    }
+}
+
+bool StreamedBuffer::reserve(size_t bytes)
+{
+    if (bytes < this->max_bytes) {
+        return true;
+    }
+
+    ScopedSpinLock lock(grow_lock);
+    if (bytes < this->max_bytes) {
+        // Another thread already grew it
+        return true;
+    }
+
+    resizing.store(true);
+    while (writers.load() != 0) {
+        std::this_thread::yield();
+    }
+
+    bool grown = this->grow && this->grow(*this, bytes + 1);
+    resizing.store(false);
+    return grown;
+}
+
+bool StreamedBuffer::take_cached(size_t size, size_t& pos)
+{
+    ThreadCache& cache = get_cache();
+    ScopedSpinLock lock(cache.lock);
+
+    size_t best = CACHE_BLOCKS;
+    for (size_t i = 0; i < cache.num_blocks; ++i) {
+        size_t block_size = cache.blocks[i].end - cache.blocks[i].start;
+        if (block_size >= size && (best == CACHE_BLOCKS ||
+            block_size < cache.blocks[best].end - cache.blocks[best].start)) {
+            best = i;
+        }
+    }
+
+    if (best == CACHE_BLOCKS) {
+        return false;
+    }
+
+    Allocation& block = cache.blocks[best];
+    pos = block.start;
+    block.start += size;
+    if (block.start == block.end) {
+        block = cache.blocks[--cache.num_blocks];
+    }
+    return true;
+}
+
+bool StreamedBuffer::take_free(size_t size, size_t& pos)
+{
+    uint32_t id = find_free(size);
+    if (id == NO_BLOCK) {
+        return false;
+    }
+
+    Block block = blocks[id];
+    remove_free(id);
+    if (block.size > size) {
+        link_free(block.start + size, block.size - size);
+    }
+    pos = block.start;
+    return true;
+}
+
+bool StreamedBuffer::allocate_free(size_t size, size_t& pos)
+{
+    ScopedSpinLock lock(index_lock);
+    return take_free(size, pos);
+}
+
+size_t StreamedBuffer::allocate(size_t size)
+{
+    size_t pos = 0;
+    if (!try_allocate(size, pos)) {
+        throw;
+    }
+    return pos;
+}
+
+bool StreamedBuffer::try_allocate(size_t size, size_t& pos)
+{
+    if (size == 0) {
+        pos = this->current_pos;
+        return true;
+    }
+
+    if (take_cached(size, pos) || allocate_free(size, pos)) {
+        return true;
+    }
+
+    // Lock free bump of the linear region
+    pos = this->current_pos.load();
+    while (true) {
+        if (pos + size >= this->max_bytes) {
+            if (!reserve(pos + size)) {
+                return false;
+            }
+            pos = this->current_pos.load();
+        } else if (this->current_pos.compare_exchange_weak(pos, pos + size)) {
+            return true;
+        }
+    }
+}
+
+bool StreamedBuffer::extend(size_t pos, size_t old_size, size_t new_size)
+{
+    if (pos + old_size != this->current_pos || !reserve(pos + new_size)) {
+        return false;
+    }
+
+    size_t tail = pos + old_size;
+    return this->current_pos.compare_exchange_strong(tail, pos + new_size);
+}
+
+size_t StreamedBuffer::reallocate(size_t pos, size_t old_size, size_t new_size, bool append)
+{
+    if (append && extend(pos, old_size, new_size)) {
+        return pos;
+    }
+
+    size_t new_pos = 0;
+    if (!copy || !try_allocate(new_size, new_pos)) {
+        return NO_SPACE;
+    }
+
+    if (!copy(*this, pos, new_pos, std::min(old_size, new_size))) {
+        free(new_pos, new_size, true);
+        return NO_SPACE;
+    }
+    free(pos, old_size);
+
+    return new_pos;
+}
+
+void StreamedBuffer::free(size_t start, size_t size, bool safe)
+{
+    if (size == 0) {
+        return;
+    }
+
+    Allocation alloc;
+    alloc.start = start;
+    alloc.end = start + size;
+
+    {
+        ThreadCache& cache = get_cache();
+        ScopedSpinLock lock(cache.lock);
+        if (!safe) {
+            cache.free_list[this->frame_num].push_back(alloc);
+            return;
+        } else if (cache.num_blocks < CACHE_BLOCKS) {
+            cache.blocks[cache.num_blocks++] = alloc;
+            return;
+        }
+    }
+
+    ScopedSpinLock lock(index_lock);
+    insert_free(start, size);
+}
+
+void StreamedBuffer::advance()
+{
+    // Caller must have waited on the fence of the frame being reclaimed
+    ScopedSpinLock lock(index_lock);
+    for (size_t i = 0; i < NUM_CACHES; ++i) {
+        ThreadCache& cache = caches[i];
+        ScopedSpinLock cache_lock(cache.lock);
+
+        // Cached blocks go back so they can coalesce
+        for (size_t j = 0; j < cache.num_blocks; ++j) {
+            insert_free(cache.blocks[j].start, cache.blocks[j].end - cache.blocks[j].start);
+        }
+        cache.num_blocks = 0;
+
+        FreeList& list = cache.free_list[this->frame_num];
+        for (FreeList::iterator zone = list.begin(); zone != list.end(); ++zone) {
+            insert_free(zone->start, zone->end - zone->start);
+        }
+        list.clear();
+    }
+}
+
+void DrawBatch::mark_updated(bool structural)
+{
+    if (structural) {
+        this->updated = true;
+    }
+    this->draws_updated = true;
+    this->material.updated = true;
+}
+
+void DrawBatch::mark_draw_updated(size_t draw, bool structural)
+{
+    if (structural) {
+        this->draw_updated[draw] = true;
+    } else {
+        this->instances_updated[draw] = true;
+    }
+    mark_updated(false);
+}
+
+PoolHandle DrawPool::create_slot(DrawBatch* batch, uint32_t draw, uint32_t instance)
+{
+    uint32_t index = free_head;
+    if (index == NONE) {
+        index = slot_table.size();
+        Slot slot = {0, NONE, nullptr, 0, 0};
+        slot_table.push_back(slot);
+        centers.push_back(glm::vec3(0.0f));
+        extents.push_back(glm::vec3(0.0f));
+        bounded.push_back(false);
+        visible.push_back(true);
+        changed.push_back(false);
+    } else {
+        free_head = slot_table[index].next_free;
+    }
+    reset_bounds(index);
+
+    Slot& slot = slot_table[index];
+    // Skip zero so a null handle never matches
+    if (++slot.generation == 0) {
+        slot.generation = 1;
+    }
+    slot.next_free = NONE;
+    slot.batch = batch;
+    slot.draw = draw;
+    slot.instance = instance;
+    return PoolHandle(index, slot.generation);
+}
+
+void DrawPool::reset_bounds(uint32_t index)
+{
+    // Large enough that the box straddles every plane
+    static const float UNBOUNDED = 1e30f;
+
+    centers[index] = glm::vec3(0.0f);
+    extents[index] = glm::vec3(UNBOUNDED);
+    bounded[index] = false;
+    visible[index] = true;
+    bvh.remove(index);
+    mark_changed(index);
+}
+
+void DrawPool::destroy_slot(uint32_t index)
+{
+    Slot& slot = slot_table[index];
+    ++slot.generation;
+    slot.batch = nullptr;
+    bounded[index] = false;
+    bvh.remove(index);
+    mark_changed(index);
+    slot.next_free = free_head;
+    free_head = index;
+}
+
+const DrawPool::Slot* DrawPool::get_slot(PoolHandle handle) const
+{
+    if (handle.is_null() || handle.index >= slot_table.size()) {
+        return nullptr;
+    }
+
+    const Slot& slot = slot_table[handle.index];
+    if (slot.generation != handle.generation || slot.batch == nullptr) {
+        return nullptr;
+    }
+    return &slot;
+}
+
+DrawPool::Slot* DrawPool::get_slot(PoolHandle handle)
+{
+    return const_cast<Slot*>(static_cast<const DrawPool*>(this)->get_slot(handle));
+}
+
+bool DrawPool::get_slot_info(uint32_t slot, const DrawBatch*& batch, uint32_t& draw, uint32_t& instance) const
+{
+    if (slot >= slot_table.size() || slot_table[slot].batch == nullptr) {
+        return false;
+    }
+
+    batch = slot_table[slot].batch;
+    draw = slot_table[slot].draw;
+    instance = slot_table[slot].instance;
+    return true;
+}
+
+void DrawPool::mark_changed(uint32_t slot)
+{
+    if (!changed[slot]) {
+        changed[slot] = true;
+        changed_slots.push_back(slot);
+    }
+}
+
+void DrawPool::take_changed(std::vector<uint32_t>& slots)
+{
+    for (size_t i = 0; i < changed_slots.size(); ++i) {
+        changed[changed_slots[i]] = false;
+    }
+    slots.swap(changed_slots);
+    changed_slots.clear();
+}
+
+DrawHandle DrawPool::add_draw(DrawBatch& batch, size_t verts, size_t elements, size_t vert_offset, size_t element_offset)
+{
+    uint32_t draw = batch.verts.size();
+    DrawHandle handle = create_slot(&batch, draw, NONE);
+
+    batch.verts.push_back(verts);
+    batch.elements.push_back(elements);
+    batch.vert_offset.push_back(vert_offset);
+    batch.element_offset.push_back(element_offset);
+    batch.num_instances.push_back(0);
+    batch.info_offset.push_back(0);
+    batch.draw_updated.push_back(true);
+    batch.instances_updated.push_back(false);
+    batch.visible.push_back(true);
+    batch.slots.push_back(handle.index);
+    batch.instances.push_back(DrawBatch::Instances());
+
+    batch.mark_updated(true);
+    return handle;
+}
+
+void DrawPool::remove_draw(DrawHandle handle)
+{
+    Slot* slot = get_slot(handle);
+    if (slot == nullptr || slot->instance != NONE) {
+        return;
+    }
+
+    DrawBatch& batch = *slot->batch;
+    uint32_t draw = slot->draw;
+    uint32_t last = batch.verts.size() - 1;
+
+    DrawBatch::Instances& instances = batch.instances[draw];
+    for (size_t i = 0; i < instances.slots.size(); ++i) {
+        destroy_slot(instances.slots[i]);
+    }
+    destroy_slot(handle.index);
+
+    // Draw info is released by write_batches with the rest of the changes
+    if (batch.num_instances[draw] > 0) {
+        batch.freed_info.push_back(std::make_pair(batch.info_offset[draw], batch.num_instances[draw]));
+    }
+
+    if (draw != last) {
+        batch.verts[draw] = batch.verts[last];
+        batch.elements[draw] = batch.elements[last];
+        batch.vert_offset[draw] = batch.vert_offset[last];
+        batch.element_offset[draw] = batch.element_offset[last];
+        batch.num_instances[draw] = batch.num_instances[last];
+        batch.info_offset[draw] = batch.info_offset[last];
+        batch.draw_updated[draw] = batch.draw_updated[last];
+        batch.instances_updated[draw] = batch.instances_updated[last];
+        batch.visible[draw] = batch.visible[last];
+        batch.slots[draw] = batch.slots[last];
+        std::swap(batch.instances[draw], batch.instances[last]);
+
+        slot_table[batch.slots[draw]].draw = draw;
+        DrawBatch::Instances& moved = batch.instances[draw];
+        for (size_t i = 0; i < moved.slots.size(); ++i) {
+            slot_table[moved.slots[i]].draw = draw;
+        }
+    }
+
+    batch.verts.pop_back();
+    batch.elements.pop_back();
+    batch.vert_offset.pop_back();
+    batch.element_offset.pop_back();
+    batch.num_instances.pop_back();
+    batch.info_offset.pop_back();
+    batch.draw_updated.pop_back();
+    batch.instances_updated.pop_back();
+    batch.visible.pop_back();
+    batch.slots.pop_back();
+    batch.instances.pop_back();
+
+    batch.mark_updated(true);
+}
+
+InstanceHandle DrawPool::add_instance(DrawHandle draw_handle, const DrawInfoBuffer::DrawInfo& draw_info)
+{
+    Slot* slot = get_slot(draw_handle);
+    if (slot == nullptr || slot->instance != NONE) {
+        return InstanceHandle();
+    }
+
+    DrawBatch& batch = *slot->batch;
+    uint32_t draw = slot->draw;
+    DrawBatch::Instances& instances = batch.instances[draw];
+    uint32_t instance = instances.draw_info.size();
+
+    // May reallocate slot_table, slot is not used past here
+    InstanceHandle handle = create_slot(&batch, draw, instance);
+    instances.draw_info.push_back(draw_info);
+    instances.slots.push_back(handle.index);
+    instances.updated.push_back(true);
+
+    batch.mark_draw_updated(draw, true);
+    return handle;
+}
+
+void DrawPool::remove_instance(InstanceHandle handle)
+{
+    Slot* slot = get_slot(handle);
+    if (slot == nullptr || slot->instance == NONE) {
+        return;
+    }
+
+    DrawBatch& batch = *slot->batch;
+    uint32_t draw = slot->draw;
+    uint32_t instance = slot->instance;
+    DrawBatch::Instances& instances = batch.instances[draw];
+    uint32_t last = instances.draw_info.size() - 1;
+
+    destroy_slot(handle.index);
+
+    if (instance != last) {
+        instances.draw_info[instance] = instances.draw_info[last];
+        instances.slots[instance] = instances.slots[last];
+        instances.updated[instance] = true;
+        slot_table[instances.slots[instance]].instance = instance;
+    }
+
+    instances.draw_info.pop_back();
+    instances.slots.pop_back();
+    instances.updated.pop_back();
+
+    batch.mark_draw_updated(draw, true);
+}
+
+InstanceHandle DrawPool::get_base_instance(DrawHandle draw_handle) const
+{
+    const Slot* slot = get_slot(draw_handle);
+    if (slot == nullptr || slot->instance != NONE) {
+        return InstanceHandle();
+    }
+
+    const DrawBatch::Instances& instances = slot->batch->instances[slot->draw];
+    if (instances.slots.empty()) {
+        return InstanceHandle();
+    }
+
+    uint32_t index = instances.slots.front();
+    return InstanceHandle(index, slot_table[index].generation);
+}
+
+DrawHandle DrawPool::get_draw(PoolHandle handle) const
+{
+    const Slot* slot = get_slot(handle);
+    if (slot == nullptr) {
+        return DrawHandle();
+    } else if (slot->instance == NONE) {
+        return handle;
+    }
+
+    uint32_t index = slot->batch->slots[slot->draw];
+    return DrawHandle(index, slot_table[index].generation);
+}
+
+DrawBatch* DrawPool::get_batch(PoolHandle handle) const
+{
+    const Slot* slot = get_slot(handle);
+    return slot != nullptr ? slot->batch : nullptr;
+}
+
+bool DrawPool::get_geometry(DrawHandle handle, size_t& verts, size_t& elements,
+                            size_t& vert_offset, size_t& element_offset) const
+{
+    const Slot* slot = get_slot(handle);
+    if (slot == nullptr || slot->instance != NONE) {
+        return false;
+    }
+
+    const DrawBatch& batch = *slot->batch;
+    verts = batch.verts[slot->draw];
+    elements = batch.elements[slot->draw];
+    vert_offset = batch.vert_offset[slot->draw];
+    element_offset = batch.element_offset[slot->draw];
+    return true;
+}
+
+bool DrawPool::update_instance(InstanceHandle handle, const DrawInfoBuffer::DrawInfo& draw_info)
+{
+    Slot* slot = get_slot(handle);
+    if (slot == nullptr || slot->instance == NONE) {
+        return false;
+    }
+
+    DrawBatch& batch = *slot->batch;
+    DrawBatch::Instances& instances = batch.instances[slot->draw];
+    if (instances.draw_info[slot->instance] == draw_info) {
+        return true;
+    }
+
+    instances.draw_info[slot->instance] = draw_info;
+    instances.updated[slot->instance] = true;
+    batch.mark_draw_updated(slot->draw, false);
+    return true;
+}
+
+bool DrawPool::get_instance_info(InstanceHandle handle, DrawInfoBuffer::DrawInfo& draw_info) const
+{
+    const Slot* slot = get_slot(handle);
+    if (slot == nullptr || slot->instance == NONE) {
+        return false;
+    }
+
+    draw_info = slot->batch->instances[slot->draw].draw_info[slot->instance];
+    return true;
+}
+
+void DrawPool::set_bounds(InstanceHandle handle, const glm::vec3& center, const glm::vec3& extent)
+{
+    if (get_slot(handle) == nullptr) {
+        return;
+    }
+
+    centers[handle.index] = center;
+    extents[handle.index] = extent;
+    bounded[handle.index] = true;
+    bvh.set(handle.index, center, extent);
+    mark_changed(handle.index);
+}
+
+bool DrawPool::get_bounds(uint32_t slot, glm::vec3& center, glm::vec3& extent) const
+{
+    center = centers[slot];
+    extent = extents[slot];
+    return bounded[slot] != 0;
+}
+
+bool DrawPool::has_bounds(InstanceHandle handle) const
+{
+    return get_slot(handle) != nullptr && bounded[handle.index];
+}
+
+void DrawPool::cull(const glm::mat4x4* view_projections, size_t num_views)
+{
+    // Slots without bounds are never culled, the rest are found through the tree
+    size_t count = slot_table.size();
+    for (size_t i = 0; i < count; ++i) {
+        visible[i] = num_views == 0 || !bounded[i];
+    }
+    if (num_views == 0) {
+        return;
+    }
+
+    bvh.update();
+    for (size_t view = 0; view < num_views; ++view) {
+        glm::vec4 planes[6];
+        get_frustum_planes(view_projections[view], planes);
+
+        found.clear();
+        bvh.query_frustum(planes, found);
+        for (size_t i = 0; i < found.size(); ++i) {
+            visible[found[i]] = true;
+        }
+    }
+}
+
+void DrawPool::intersect_ray(const glm::vec3& from, const glm::vec3& to, std::vector<InstanceHandle>& result)
+{
+    bvh.update();
+
+    std::vector<std::pair<float, uint32_t>> hits;
+    bvh.query_ray(from, to - from, 1.0f, hits);
+    for (size_t i = 0; i < hits.size(); ++i) {
+        result.push_back(PoolHandle(hits[i].second, slot_table[hits[i].second].generation));
+    }
+}
+
+InstanceHandle DrawPool::find_nearest(const glm::vec3& point, float max_distance)
+{
+    bvh.update();
+
+    float distance;
+    uint32_t slot = bvh.query_nearest(point, max_distance, distance);
+    if (slot == BoundingVolumeHierarchy::NONE) {
+        return InstanceHandle();
+    }
+    return PoolHandle(slot, slot_table[slot].generation);
+}
+
+static float get_surface_area(const glm::vec3& min, const glm::vec3& max)
+{
+    glm::vec3 size = max - min;
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+// Distance from the point to the box, 0 inside it
+static float get_box_distance(const glm::vec3& point, const glm::vec3& min, const glm::vec3& max)
+{
+    glm::vec3 offset = glm::max(glm::max(min - point, point - max), glm::vec3(0.0f));
+    return glm::length(offset);
+}
+
+// Entry distance of the ray into the box, false if it misses or enters past max_distance
+static bool intersect_box(const glm::vec3& origin, const glm::vec3& inv_direction, float max_distance,
+                          const glm::vec3& min, const glm::vec3& max, float& distance)
+{
+    float near = 0.0f;
+    float far = max_distance;
+    for (int i = 0; i < 3; ++i) {
+        float t0 = (min[i] - origin[i]) * inv_direction[i];
+        float t1 = (max[i] - origin[i]) * inv_direction[i];
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        // NaN from a zero direction on the slab's plane keeps the old range
+        near = t0 > near ? t0 : near;
+        far = t1 < far ? t1 : far;
+        if (near > far) {
+            return false;
+        }
+    }
+    distance = near;
+    return true;
+}
+
+void BoundingVolumeHierarchy::set(uint32_t item, const glm::vec3& center, const glm::vec3& extent)
+{
+    if (item >= present.size()) {
+        present.resize(item + 1, false);
+        queued.resize(item + 1, false);
+        leaf.resize(item + 1, (uint32_t)NONE);
+        item_min.resize(item + 1);
+        item_max.resize(item + 1);
+    }
+
+    if (!present[item]) {
+        present[item] = true;
+        ++num_items;
+    }
+    if (!queued[item]) {
+        queued[item] = true;
+        pending.push_back(item);
+    }
+    item_min[item] = center - extent;
+    item_max[item] = center + extent;
+}
+
+void BoundingVolumeHierarchy::remove(uint32_t item)
+{
+    if (item < present.size() && present[item]) {
+        present[item] = false;
+        --num_items;
+        if (!queued[item]) {
+            queued[item] = true;
+            pending.push_back(item);
+        }
+    }
+}
+
+void BoundingVolumeHierarchy::update()
+{
+    // Incremental changes wear the tree down, past a quarter of it is built again
+    size_t changes = num_changes;
+    for (size_t i = 0; i < pending.size(); ++i) {
+        uint32_t item = pending[i];
+        changes += (present[item] != 0) != (leaf[item] != NONE);
+    }
+    if (changes > 0 && (nodes.empty() || changes > std::max(num_built / 4, (size_t)64))) {
+        rebuild();
+        return;
+    }
+
+    for (size_t i = 0; i < pending.size(); ++i) {
+        uint32_t item = pending[i];
+        queued[item] = false;
+        if (!present[item]) {
+            if (leaf[item] != NONE) {
+                erase(item);
+            }
+        } else if (leaf[item] == NONE) {
+            insert(item);
+        } else {
+            refit(leaf[item]);
+        }
+    }
+    pending.clear();
+    num_changes = changes;
+}
+
+void BoundingVolumeHierarchy::rebuild()
+{
+    for (size_t i = 0; i < pending.size(); ++i) {
+        queued[pending[i]] = false;
+    }
+    pending.clear();
+    num_changes = 0;
+
+    order.clear();
+    for (uint32_t i = 0; i < present.size(); ++i) {
+        if (present[i]) {
+            order.push_back(i);
+        }
+    }
+    num_built = order.size();
+
+    std::fill(leaf.begin(), leaf.end(), (uint32_t)NONE);
+    nodes.clear();
+    parents.clear();
+    if (!order.empty()) {
+        nodes.push_back(Node());
+        parents.push_back((uint32_t)NONE);
+        build(0, 0, order.size());
+    }
+}
+
+void BoundingVolumeHierarchy::insert(uint32_t item)
+{
+    // Erasing the last item of this update may have emptied the tree
+    if (nodes.empty()) {
+        Node root = {item_min[item], item_max[item], 0, 1};
+        nodes.push_back(root);
+        parents.push_back((uint32_t)NONE);
+        order.assign(1, item);
+        leaf[item] = 0;
+        return;
+    }
+
+    // Descends into the child whose surface grows least
+    uint32_t id = 0;
+    while (nodes[id].count == 0) {
+        uint32_t left = nodes[id].first;
+        uint32_t right = left + 1;
+        float left_area = get_surface_area(nodes[left].min, nodes[left].max);
+        float right_area = get_surface_area(nodes[right].min, nodes[right].max);
+        float left_growth = get_surface_area(glm::min(nodes[left].min, item_min[item]),
+                                             glm::max(nodes[left].max, item_max[item])) - left_area;
+        float right_growth = get_surface_area(glm::min(nodes[right].min, item_min[item]),
+                                              glm::max(nodes[right].max, item_max[item])) - right_area;
+        if (left_growth != right_growth) {
+            id = left_growth < right_growth ? left : right;
+        } else {
+            id = left_area <= right_area ? left : right;
+        }
+    }
+
+    if (nodes[id].count < LEAF_SIZE) {
+        // The leaf's range is moved to the end of order unless already there,
+        // the space left behind is reclaimed by the next build
+        Node& node = nodes[id];
+        if (node.first + node.count != order.size()) {
+            uint32_t first = order.size();
+            for (uint32_t i = 0; i < node.count; ++i) {
+                order.push_back(order[node.first + i]);
+            }
+            node.first = first;
+        }
+        order.push_back(item);
+        ++node.count;
+        leaf[item] = id;
+        refit(id);
+        return;
+    }
+
+    // Full leaves keep their items in a new left child, the item goes right
+    uint32_t left = nodes.size();
+    nodes.resize(left + 2);
+    parents.push_back(id);
+    parents.push_back(id);
+
+    nodes[left].first = nodes[id].first;
+    nodes[left].count = nodes[id].count;
+    for (uint32_t i = 0; i < nodes[left].count; ++i) {
+        leaf[order[nodes[left].first + i]] = left;
+    }
+    fit(left);
+
+    nodes[left + 1].first = order.size();
+    nodes[left + 1].count = 1;
+    order.push_back(item);
+    leaf[item] = left + 1;
+    fit(left + 1);
+
+    nodes[id].first = left;
+    nodes[id].count = 0;
+    refit(id);
+}
+
+void BoundingVolumeHierarchy::erase(uint32_t item)
+{
+    uint32_t id = leaf[item];
+    leaf[item] = NONE;
+
+    Node& node = nodes[id];
+    uint32_t pos = node.first;
+    while (order[pos] != item) {
+        ++pos;
+    }
+    order[pos] = order[node.first + node.count - 1];
+    if (--node.count > 0) {
+        refit(id);
+        return;
+    }
+
+    uint32_t parent = parents[id];
+    if (parent == NONE) {
+        nodes.clear();
+        parents.clear();
+        order.clear();
+        return;
+    }
+
+    // The sibling takes the parent's place, the pair is left unused until the next build
+    uint32_t sibling = nodes[parent].first + (nodes[parent].first == id ? 1 : 0);
+    nodes[parent] = nodes[sibling];
+    if (nodes[parent].count > 0) {
+        for (uint32_t i = 0; i < nodes[parent].count; ++i) {
+            leaf[order[nodes[parent].first + i]] = parent;
+        }
+    } else {
+        parents[nodes[parent].first] = parent;
+        parents[nodes[parent].first + 1] = parent;
+    }
+    if (parents[parent] != NONE) {
+        refit(parents[parent]);
+    }
+}
+
+// Ancestors are refitted until one's box is left unchanged
+void BoundingVolumeHierarchy::refit(uint32_t id)
+{
+    for (; id != NONE; id = parents[id]) {
+        glm::vec3 min = nodes[id].min;
+        glm::vec3 max = nodes[id].max;
+        fit(id);
+        if (nodes[id].min == min && nodes[id].max == max) {
+            break;
+        }
+    }
+}
+
+void BoundingVolumeHierarchy::fit(uint32_t id)
+{
+    Node& node = nodes[id];
+    if (node.count == 0) {
+        node.min = glm::min(nodes[node.first].min, nodes[node.first + 1].min);
+        node.max = glm::max(nodes[node.first].max, nodes[node.first + 1].max);
+        return;
+    }
+
+    node.min = item_min[order[node.first]];
+    node.max = item_max[order[node.first]];
+    for (uint32_t i = 1; i < node.count; ++i) {
+        node.min = glm::min(node.min, item_min[order[node.first + i]]);
+        node.max = glm::max(node.max, item_max[order[node.first + i]]);
+    }
+}
+
+void BoundingVolumeHierarchy::build(uint32_t id, uint32_t first, uint32_t count)
+{
+    nodes[id].first = first;
+    nodes[id].count = count;
+    fit(id);
+
+    // Centroids are binned along their widest axis
+    glm::vec3 centroid_min = item_min[order[first]] + item_max[order[first]];
+    glm::vec3 centroid_max = centroid_min;
+    for (uint32_t i = 1; i < count; ++i) {
+        glm::vec3 centroid = item_min[order[first + i]] + item_max[order[first + i]];
+        centroid_min = glm::min(centroid_min, centroid);
+        centroid_max = glm::max(centroid_max, centroid);
+    }
+    glm::vec3 size = centroid_max - centroid_min;
+    int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+
+    uint32_t mid = first + count / 2;
+    if (count > LEAF_SIZE && size[axis] > 0.0f) {
+        struct Bin
+        {
+            glm::vec3 min;
+            glm::vec3 max;
+            uint32_t count;
+        };
+        Bin bins[NUM_BINS];
+        for (uint32_t b = 0; b < NUM_BINS; ++b) {
+            bins[b].count = 0;
+        }
+
+        float scale = NUM_BINS / size[axis];
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t item = order[first + i];
+            float centroid = item_min[item][axis] + item_max[item][axis];
+            uint32_t b = std::min((uint32_t)((centroid - centroid_min[axis]) * scale), NUM_BINS - 1);
+            if (bins[b].count++ == 0) {
+                bins[b].min = item_min[item];
+                bins[b].max = item_max[item];
+            } else {
+                bins[b].min = glm::min(bins[b].min, item_min[item]);
+                bins[b].max = glm::max(bins[b].max, item_max[item]);
+            }
+        }
+
+        // Cost of splitting after each bin, swept from the right first
+        float right_cost[NUM_BINS];
+        glm::vec3 min;
+        glm::vec3 max;
+        uint32_t right_count = 0;
+        for (uint32_t b = NUM_BINS - 1; b > 0; --b) {
+            if (bins[b].count > 0) {
+                min = right_count > 0 ? glm::min(min, bins[b].min) : bins[b].min;
+                max = right_count > 0 ? glm::max(max, bins[b].max) : bins[b].max;
+                right_count += bins[b].count;
+            }
+            right_cost[b - 1] = right_count > 0 ? right_count * get_surface_area(min, max) : 0.0f;
+        }
+
+        float best_cost = count * get_surface_area(nodes[id].min, nodes[id].max);
+        uint32_t best_split = NUM_BINS;
+        uint32_t left_count = 0;
+        for (uint32_t b = 0; b + 1 < NUM_BINS; ++b) {
+            if (bins[b].count > 0) {
+                min = left_count > 0 ? glm::min(min, bins[b].min) : bins[b].min;
+                max = left_count > 0 ? glm::max(max, bins[b].max) : bins[b].max;
+                left_count += bins[b].count;
+            }
+            if (left_count == 0 || left_count == count) {
+                continue;
+            }
+
+            float cost = left_count * get_surface_area(min, max) + right_cost[b];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_split = b;
+            }
+        }
+
+        // Small ranges stay leaves when no split pays for itself
+        if (best_split == NUM_BINS && count <= LEAF_SIZE * 4) {
+            mid = first;
+        } else if (best_split != NUM_BINS) {
+            uint32_t* split = std::partition(order.data() + first, order.data() + first + count,
+                                             [&](uint32_t item) {
+                float centroid = item_min[item][axis] + item_max[item][axis];
+                uint32_t b = std::min((uint32_t)((centroid - centroid_min[axis]) * scale), NUM_BINS - 1);
+                return b <= best_split;
+            });
+            mid = split - order.data();
+        }
+    } else if (count <= LEAF_SIZE) {
+        mid = first;
+    }
+
+    if (mid == first) {
+        for (uint32_t i = 0; i < count; ++i) {
+            leaf[order[first + i]] = id;
+        }
+        return;
+    }
+
+    uint32_t left = nodes.size();
+    nodes.resize(left + 2);
+    parents.push_back(id);
+    parents.push_back(id);
+    nodes[id].first = left;
+    nodes[id].count = 0;
+
+    build(left, first, mid - first);
+    build(left + 1, mid, first + count - mid);
+}
+
+void BoundingVolumeHierarchy::collect(uint32_t id, std::vector<uint32_t>& result) const
+{
+    const Node& node = nodes[id];
+    if (node.count > 0) {
+        result.insert(result.end(), order.begin() + node.first, order.begin() + node.first + node.count);
+    } else {
+        collect(node.first, result);
+        collect(node.first + 1, result);
+    }
+}
+
+void BoundingVolumeHierarchy::query_frustum(const glm::vec4* planes, std::vector<uint32_t>& result) const
+{
+    if (nodes.empty()) {
+        return;
+    }
+
+    // Planes a box is fully in front of are dropped for its children
+    std::vector<std::pair<uint32_t, uint32_t>> stack;
+    stack.push_back(std::make_pair(0u, 0x3fu));
+    while (!stack.empty()) {
+        uint32_t id = stack.back().first;
+        uint32_t mask = stack.back().second;
+        stack.pop_back();
+
+        const Node& node = nodes[id];
+        glm::vec3 center = (node.min + node.max) * 0.5f;
+        glm::vec3 extent = (node.max - node.min) * 0.5f;
+        bool outside = false;
+        for (uint32_t p = 0; p < 6 && !outside; ++p) {
+            if (!(mask & (1u << p))) {
+                continue;
+            }
+            const glm::vec4& plane = planes[p];
+            float dist = center.x * plane.x + center.y * plane.y + center.z * plane.z + plane.w;
+            float radius = extent.x * std::fabs(plane.x) + extent.y * std::fabs(plane.y)
+                    + extent.z * std::fabs(plane.z);
+            outside = dist + radius < 0.0f;
+            if (dist - radius >= 0.0f) {
+                mask &= ~(1u << p);
+            }
+        }
+
+        if (outside) {
+            continue;
+        } else if (mask == 0) {
+            collect(id, result);
+        } else if (node.count > 0) {
+            // Leaf items are tested against the planes left over
+            for (uint32_t i = 0; i < node.count; ++i) {
+                uint32_t item = order[node.first + i];
+                glm::vec3 item_center = (item_min[item] + item_max[item]) * 0.5f;
+                glm::vec3 item_extent = (item_max[item] - item_min[item]) * 0.5f;
+                bool item_outside = false;
+                for (uint32_t p = 0; p < 6 && !item_outside; ++p) {
+                    const glm::vec4& plane = planes[p];
+                    float dist = item_center.x * plane.x + item_center.y * plane.y
+                            + item_center.z * plane.z + plane.w;
+                    float radius = item_extent.x * std::fabs(plane.x) + item_extent.y * std::fabs(plane.y)
+                            + item_extent.z * std::fabs(plane.z);
+                    item_outside = (mask & (1u << p)) && dist + radius < 0.0f;
+                }
+                if (!item_outside) {
+                    result.push_back(item);
+                }
+            }
+        } else {
+            stack.push_back(std::make_pair(node.first, mask));
+            stack.push_back(std::make_pair(node.first + 1, mask));
+        }
+    }
+}
+
+void BoundingVolumeHierarchy::query_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance,
+                                        std::vector<std::pair<float, uint32_t>>& result) const
+{
+    if (nodes.empty()) {
+        return;
+    }
+
+    glm::vec3 inv_direction(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+    size_t first_result = result.size();
+
+    std::vector<uint32_t> stack(1, 0);
+    while (!stack.empty()) {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+
+        float distance;
+        if (!intersect_box(origin, inv_direction, max_distance, node.min, node.max, distance)) {
+            continue;
+        }
+
+        if (node.count == 0) {
+            stack.push_back(node.first);
+            stack.push_back(node.first + 1);
+            continue;
+        }
+
+        for (uint32_t i = 0; i < node.count; ++i) {
+            uint32_t item = order[node.first + i];
+            if (intersect_box(origin, inv_direction, max_distance, item_min[item], item_max[item], distance)) {
+                result.push_back(std::make_pair(distance, item));
+            }
+        }
+    }
+
+    std::sort(result.begin() + first_result, result.end());
+}
+
+uint32_t BoundingVolumeHierarchy::query_nearest(const glm::vec3& point, float max_distance, float& distance) const
+{
+    uint32_t nearest = NONE;
+    distance = max_distance;
+    if (nodes.empty()) {
+        return nearest;
+    }
+
+    // The closer child is visited first so the bound tightens early
+    std::vector<uint32_t> stack(1, 0);
+    while (!stack.empty()) {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+
+        if (get_box_distance(point, node.min, node.max) > distance) {
+            continue;
+        }
+
+        if (node.count == 0) {
+            const Node& left = nodes[node.first];
+            const Node& right = nodes[node.first + 1];
+            bool left_first = get_box_distance(point, left.min, left.max)
+                    <= get_box_distance(point, right.min, right.max);
+            stack.push_back(left_first ? node.first + 1 : node.first);
+            stack.push_back(left_first ? node.first : node.first + 1);
+            continue;
+        }
+
+        for (uint32_t i = 0; i < node.count; ++i) {
+            uint32_t item = order[node.first + i];
+            float item_distance = get_box_distance(point, item_min[item], item_max[item]);
+            if (item_distance <= distance && (nearest == NONE || item_distance < distance)) {
+                nearest = item;
+                distance = item_distance;
+            }
+        }
+    }
+    return nearest;
+}
+
+TransformHierarchy::Index TransformHierarchy::add(Index parent_id, void* node_value)
+{
+    Index id;
+    if (free_head != NONE) {
+        id = free_head;
+        free_head = parent[id];
+    } else {
+        id = parent.size();
+        level_pos.push_back(0);
+        depth.push_back(0);
+        parent.push_back((Index)NONE);
+        local.push_back(glm::mat4x4(1.0));
+        world.push_back(glm::mat4x4(1.0));
+        dirty.push_back(false);
+        output.push_back((size_t)NO_OUTPUT);
+        value.push_back(nullptr);
+    }
+
+    uint32_t level = parent_id != NONE ? depth[parent_id] + 1 : 0;
+    if (level >= levels.size()) {
+        levels.resize(level + 1);
+    }
+
+    level_pos[id] = levels[level].size();
+    levels[level].push_back(id);
+    depth[id] = level;
+    parent[id] = parent_id;
+    local[id] = glm::mat4x4(1.0);
+    dirty[id] = true;
+    output[id] = NO_OUTPUT;
+    value[id] = node_value;
+    return id;
+}
+
+void TransformHierarchy::remove(Index id, std::vector<void*>* removed)
+{
+    if (id >= depth.size() || depth[id] == NONE) {
+        return;
+    }
+
+    uint32_t level = depth[id];
+    if (level + 1 < levels.size()) {
+        // Walked backwards as removing swaps the last child into place
+        std::vector<Index>& children = levels[level + 1];
+        for (size_t i = children.size(); i-- > 0;) {
+            if (i < children.size() && parent[children[i]] == id) {
+                remove(children[i], removed);
+            }
+        }
+    }
+
+    unlink(id);
+
+    if (removed != nullptr) {
+        removed->push_back(value[id]);
+    }
+    depth[id] = NONE;
+    value[id] = nullptr;
+    parent[id] = free_head;
+    free_head = id;
+}
+
+void TransformHierarchy::unlink(Index id)
+{
+    std::vector<Index>& nodes = levels[depth[id]];
+    Index last = nodes.back();
+    nodes[level_pos[id]] = last;
+    level_pos[last] = level_pos[id];
+    nodes.pop_back();
+}
+
+void TransformHierarchy::set_depth(Index id, uint32_t level)
+{
+    uint32_t old_level = depth[id];
+    if (old_level == level) {
+        return;
+    }
+
+    // Children are found before the node leaves its level
+    std::vector<Index> children;
+    if (old_level + 1 < levels.size()) {
+        const std::vector<Index>& below = levels[old_level + 1];
+        for (size_t i = 0; i < below.size(); ++i) {
+            if (parent[below[i]] == id) {
+                children.push_back(below[i]);
+            }
+        }
+    }
+
+    unlink(id);
+    if (level >= levels.size()) {
+        levels.resize(level + 1);
+    }
+    level_pos[id] = levels[level].size();
+    levels[level].push_back(id);
+    depth[id] = level;
+
+    for (size_t i = 0; i < children.size(); ++i) {
+        set_depth(children[i], level + 1);
+    }
+}
+
+void TransformHierarchy::set_local(Index id, const glm::mat4x4& matrix)
+{
+    local[id] = matrix;
+    dirty[id] = true;
+}
+
+void TransformHierarchy::set_parent(Index id, Index parent_id)
+{
+    if (parent[id] == parent_id) {
+        return;
+    }
+
+    parent[id] = parent_id;
+    set_depth(id, parent_id != NONE ? depth[parent_id] + 1 : 0);
+
+    // The subtree follows as the node's world matrix changes
+    dirty[id] = true;
+}
+
+// Column major a * b
+static inline void multiply_matrix(const glm::mat4x4& a, const glm::mat4x4& b, glm::mat4x4& result)
+{
+#ifdef __SSE__
+    const float* lhs = &a[0][0];
+    const float* rhs = &b[0][0];
+    float* out = &result[0][0];
+
+    __m128 c0 = _mm_loadu_ps(lhs);
+    __m128 c1 = _mm_loadu_ps(lhs + 4);
+    __m128 c2 = _mm_loadu_ps(lhs + 8);
+    __m128 c3 = _mm_loadu_ps(lhs + 12);
+    for (int i = 0; i < 4; ++i) {
+        const float* column = rhs + i * 4;
+        __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(column[0])),
+                                         _mm_mul_ps(c1, _mm_set1_ps(column[1]))),
+                              _mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(column[2])),
+                                         _mm_mul_ps(c3, _mm_set1_ps(column[3]))));
+        _mm_storeu_ps(out + i * 4, r);
+    }
+#else
+    result = a * b;
+#endif
+}
+
+void TransformHierarchy::update_range(const Index* ids, size_t count, char* data, std::vector<Index>& result)
+{
+    for (size_t i = 0; i < count; ++i) {
+        Index id = ids[i];
+        Index parent_id = parent[id];
+        bool parent_dirty = parent_id != NONE && dirty[parent_id];
+        if (!dirty[id] && !parent_dirty) {
+            continue;
+        }
+
+        if (parent_id != NONE) {
+            multiply_matrix(world[parent_id], local[id], world[id]);
+        } else {
+            world[id] = local[id];
+        }
+
+        dirty[id] = true;
+        if (output[id] != NO_OUTPUT && data != nullptr) {
+            // Transposed so the first three rows hold the affine part
+            float* out = (float*)(data + output[id]);
+#ifdef __SSE__
+            const float* m = &world[id][0][0];
+            __m128 r0 = _mm_loadu_ps(m);
+            __m128 r1 = _mm_loadu_ps(m + 4);
+            __m128 r2 = _mm_loadu_ps(m + 8);
+            __m128 r3 = _mm_loadu_ps(m + 12);
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+            _mm_storeu_ps(out, r0);
+            _mm_storeu_ps(out + 4, r1);
+            _mm_storeu_ps(out + 8, r2);
+#else
+            const glm::mat4x4& m = world[id];
+            for (int row = 0; row < 3; ++row) {
+                for (int column = 0; column < 4; ++column) {
+                    out[row * 4 + column] = m[column][row];
+                }
+            }
+#endif
+        }
+        result.push_back(id);
+    }
+}
+
+void TransformHierarchy::update(char* data)
+{
+    updated.clear();
+
+    size_t num_threads = std::max(QThreadPool::globalInstance()->maxThreadCount(), 1);
+    std::vector<std::vector<Index>> results;
+    std::vector<QFuture<void>> futures;
+
+    for (size_t level = 0; level < levels.size(); ++level) {
+        const std::vector<Index>& nodes = levels[level];
+        if (nodes.size() < PARALLEL_LEVEL || num_threads == 1) {
+            update_range(nodes.data(), nodes.size(), data, updated);
+            continue;
+        }
+
+        // This thread takes the first chunk
+        size_t chunk = (nodes.size() + num_threads - 1) / num_threads;
+        results.resize(num_threads);
+        futures.clear();
+        for (size_t i = 1; i < num_threads && i * chunk < nodes.size(); ++i) {
+            const Index* ids = nodes.data() + i * chunk;
+            size_t count = std::min(chunk, nodes.size() - i * chunk);
+            std::vector<Index>* result = &results[i];
+            result->clear();
+            futures.push_back(QtConcurrent::run([this, ids, count, data, result]() {
+                update_range(ids, count, data, *result);
+            }));
+        }
+        update_range(nodes.data(), chunk, data, updated);
+
+        for (size_t i = 0; i < futures.size(); ++i) {
+            futures[i].waitForFinished();
+            updated.insert(updated.end(), results[i + 1].begin(), results[i + 1].end());
+        }
+    }
+
+    for (size_t i = 0; i < updated.size(); ++i) {
+        dirty[updated[i]] = false;
+    }
+}
+
+void LightClusters::set_light(uint32_t index, const glm::vec3& center, float light_radius)
+{
+    if (index >= radius.size()) {
+        // Padded to whole SSE lanes, the tail is never assigned
+        size_t size = align(index + 1, 4);
+        center_x.resize(size, 0.0f);
+        center_y.resize(size, 0.0f);
+        center_z.resize(size, 0.0f);
+        radius.resize(size, -1.0f);
+    }
+
+    if (radius[index] < 0.0f) {
+        ++num_lights;
+    }
+    center_x[index] = center.x;
+    center_y[index] = center.y;
+    center_z[index] = center.z;
+    radius[index] = std::max(light_radius, 0.0f);
+}
+
+void LightClusters::remove_light(uint32_t index)
+{
+    if (index < radius.size() && radius[index] >= 0.0f) {
+        radius[index] = -1.0f;
+        --num_lights;
+    }
+}
+
+static inline uint32_t clamp_cluster(float value, uint32_t size)
+{
+    return (uint32_t)std::min(std::max(value, 0.0f), (float)(size - 1));
+}
+
+void LightClusters::build(const glm::mat4x4& view, const glm::mat4x4& projection, std::vector<uint32_t>& result)
+{
+    result.assign(NUM_CLUSTERS * 2, 0);
+    ranges.clear();
+    if (empty()) {
+        return;
+    }
+
+    // Planes of a glm::perspective projection
+    float near = projection[3][2] / (projection[2][2] - 1.0f);
+    float far = projection[3][2] / (projection[2][2] + 1.0f);
+    float log_scale = GRID_Z / std::log(far / near);
+
+    // View space centres and depth bounds four lights at a time
+#ifdef __SSE__
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 near_4 = _mm_set1_ps(near);
+#endif
+    for (size_t i = 0; i < radius.size(); i += 4) {
+        float lane_r[4], lane_min[4], lane_max[4], lane_bounds[2][2][4];
+#ifdef __SSE__
+        __m128 cx = _mm_loadu_ps(&center_x[i]);
+        __m128 cy = _mm_loadu_ps(&center_y[i]);
+        __m128 cz = _mm_loadu_ps(&center_z[i]);
+        __m128 r = _mm_loadu_ps(&radius[i]);
+
+        __m128 vx[3];
+        for (int row = 0; row < 3; ++row) {
+            vx[row] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(view[0][row])),
+                                            _mm_mul_ps(cy, _mm_set1_ps(view[1][row]))),
+                                 _mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(view[2][row])),
+                                            _mm_set1_ps(view[3][row])));
+        }
+
+        __m128 depth = _mm_sub_ps(zero, vx[2]);
+        __m128 depth_min = _mm_max_ps(_mm_sub_ps(depth, r), near_4);
+        __m128 depth_max = _mm_add_ps(depth, r);
+
+        // Extremes of the bounding box over its nearest and farthest depth
+        __m128 bounds[2][2];
+        for (int axis = 0; axis < 2; ++axis) {
+            __m128 scale = _mm_set1_ps(projection[axis][axis]);
+            __m128 low = _mm_sub_ps(vx[axis], r);
+            __m128 high = _mm_add_ps(vx[axis], r);
+            bounds[axis][0] = _mm_mul_ps(scale, _mm_min_ps(_mm_div_ps(low, depth_min), _mm_div_ps(low, depth_max)));
+            bounds[axis][1] = _mm_mul_ps(scale, _mm_max_ps(_mm_div_ps(high, depth_min), _mm_div_ps(high, depth_max)));
+        }
+
+        _mm_storeu_ps(lane_r, r);
+        _mm_storeu_ps(lane_min, depth_min);
+        _mm_storeu_ps(lane_max, depth_max);
+        for (int axis = 0; axis < 2; ++axis) {
+            _mm_storeu_ps(lane_bounds[axis][0], bounds[axis][0]);
+            _mm_storeu_ps(lane_bounds[axis][1], bounds[axis][1]);
+        }
+#else
+        for (int lane = 0; lane < 4; ++lane) {
+            glm::vec4 center(center_x[i + lane], center_y[i + lane], center_z[i + lane], 1.0f);
+            glm::vec4 vx = view * center;
+            float r = radius[i + lane];
+
+            float depth = -vx[2];
+            lane_r[lane] = r;
+            lane_min[lane] = std::max(depth - r, near);
+            lane_max[lane] = depth + r;
+
+            // Extremes of the bounding box over its nearest and farthest depth
+            for (int axis = 0; axis < 2; ++axis) {
+                float scale = projection[axis][axis];
+                float low = vx[axis] - r;
+                float high = vx[axis] + r;
+                lane_bounds[axis][0][lane] = scale * std::min(low / lane_min[lane], low / lane_max[lane]);
+                lane_bounds[axis][1][lane] = scale * std::max(high / lane_min[lane], high / lane_max[lane]);
+            }
+        }
+#endif
+
+        for (int lane = 0; lane < 4; ++lane) {
+            if (lane_r[lane] < 0.0f || lane_max[lane] < near || lane_min[lane] > far) {
+                continue;
+            }
+
+            Range range;
+            range.light = i + lane;
+            const uint32_t grid[2] = {GRID_X, GRID_Y};
+            bool visible = true;
+            for (int axis = 0; axis < 2; ++axis) {
+                // Off centre projections shift the frustum in NDC
+                float offset = projection[2][axis];
+                float low = lane_bounds[axis][0][lane] - offset;
+                float high = lane_bounds[axis][1][lane] - offset;
+                visible = visible && high >= -1.0f && low <= 1.0f;
+                range.min[axis] = clamp_cluster((low * 0.5f + 0.5f) * grid[axis], grid[axis]);
+                range.max[axis] = clamp_cluster((high * 0.5f + 0.5f) * grid[axis], grid[axis]);
+            }
+            if (!visible) {
+                continue;
+            }
+
+            range.min[2] = clamp_cluster(std::log(lane_min[lane] / near) * log_scale, GRID_Z);
+            range.max[2] = clamp_cluster(std::log(std::min(lane_max[lane], far) / near) * log_scale, GRID_Z);
+            ranges.push_back(range);
+        }
+    }
+
+    // Count, prefix sum into offsets, then fill using the counts as cursors
+    for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+        for (uint32_t z = it->min[2]; z <= it->max[2]; ++z) {
+            for (uint32_t y = it->min[1]; y <= it->max[1]; ++y) {
+                for (uint32_t x = it->min[0]; x <= it->max[0]; ++x) {
+                    ++result[((z * GRID_Y + y) * GRID_X + x) * 2 + 1];
+                }
+            }
+        }
+    }
+
+    uint32_t offset = 0;
+    for (uint32_t cluster = 0; cluster < NUM_CLUSTERS; ++cluster) {
+        result[cluster * 2] = offset;
+        offset += result[cluster * 2 + 1];
+        result[cluster * 2 + 1] = 0;
+    }
+
+    result.resize(NUM_CLUSTERS * 2 + offset);
+    for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+        for (uint32_t z = it->min[2]; z <= it->max[2]; ++z) {
+            for (uint32_t y = it->min[1]; y <= it->max[1]; ++y) {
+                for (uint32_t x = it->min[0]; x <= it->max[0]; ++x) {
+                    uint32_t cluster = (z * GRID_Y + y) * GRID_X + x;
+                    uint32_t& count = result[cluster * 2 + 1];
+                    result[NUM_CLUSTERS * 2 + result[cluster * 2] + count] = it->light;
+                    ++count;
+                }
+            }
+        }
+    }
+}
+
+static inline uint64_t rotate_left(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static void hash_bytes(const char* data, size_t size, uint64_t (&hash)[2])
+{
+    // Two independent lanes so a collision needs both to match
+    uint64_t a = hash[0];
+    uint64_t b = hash[1];
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        a = (a ^ word) * 0x100000001b3ULL;
+        b = rotate_left(b ^ word, 31) * 0x9e3779b97f4a7c15ULL;
+    }
+    for (; i < size; ++i) {
+        uint64_t byte = (unsigned char)data[i];
+        a = (a ^ byte) * 0x100000001b3ULL;
+        b = rotate_left(b ^ byte, 31) * 0x9e3779b97f4a7c15ULL;
+    }
+    hash[0] = a;
+    hash[1] = b;
+}
+
+GeometryKey::GeometryKey(const VertexFormat& format, size_t format_stride,
+                         const char* vertices, size_t vertex_bytes,
+                         const char* elements, size_t element_bytes)
+    : vertex_bytes(vertex_bytes), element_bytes(element_bytes)
+{
+    hash[0] = 0xcbf29ce484222325ULL;
+    hash[1] = 0x84222325cbf29ce4ULL;
+
+    uint64_t layout[3] = {format.num_attribs, format_stride, 0};
+    hash_bytes((const char*)layout, sizeof(layout), hash);
+    for (size_t i = 0; i < format.num_attribs; ++i) {
+        const Attribute& attrib = format.attribs[i];
+        uint64_t fields[4] = {attrib.type, attrib.components, attrib.normalized, attrib.offset};
+        hash_bytes((const char*)fields, sizeof(fields), hash);
+    }
+
+    hash_bytes(vertices, vertex_bytes, hash);
+    hash_bytes(elements, element_bytes, hash);
+}
+
+ParameterKey::ParameterKey(const char* data, size_t size)
+    : size(size)
+{
+    hash[0] = 0xcbf29ce484222325ULL;
+    hash[1] = 0x84222325cbf29ce4ULL;
+    hash_bytes(data, size, hash);
+}
+
+void Material::set_params(size_t offset, const void* data, size_t size)
+{
+    if (offset + size > frag_params.size()) {
+        frag_params.resize(offset + size);
+    }
+    memcpy(frag_params.data() + offset, data, size);
 }
 
 DrawBatch& Material::get_batch(const VertexFormat& format, size_t format_stride, size_t primitive_type, size_t element_type)
 {
-    for (std::vector<DrawBatch>::iterator batch = batches.begin(); batch != batches.end(); ++batch) {
-        if (batch->format == format && batch->primitive_type == primitive_type
-                && batch->element_type == element_type
-                && batch->format_stride == format_stride) {
+    for (std::list<DrawBatch>::iterator batch = batches.begin(); batch != batches.end(); ++batch) {
+        if (batch->format == format && batch->primitive_type == (int)primitive_type
+                && batch->element_type == (int)element_type
+                && batch->format_stride == (int)format_stride) {
             return *batch;
         }
     }
 
     DrawBatch batch(*this, format, format_stride, element_type, primitive_type);
     batches.push_back(batch);
+    updated = true;
     return batches.back();
 }
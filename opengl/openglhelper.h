@@ -2,10 +2,15 @@
 #define OPENGLHELPER_H
 
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
 #include <thread>
 #include <functional>
 #include <vector>
 #include <atomic>
+#include <algorithm>
+#include <cmath>
 
 #include <glm/glm.hpp>
 
@@ -23,7 +28,22 @@ class QOpenGLExtension_ARB_separate_shader_objects;
 class QOpenGLExtension_ARB_debug_output;
 class QOpenGLExtension_ARB_texture_buffer_object;
 typedef void (*QOpenGLExtension_ARB_buffer_storage) (int target, ptrdiff_t size, const void *data, int flags);
+
+// Entry points past the 3.2 core functions, null when not supported
+struct QOpenGLExtension_ARB_compute
+{
+    void (*glDispatchCompute) (unsigned int num_groups_x, unsigned int num_groups_y, unsigned int num_groups_z);
+    void (*glMemoryBarrier) (unsigned int barriers);
+    void (*glClearBufferData) (int target, int internal_format, int format, int type, const void *data);
+    void (*glMultiDrawElementsIndirectCountARB) (int mode, int type, const void *indirect, ptrdiff_t drawcount,
+                                                 int maxdrawcount, int stride);
+    void (*glMultiDrawArraysIndirectCountARB) (int mode, const void *indirect, ptrdiff_t drawcount,
+                                               int maxdrawcount, int stride);
+    void (*glBindImageTexture) (unsigned int unit, unsigned int texture, int level, unsigned char layered,
+                                int layer, int access, int format);
+};
 class QOpenGLFunctions_3_2_Core;
+typedef struct __GLsync *GLsync;
 
 typedef float Scalar;
 
@@ -107,8 +127,45 @@ public:
     }
 };
 
+class SpinLock
+{
+public:
+    void lock()
+    {
+        while (flag.test_and_set(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+
+    void unlock()
+    {
+        flag.clear(std::memory_order_release);
+    }
+private:
+    std::atomic_flag flag = ATOMIC_FLAG_INIT;
+};
+
+class ScopedSpinLock
+{
+public:
+    ScopedSpinLock(SpinLock& lock) : lock(lock)
+    {
+        lock.lock();
+    }
+
+    ~ScopedSpinLock()
+    {
+        lock.unlock();
+    }
+
+    SpinLock& lock;
+};
+
 class StreamedBuffer
 {
+public:
+    static const size_t NUM_FRAMES = 3;
+
 protected:
 
     struct Allocation
@@ -117,115 +174,141 @@ protected:
         size_t end;
     };
 
-    typedef std::map<size_t, std::list<Allocation>> FreeList;
-    typedef std::list<Allocation> SafeList;
+    // Two level segregated fit, the first level splits free blocks by power
+    // of two and the second splits each power of two linearly so finding a
+    // block that fits is two bit scans rather than a walk.
+    static const int SL_LOG2 = 4;
+    static const int SL_COUNT = 1 << SL_LOG2;
+    static const int FL_COUNT = sizeof(size_t) * 8 - SL_LOG2 + 1;
+    static const uint32_t NO_BLOCK = ~0u;
+
+    struct Block
+    {
+        size_t start;
+        size_t size;
+        uint32_t prev_free;
+        uint32_t next_free;
+    };
+
+    typedef std::vector<Allocation> FreeList;
+    typedef std::unordered_map<size_t, uint32_t> BlockMap;
+
+    // Threads are striped over a few caches so concurrent uploads mostly
+    // reuse blocks and queue frees without touching the shared index.
+    static const size_t NUM_CACHES = 8;
+    static const size_t CACHE_BLOCKS = 16;
 
-    FreeList free_list;
-    SafeList safe_list;
+    struct ThreadCache
+    {
+        ThreadCache() : num_blocks(0) {}
+        SpinLock lock;
+        size_t num_blocks;
+        Allocation blocks[CACHE_BLOCKS];
+        FreeList free_list[NUM_FRAMES];
+    };
+
+    ThreadCache caches[NUM_CACHES];
+
+    // Block bookkeeping is kept out of the mapped memory so the GPU data is
+    // never read back by the CPU.
+    SpinLock index_lock;
+    size_t free_bytes; // bytes held in free blocks below current_pos
+    std::vector<Block> blocks;
+    std::vector<uint32_t> unused_blocks;
+    BlockMap blocks_by_start;
+    BlockMap blocks_by_end;
+    uint64_t fl_bitmap;
+    uint32_t sl_bitmap[FL_COUNT];
+    uint32_t free_heads[FL_COUNT][SL_COUNT];
+
+    // Growth replaces data so it waits for writers to leave, see ScopedBufferWrite
+    SpinLock grow_lock;
+    std::atomic<bool> resizing;
+    std::atomic<int> writers;
+
+    ThreadCache& get_cache();
+    bool take_cached(size_t size, size_t& pos);
+    bool take_free(size_t size, size_t& pos);
+    void insert_free(size_t start, size_t size);
+    void link_free(size_t start, size_t size);
+    void remove_free(uint32_t block);
+    uint32_t find_free(size_t size) const;
+    bool reserve(size_t bytes);
 public:
-    static const size_t NUM_FRAMES = 3;
+    // Returned by reallocate when the buffer can't grow, 0 is a valid offset
+    static const size_t NO_SPACE = ~(size_t)0;
+
+    // Called when the linear region runs out, must replace buffer, data and
+    // max_bytes with storage of at least the requested size and keep contents.
+    typedef std::function<bool(StreamedBuffer&, size_t)> GrowFunction;
+
+    // Called by reallocate to move bytes from one position to another on the
+    // GPU, the mapping is write only so they can't be read back.
+    typedef std::function<bool(StreamedBuffer&, size_t, size_t, size_t)> CopyFunction;
+
+    StreamedBuffer();
+    StreamedBuffer(const StreamedBuffer&) = delete;
+    StreamedBuffer& operator=(const StreamedBuffer&) = delete;
+    virtual ~StreamedBuffer() {}
 
-    StreamedBuffer() : buffer(0), offset(0),
-        max_bytes(0), current_pos(0), frame_num(0), data(nullptr) {}
     unsigned int buffer;
     size_t offset; // meant of offset into buffer e.g. per vertex format type if sharing one buffer
-    size_t max_bytes;
-    size_t current_pos; // current position in bytes from offset
-    size_t frame_num;
+    std::atomic<size_t> max_bytes;
+    std::atomic<size_t> current_pos; // current position in bytes from offset
+    std::atomic<size_t> frame_num;
     char *data; // This should take into account the buffer offset
+    GrowFunction grow;
+    CopyFunction copy;
+    std::function<void(StreamedBuffer&)> relocated; // buffer, offset or data changed
+    StreamedBuffer* parent; // arena the region lives in, if any
 
-    // TODO make this more efficient?
-    // TODO thread safety, etc.
-    virtual size_t allocate(size_t size)
-    {
-        size_t pos = 0;
-        // scoped cas lock
-        for (auto zone = safe_list.begin(); zone != safe_list.end(); ++zone) {
-            if ((zone->end - zone->start) >= size) {
-                pos = zone->start;
-
-                size_t overused = (zone->end - zone->start) - size;
-                safe_list.erase(zone);
-                if (overused > 0) {
-                    free(pos + size, overused, true);
-                }
-
-                break;
-            }
-        }
+    // Safe to call from any thread, data must only be written to inside a
+    // ScopedBufferWrite as it moves when the buffer grows.
+    virtual size_t allocate(size_t size);
 
-        if (pos == 0) {
-            if (this->current_pos + size >= this->max_bytes) {
-                // TODO too many draws
-                throw;
-            }
+    // As allocate but returns false instead of throwing when growth fails
+    bool try_allocate(size_t size, size_t& pos);
 
-            pos = this->current_pos;
-            this->current_pos += size;
-        }
-        return pos;
-    }
+    // Only hands out already free blocks, never extends the linear region
+    bool allocate_free(size_t size, size_t& pos);
+
+    // Bytes held in free blocks below current_pos
+    size_t get_free_bytes();
+
+    // Grows an allocation in place if it is the last one in the linear region
+    bool extend(size_t pos, size_t old_size, size_t new_size);
 
     // TODO enforce append only - only new data can change
-    virtual size_t reallocate(size_t pos, size_t old_size, size_t new_size, bool append)
-    {
-        size_t new_pos = 0;
-
-        {
-            // scoped cas lock
-            if (pos + old_size == this->current_pos && append) {
-                new_pos = pos;
-                this->current_pos += (new_size - old_size);
-            } else {
-                new_pos = allocate(new_size);
-            }
-        }
+    // Returns NO_SPACE and keeps the old allocation if it can't be moved,
+    // moving needs a copy function
+    virtual size_t reallocate(size_t pos, size_t old_size, size_t new_size, bool append);
 
-        if (new_pos != 0 && new_pos != pos) {
-            memcpy(this->data + new_pos, this->data + pos, old_size);
-            free(pos, old_size);
-        }
+    virtual void free(size_t start, size_t size, bool safe = false);
 
-        return new_pos;
-    }
+    // Not to be called concurrently with itself, returns cached blocks to
+    // the shared index and reclaims the frame's frees.
+    virtual void advance();
 
-    virtual void free(size_t start, size_t size, bool safe = false)
-    {
-        // scoped cas lock
-        Allocation alloc;
-        alloc.end = start + size;
-        alloc.start = start;
+    void begin_write();
+    void end_write();
+};
 
-        if (safe) {
-            safe_list.push_back(alloc);
-        } else {
-            auto& list = free_list[this->frame_num];
-            list.push_back(alloc);
-        }
+class ScopedBufferWrite
+{
+public:
+    ScopedBufferWrite(StreamedBuffer& buffer) : buffer(buffer)
+    {
+        buffer.begin_write();
+        data = buffer.data;
     }
 
-    virtual void advance()
+    ~ScopedBufferWrite()
     {
-        // TODO this needs GPU sync
-        auto& list = free_list[this->frame_num];
-        for (auto zone = list.begin(); zone != list.end(); ++zone) {
-            Allocation alloc = *zone;
-            for (auto safe_zone = safe_list.begin(); safe_zone != safe_list.end();) {
-                if (safe_zone->start == alloc.end) {
-                    alloc.end = safe_zone->end;
-                    safe_zone = safe_list.erase(safe_zone);
-                } else if (safe_zone->end == alloc.start) {
-                    alloc.start = safe_zone->start;
-                    safe_zone = safe_list.erase(safe_zone);
-                } else {
-                    ++safe_zone;
-                }
-            }
-
-            safe_list.push_back(alloc);
-        }
-        list.clear();
+        buffer.end_write();
     }
+
+    StreamedBuffer& buffer;
+    char* data;
 };
 
 class DrawBuffer : public StreamedBuffer
@@ -249,7 +332,11 @@ public:
 class ShaderBuffer : public StreamedBuffer
 {
 public:
-    ShaderBuffer() {}
+    // Texture unit of the buffer texture, past the render target inputs
+    static const int TEXTURE_UNIT = 7;
+
+    ShaderBuffer() : texture(0) {}
+    unsigned int texture; // texture buffer view, only without storage buffers
 };
 
 class PixelBuffer : public StreamedBuffer
@@ -268,71 +355,66 @@ public:
 
 class DrawBatch;
 
+// Generational handle into a DrawPool, a zero generation is never handed out
+// so a default handle is always stale.
+struct PoolHandle
+{
+    PoolHandle() : index(0), generation(0) {}
+    PoolHandle(uint32_t index, uint32_t generation) : index(index), generation(generation) {}
+
+    uint32_t index;
+    uint32_t generation;
+
+    bool is_null() const { return generation == 0; }
+
+    // Packed so it can be stored in a node's value
+    void* to_value() const
+    {
+        return (void*)(((uintptr_t)generation << 32) | index);
+    }
+
+    static PoolHandle from_value(void* value)
+    {
+        return PoolHandle((uint32_t)((uintptr_t)value & 0xffffffff), (uint32_t)((uintptr_t)value >> 32));
+    }
+};
+
+typedef PoolHandle DrawHandle;
+typedef PoolHandle InstanceHandle;
+
 class Material
 {
 public:
+    Material() : updated(false), pass(0), frag(0), vert(0), frag_offset(0), total_objects(0), id(0),
+        batch_material(nullptr), params_material(nullptr) {}
+
     std::string name;
-    std::vector<DrawBatch> batches;
+    std::list<DrawBatch> batches; // stable addresses, held by DrawPool slots
+    bool updated; // a batch needs writing
     unsigned int pass;
     unsigned int frag;
     unsigned int vert;
-    unsigned int frag_params;
+    std::vector<char> frag_params; // copied to the uniform ring every frame
+    size_t frag_offset; // of this frame's copy
     size_t total_objects;
     size_t id;
     bool operator<(const Material& b) const {
         return this->name.compare(b.name) < 0;
     }
 
-    DrawBatch& get_batch(const VertexFormat& format, size_t format_stride, size_t primitive_type, size_t element_type);
-};
-
-class DrawInstance
-{
-public:
-    DrawInstance(const DrawInfoBuffer::DrawInfo& draw_info) : draw_info(draw_info), updated(true) {}
-    void update(const DrawInfoBuffer::DrawInfo& draw_info);
-
-    bool operator==(const DrawInstance& b) const {
-        return this->draw_info == b.draw_info;
-    }
-//private:
-    bool updated;
-    DrawInfoBuffer::DrawInfo draw_info;
-};
-
-class Draw
-{
-public:
-    size_t verts;
-    size_t elements;
-    size_t vert_offset;
-    size_t element_offset;
-
-    Draw(size_t verts, size_t elements, size_t vert_offset, size_t element_offset)
-        : verts(verts), elements(elements), vert_offset(vert_offset), element_offset(element_offset)
-        , num_instances(0), buffer_offset(0), updated(true)
-    {
-    }
+    // Set when merged with a material on the same pipeline, its batches
+    // and parameters are shared and draws index them by draw_info[2].
+    Material* batch_material;
 
-    DrawInstance& add_instance(const DrawInfoBuffer::DrawInfo& draw_info);
-    void remove_instance(const DrawInstance& draw_id);
+    Material& get_batch_material() { return batch_material != nullptr ? *batch_material : *this; }
 
-    bool operator==(const Draw& b) const {
-        return this->verts == b.verts && this->elements == b.elements
-                && this->vert_offset == b.vert_offset
-                && this->element_offset == b.element_offset;
-    }
+    // Set when this material reads another material's parameters
+    Material* params_material;
 
-    DrawInstance* get_base_instance()
-    {
-        return (instances.size() > 0) ? &instances.front() : nullptr;
-    }
+    const Material& get_params_material() const { return params_material != nullptr ? *params_material : *this; }
 
-//private
-    bool updated;
-    size_t num_instances;
-    size_t buffer_offset;
-    std::list<DrawInstance> instances;
+    DrawBatch& get_batch(const VertexFormat& format, size_t format_stride, size_t primitive_type, size_t element_type);
+    void set_params(size_t offset, const void* data, size_t size);
 };
 
 typedef struct {
@@ -355,7 +437,7 @@ class DrawBatch
 public:
     DrawBatch(Material& material, const VertexFormat& format, int format_stride, int element_type, int primitive_type)
         : material(material), format(format), format_stride(format_stride), element_type(element_type), buffer_offset(0),
-          num_draws(0), primitive_type(primitive_type), updated(true)
+          num_draws(0), primitive_type(primitive_type), cull_index(0), updated(true), draws_updated(true)
     {
         if (element_type != 0) {
             draw_stride = sizeof(DrawElementsIndirectCommand);
@@ -372,22 +454,202 @@ public:
     int num_draws;
     int draw_stride;
     int primitive_type;
+    int cull_index; // position in the GPU culling draw counts
 
-    Draw& add_draw(size_t verts, size_t elements, size_t vert_offset, size_t element_offset);
+    size_t get_num_draws() const { return verts.size(); }
 
-    void remove_draw(const Draw& batch_id);
+    // Structural changes reallocate the batch's commands, otherwise only
+    // draws flagged as updated are rewritten.
+    void mark_updated(bool structural);
+    void mark_draw_updated(size_t draw, bool structural);
 //private
     bool updated;
-    std::list<Draw> draws;
+    bool draws_updated;
+
+    // Instances of a single draw, their draw info is written contiguously
+    struct Instances
+    {
+        std::vector<DrawInfoBuffer::DrawInfo> draw_info;
+        std::vector<uint32_t> slots;
+        std::vector<char> updated;
+    };
+
+    // Draws stored as parallel arrays indexed by their command position,
+    // removal swaps the last draw into the hole.
+    std::vector<size_t> verts;
+    std::vector<size_t> elements;
+    std::vector<size_t> vert_offset;
+    std::vector<size_t> element_offset;
+    std::vector<size_t> num_instances;
+    std::vector<size_t> info_offset;
+    std::vector<char> draw_updated;
+    std::vector<char> instances_updated;
+    std::vector<char> visible;
+    std::vector<uint32_t> slots;
+    std::vector<Instances> instances;
+    std::vector<std::pair<size_t, size_t>> freed_info; // offset, instances of removed draws
+};
+
+// Bounding volume hierarchy over world boxes, items are small integer ids.
+// Built with the surface area heuristic, added items are inserted into the
+// leaf growing least and removed ones taken out of theirs until enough have
+// changed to build it again, moved items only refit their ancestors.
+class BoundingVolumeHierarchy
+{
+public:
+    static const uint32_t NONE = 0xffffffff;
+
+    BoundingVolumeHierarchy() : num_items(0), num_built(0), num_changes(0) {}
+
+    void set(uint32_t item, const glm::vec3& center, const glm::vec3& extent);
+    void remove(uint32_t item);
+    size_t size() const { return num_items; }
+    // Items set or removed since the last update, each counted once
+    size_t num_pending() const { return pending.size(); }
+
+    // Applies the changes since the last update, queries see the tree as of then
+    void update();
+
+    // Items whose box is not fully behind any of the six planes
+    void query_frustum(const glm::vec4* planes, std::vector<uint32_t>& result) const;
+    // Items whose box the ray enters within max_distance, with the entry
+    // distance in units of direction, nearest first
+    void query_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance,
+                   std::vector<std::pair<float, uint32_t>>& result) const;
+    // Item whose box is closest to the point, NONE when none is within max_distance
+    uint32_t query_nearest(const glm::vec3& point, float max_distance, float& distance) const;
+private:
+    static const uint32_t LEAF_SIZE = 4;
+    static const uint32_t NUM_BINS = 12;
+
+    // Inner nodes have a count of 0 and their children at first and first + 1
+    struct Node
+    {
+        glm::vec3 min;
+        glm::vec3 max;
+        uint32_t first;
+        uint32_t count;
+    };
+
+    void rebuild();
+    void build(uint32_t node, uint32_t first, uint32_t count);
+    void insert(uint32_t item);
+    void erase(uint32_t item);
+    void fit(uint32_t node);
+    void refit(uint32_t node);
+    void collect(uint32_t node, std::vector<uint32_t>& result) const;
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> parents;
+    std::vector<uint32_t> order; // items in leaf order
+    std::vector<uint32_t> leaf; // node holding each item, NONE outside the tree
+    std::vector<glm::vec3> item_min;
+    std::vector<glm::vec3> item_max;
+    std::vector<char> present;
+    std::vector<char> queued; // in pending
+    std::vector<uint32_t> pending;
+    size_t num_items;
+    size_t num_built; // items in the tree when last built
+    size_t num_changes; // items inserted or erased since
+};
+
+class DrawPool
+{
+public:
+    static const uint32_t NONE = 0xffffffff;
+
+    DrawPool() : free_head(NONE) {}
+
+    DrawHandle add_draw(DrawBatch& batch, size_t verts, size_t elements, size_t vert_offset, size_t element_offset);
+    void remove_draw(DrawHandle draw);
+
+    InstanceHandle add_instance(DrawHandle draw, const DrawInfoBuffer::DrawInfo& draw_info);
+    void remove_instance(InstanceHandle instance);
+    InstanceHandle get_base_instance(DrawHandle draw) const;
+
+    // Draw an instance belongs to, the handle itself for draws
+    DrawHandle get_draw(PoolHandle handle) const;
+    DrawBatch* get_batch(PoolHandle handle) const;
+    bool get_geometry(DrawHandle draw, size_t& verts, size_t& elements,
+                      size_t& vert_offset, size_t& element_offset) const;
+
+    // Returns false if the handle is stale
+    bool update_instance(InstanceHandle instance, const DrawInfoBuffer::DrawInfo& draw_info);
+    bool get_instance_info(InstanceHandle instance, DrawInfoBuffer::DrawInfo& draw_info) const;
+
+    bool is_valid(PoolHandle handle) const { return get_slot(handle) != nullptr; }
+
+    // World space box of an instance, instances without one are never culled
+    void set_bounds(InstanceHandle instance, const glm::vec3& center, const glm::vec3& extent);
+    bool has_bounds(InstanceHandle instance) const;
+
+    // Returns false for slots without bounds
+    bool get_bounds(uint32_t slot, glm::vec3& center, glm::vec3& extent) const;
+
+    // Marks every slot visible in any of the views, all of them when empty
+    void cull(const glm::mat4x4* view_projections, size_t num_views);
+    bool is_visible(uint32_t slot) const { return visible[slot] != 0; }
+    // Bounds changes not yet applied to the tree, at most one per slot
+    size_t num_pending_bounds() const { return bvh.num_pending(); }
+
+    // Instances whose box the segment crosses, nearest first
+    void intersect_ray(const glm::vec3& from, const glm::vec3& to, std::vector<InstanceHandle>& result);
+    // Instance whose box is closest to the point, null when none is within max_distance
+    InstanceHandle find_nearest(const glm::vec3& point, float max_distance);
+
+    size_t get_num_slots() const { return slot_table.size(); }
+    // Batch and draw of a live slot, instance is NONE for draws
+    bool get_slot_info(uint32_t slot, const DrawBatch*& batch, uint32_t& draw, uint32_t& instance) const;
+
+    // Slots created, destroyed or given new bounds, or marked by the owner
+    // of the batches, each listed once until taken
+    void mark_changed(uint32_t slot);
+    void take_changed(std::vector<uint32_t>& slots);
+private:
+    struct Slot
+    {
+        uint32_t generation;
+        uint32_t next_free;
+        DrawBatch* batch;
+        uint32_t draw;
+        uint32_t instance; // NONE for draws
+    };
+
+    PoolHandle create_slot(DrawBatch* batch, uint32_t draw, uint32_t instance);
+    void destroy_slot(uint32_t index);
+    void reset_bounds(uint32_t index);
+    const Slot* get_slot(PoolHandle handle) const;
+    Slot* get_slot(PoolHandle handle);
+
+    std::vector<Slot> slot_table;
+    uint32_t free_head;
+
+    // Bounds indexed by slot, culling itself goes through the tree
+    std::vector<glm::vec3> centers;
+    std::vector<glm::vec3> extents;
+    std::vector<char> bounded;
+    std::vector<char> visible;
+    BoundingVolumeHierarchy bvh; // bounded slots
+    std::vector<uint32_t> found;
+    std::vector<char> changed;
+    std::vector<uint32_t> changed_slots;
 };
 
 class ShaderPass
 {
 public:
     static const int DISABLED = -1;
+
+    // Actions on the stencil value, DISABLED keeps it
     class StencilOp
     {
+    public:
+        StencilOp(int stencil_fail = DISABLED, int depth_fail = DISABLED, int depth_pass = DISABLED)
+            : stencil_fail(stencil_fail), depth_fail(depth_fail), depth_pass(depth_pass) {}
 
+        int stencil_fail;
+        int depth_fail;
+        int depth_pass;
     };
 
     ShaderPass(const char* name, size_t pass_id, ssize_t in, ssize_t out, bool color_mask, bool depth_mask,
@@ -395,7 +657,8 @@ public:
                int blend_dst, int blend_src, int cull_face, int stencil_func)
         : name(name), pass_id(pass_id), in(in), out(out), color_mask(color_mask), depth_mask(depth_mask),
           stencil_mask(stencil_mask), clear(clear), depth_func(depth_func), blend_equation(blend_equation),
-          blend_dst(blend_dst), blend_src(blend_src), cull_face(cull_face), stencil_func(stencil_func) {}
+          blend_dst(blend_dst), blend_src(blend_src), cull_face(cull_face), stencil_func(stencil_func),
+          stencil_ref(0), copy_depth(false), enabled(true) {}
 
     const char* name;
 
@@ -414,6 +677,14 @@ public:
     int blend_src;
     int cull_face;
     int stencil_func;
+    int stencil_ref;
+    StencilOp stencil_front;
+    StencilOp stencil_back;
+
+    // Depth of the in target is copied to the out target before clearing,
+    // out's own depth is left uncleared
+    bool copy_depth;
+    bool enabled; // skipped when false
 };
 
 struct GlobalParameters
@@ -425,16 +696,323 @@ struct GlobalParameters
     int width;
     int height;
     int render_type;
+    int g_buffer_layout;
+    glm::mat4x4 inverse_view_projection; // at 224, where std140 places it too
+};
+
+// Identifies uploaded geometry by its payload, the format is folded into
+// the hash so equal bytes laid out differently never match.
+struct GeometryKey
+{
+    GeometryKey(const VertexFormat& format, size_t format_stride,
+                const char* vertices, size_t vertex_bytes,
+                const char* elements, size_t element_bytes);
+
+    uint64_t hash[2];
+    size_t vertex_bytes;
+    size_t element_bytes;
+
+    bool operator<(const GeometryKey& b) const {
+        if (hash[0] != b.hash[0]) {
+            return hash[0] < b.hash[0];
+        } else if (hash[1] != b.hash[1]) {
+            return hash[1] < b.hash[1];
+        } else if (vertex_bytes != b.vertex_bytes) {
+            return vertex_bytes < b.vertex_bytes;
+        }
+        return element_bytes < b.element_bytes;
+    }
+};
+
+// World matrices of a node hierarchy, nodes are grouped by depth so every
+// level only reads parents finished in the level before it
+class TransformHierarchy
+{
+public:
+    typedef uint32_t Index;
+    static const Index NONE = 0xffffffff;
+    static const size_t NO_OUTPUT = ~(size_t)0;
+    static const size_t AFFINE_BYTES = 3 * 4 * sizeof(float);
+
+    TransformHierarchy() : free_head(NONE) {}
+
+    Index add(Index parent, void* value);
+    // Removes the node's children as well, their values are added to removed
+    void remove(Index id, std::vector<void*>* removed = nullptr);
+
+    void set_local(Index id, const glm::mat4x4& matrix);
+    // Moves the node and its children under another parent
+    void set_parent(Index id, Index parent);
+    Index get_parent(Index id) const { return parent[id]; }
+    // Byte offset the world matrix is written to on update, as the three
+    // rows of its affine part (AFFINE_BYTES)
+    void set_output(Index id, size_t pos) { output[id] = pos; }
+    void* get_value(Index id) const { return value[id]; }
+    const glm::mat4x4& get_world(Index id) const { return world[id]; }
+    size_t size() const { return parent.size(); }
+
+    // Recomputes the world matrix of every node below a changed local one,
+    // levels large enough are split over the thread pool
+    void update(char* data);
+    // Nodes whose world matrix changed in the last update
+    const std::vector<Index>& get_updated() const { return updated; }
+private:
+    static const size_t PARALLEL_LEVEL = 4096;
+
+    void update_range(const Index* ids, size_t count, char* data, std::vector<Index>& result);
+    void unlink(Index id);
+    void set_depth(Index id, uint32_t level);
+
+    std::vector<std::vector<Index>> levels;
+    std::vector<uint32_t> level_pos;
+    std::vector<uint32_t> depth; // NONE for free ids
+    std::vector<Index> parent; // next free id for free ids
+    std::vector<glm::mat4x4> local;
+    std::vector<glm::mat4x4> world;
+    std::vector<char> dirty; // local changed, or world changed during update
+    std::vector<size_t> output;
+    std::vector<void*> value;
+    std::vector<Index> updated;
+    Index free_head;
+};
+
+// Content hash of a shader parameter record
+struct ParameterKey
+{
+    ParameterKey(const char* data, size_t size);
+
+    uint64_t hash[2];
+    size_t size;
+
+    bool operator<(const ParameterKey& b) const {
+        if (hash[0] != b.hash[0]) {
+            return hash[0] < b.hash[0];
+        } else if (hash[1] != b.hash[1]) {
+            return hash[1] < b.hash[1];
+        }
+        return size < b.size;
+    }
+};
+
+// View space grid of light lists. Lights are spheres added to every
+// cluster their bounds overlap, depth is split logarithmically.
+class LightClusters
+{
+public:
+    static const uint32_t GRID_X = 16;
+    static const uint32_t GRID_Y = 9;
+    static const uint32_t GRID_Z = 24;
+    static const uint32_t NUM_CLUSTERS = GRID_X * GRID_Y * GRID_Z;
+
+    void set_light(uint32_t index, const glm::vec3& center, float radius);
+    void remove_light(uint32_t index);
+    bool empty() const { return num_lights == 0; }
+
+    // Offset and count per cluster followed by the light indices they point at
+    void build(const glm::mat4x4& view, const glm::mat4x4& projection, std::vector<uint32_t>& result);
+private:
+    struct Range
+    {
+        uint32_t light;
+        uint32_t min[3];
+        uint32_t max[3];
+    };
+
+    // Indexed by light, radius < 0 for unused
+    std::vector<float> center_x;
+    std::vector<float> center_y;
+    std::vector<float> center_z;
+    std::vector<float> radius;
+    size_t num_lights = 0;
+    std::vector<Range> ranges;
+};
+
+struct GeometryStats
+{
+    GeometryStats() : uploads(0), shared(0), collisions(0), bytes_uploaded(0), bytes_saved(0) {}
+    size_t uploads;         // geometry written to the vertex and index buffers
+    size_t shared;          // geometry matched to an earlier upload
+    size_t collisions;      // hash matches whose bytes differed, uploaded again
+    uint64_t bytes_uploaded;
+    uint64_t bytes_saved;
+};
+
+struct CullingStats
+{
+    CullingStats() : visible_instances(0), culled_instances(0),
+        visible_draws(0), culled_draws(0) {}
+    size_t visible_instances;
+    size_t culled_instances;
+    size_t visible_draws;
+    size_t culled_draws;    // draws with every instance outside both eyes
+};
+
+struct FrameSyncStats
+{
+    FrameSyncStats() : frames(0), stalls(0), deferred(0), skipped(0),
+        stall_time_ns(0), max_stall_time_ns(0) {}
+    size_t frames;      // frames whose fences have been checked
+    size_t stalls;      // frames where the CPU blocked on the GPU
+    size_t deferred;    // frames where reclamation was skipped while polling
+    size_t skipped;     // frames dropped as the uniform slice was in use, too small or its wait failed
+    uint64_t stall_time_ns;
+    uint64_t max_stall_time_ns;
+};
+
+// Inputs of cull.comp laid out as std430, one of each per DrawPool slot
+struct CullInstance
+{
+    static const uint32_t NONE = 0xffffffff;
+
+    glm::vec3 center;
+    uint32_t draw;      // slot of the instance's draw, NONE for slots without an instance
+    glm::vec3 extent;
+    uint32_t bounded;
+    uint32_t info;      // index of the instance's draw info
+    uint32_t pad[3];
+};
+
+struct CullDraw
+{
+    uint32_t count;         // vertices or elements
+    uint32_t first;         // first vertex or element
+    uint32_t base_vertex;   // element draws only
+    uint32_t info_first;    // where the draw's visible instances' draw info starts
+    uint32_t stride;        // words per command, 0 for slots without a draw
+    uint32_t command;       // first word of the draw's command
+    uint32_t batch;
+    uint32_t batch_command; // first word of the batch's commands
+};
+
+// Commands built on the GPU go to per-frame copies of the draw buffer, with
+// the draw info of visible instances packed into per-frame copies of the
+// draw info buffer, so the streams written by the CPU are left untouched.
+struct ComputeCulling
+{
+    ComputeCulling() : program(0), instances(0), draws(0), visibility(0), command_bytes(0),
+        info_bytes(0), num_slots(0), capacity(0), num_batches(0), updated(true), enabled(false),
+        active(false), compact(false)
+    {
+        for (size_t i = 0; i < StreamedBuffer::NUM_FRAMES; ++i) {
+            culled_commands[i] = 0;
+            culled_info[i] = 0;
+            draw_counts[i] = 0;
+        }
+    }
+
+    unsigned int program;
+    unsigned int instances;     // CullInstance per slot
+    unsigned int draws;         // CullDraw per slot
+    unsigned int visibility;    // visible instances per draw slot
+    unsigned int culled_commands[StreamedBuffer::NUM_FRAMES];
+    unsigned int culled_info[StreamedBuffer::NUM_FRAMES];
+    unsigned int draw_counts[StreamedBuffer::NUM_FRAMES];
+    size_t command_bytes;
+    size_t info_bytes;
+    size_t num_slots;   // entries the dispatches cover
+    size_t capacity;    // entries the buffers hold
+    size_t num_batches;
+    std::vector<CullInstance> instance_data; // as uploaded
+    std::vector<CullDraw> draw_data;
+    std::vector<uint32_t> changed;
+    bool updated;   // every entry needs uploading
+    bool enabled;
+    bool active;    // commands for this frame were culled on the GPU
+    bool compact;   // culled draws removed and counted per batch
+};
+
+// Replaces a pass's draws with a compute shader shading a tile of its input
+// targets at a time, against only the lights touching the tile.
+struct TiledLighting
+{
+    static const size_t TILE_SIZE = 16;
+    static const size_t MAX_LIGHTS = 768; // light arrays of the lighting shaders
+
+    TiledLighting() : program(0), first_pass(-1), num_passes(0), record_size(0), lights(nullptr),
+        enabled(false), active(false) {}
+
+    unsigned int program;
+    ssize_t first_pass;     // index of the first pass the dispatch replaces
+    size_t num_passes;
+    size_t record_size;     // bytes per light in the lights' parameters
+    const Material* lights; // parameters holding the light records
+    bool enabled;
+    bool active;            // this frame's lighting runs as a dispatch
+};
+
+// Depth pyramids built from each eye's depth after the geometry pass.
+// Instances behind the last pyramids are left out of the early commands,
+// the ones this frame's pyramid no longer hides are drawn by a late pass.
+struct OcclusionCulling
+{
+    static const size_t NUM_EYES = 2;
+    static const size_t TEXTURE_UNIT = 9; // one unit per eye from here
+    static const int RENDER_TYPE = 6;     // debug view tinting late draws
+
+    OcclusionCulling() : program(0), occluded(0), capacity(0), command_bytes(0), info_bytes(0),
+        geometry_pass(-1), enabled(false), active(false)
+    {
+        for (size_t i = 0; i < NUM_EYES; ++i) {
+            pyramid[i] = 0;
+            width[i] = 0;
+            height[i] = 0;
+            levels[i] = 0;
+            valid[i] = false;
+            ready[i] = nullptr;
+            late_visibility[i] = 0;
+            late_commands[i] = 0;
+            late_info[i] = 0;
+        }
+    }
+
+    unsigned int program;   // pyramid build
+    unsigned int occluded;  // per instance, in view but hidden by the pyramids
+    unsigned int pyramid[NUM_EYES];
+    size_t width[NUM_EYES]; // of the first level, half the depth's size
+    size_t height[NUM_EYES];
+    size_t levels[NUM_EYES];
+    glm::mat4x4 view_projection[NUM_EYES]; // of the depth the pyramid holds
+    bool valid[NUM_EYES];
+    GLsync ready[NUM_EYES]; // pyramid written, waited on before culling reads it
+    unsigned int late_visibility[NUM_EYES];
+    unsigned int late_commands[NUM_EYES];
+    unsigned int late_info[NUM_EYES];
+    size_t capacity;        // slots the per slot buffers hold
+    size_t command_bytes;
+    size_t info_bytes;
+    ssize_t geometry_pass;  // index of the pass the late draws are added to
+    bool enabled;
+    bool active;            // this frame's early commands were tested against pyramids
+};
+
+struct LightingStats
+{
+    LightingStats() : frames(0), gpu_time_ns(0), max_gpu_time_ns(0), rejected_lights(0) {}
+    size_t frames;          // eyes whose lighting pass time was read back
+    uint64_t gpu_time_ns;
+    uint64_t max_gpu_time_ns;
+    size_t rejected_lights; // lights past TiledLighting::MAX_LIGHTS, left unlit
 };
 
 class RenderTarget
 {
 public:
     static const size_t MAX_ATTACHMENTS = 6;
+    static const size_t DEPTH_UNIT = 8; // texture unit depth is read from when this is a pass's input
+
+    enum Layout
+    {
+        // RGBA16F position, normal, albedo and emissive with specular in
+        // their alphas
+        RGBA16F,
+        // RGBA8 albedo, RGBA8 specular, RG16F octahedral normal and RGBA8
+        // emissive, position comes from depth
+        COMPACT_G_BUFFER,
+    };
 
     RenderTarget(size_t num_attachments, bool depth)
         : width(0), height(0), num_attachments(num_attachments),
-          use_depth(depth), initialized(false)
+          use_depth(depth), initialized(false), layout(RGBA16F)
     {
     }
 
@@ -445,6 +1023,11 @@ public:
     size_t num_attachments;
     bool use_depth;
     bool initialized;
+    Layout layout;
+
+    unsigned int get_format(size_t attachment) const;
+    // Bytes a pass writing every attachment and depth touches per pixel
+    size_t get_bytes_per_pixel() const;
 
     bool operator<(const RenderTarget& b) const {
         if (this->num_attachments > b.num_attachments) {
@@ -468,7 +1051,7 @@ public:
 class RenderOuputGroup
 {
 public:
-    RenderOuputGroup() :  enabled(false), uniform_offset(0),
+    RenderOuputGroup() :  enabled(false), uniform_offset(0), cluster_offset(0), cluster_bytes(0),
         g_buffer(6, true), back_buffer(1, true)
     {
     }
@@ -483,9 +1066,14 @@ public:
 
     glm::mat4x4 projection;
     glm::mat4x4 view_offset;
+    glm::mat4x4 view;
+    glm::mat4x4 view_projection;
 
     bool enabled;
+    GlobalParameters params; // written to the uniform ring when the frame starts
     size_t uniform_offset;
+    size_t cluster_offset; // this frame's light clusters in the uniform ring
+    size_t cluster_bytes;
     RenderTarget g_buffer;
     RenderTarget back_buffer;
 };
@@ -517,6 +1105,7 @@ public:
         }
         fbos = std::move(old.fbos);
         pipelines = std::move(old.pipelines);
+        vertex_pipelines = std::move(old.vertex_pipelines);
         vaos = std::move(old.vaos);
         surface = old.surface;
         context = old.context;
@@ -527,6 +1116,11 @@ public:
         sso = old.sso;
         tex = old.tex;
         buffer = old.buffer;
+        compute = old.compute;
+        has_compute = old.has_compute;
+        has_indirect_parameters = old.has_indirect_parameters;
+        has_storage_buffer = old.has_storage_buffer;
+        has_timer_query = old.has_timer_query;
         debug = old.debug;
         old.reserved = false;
         old.surface = nullptr;
@@ -536,6 +1130,10 @@ public:
         old.sso = nullptr;
         old.tex = nullptr;
         old.buffer = nullptr;
+        old.has_compute = false;
+        old.has_indirect_parameters = false;
+        old.has_storage_buffer = false;
+        old.has_timer_query = false;
         old.debug = nullptr;
         old.vab = nullptr;
         old.used.clear();
@@ -555,16 +1153,22 @@ public:
     QOpenGLExtension_ARB_vertex_attrib_binding* vab;
     QOpenGLExtension_ARB_separate_shader_objects* sso;
     QOpenGLExtension_ARB_buffer_storage buffer;
+    QOpenGLExtension_ARB_compute compute;
+    bool has_compute;
+    bool has_indirect_parameters;
+    bool has_storage_buffer;
+    bool has_timer_query;
     QOpenGLExtension_ARB_texture_buffer_object* tex;
     QOpenGLExtension_ARB_debug_output* debug;
     QOpenGLFunctions_3_2_Core* gl;
     RenderTargetFboMap fbos;
     VertexFormatVaoMap vaos;
     MaterialPipelineMap pipelines;
+    MaterialPipelineMap vertex_pipelines; // no fragment stage, for passes writing no color
 
     int get_vao(const VertexFormat& format);
     int get_fbo(const RenderTarget& render_target);
-    int get_pipeline(const Material& material);
+    int get_pipeline(const Material& material, bool fragment = true);
     void setup_for_pass(const ShaderPass& pass, const RenderOuputGroup& output);
 
     bool make_current();
@@ -607,14 +1211,103 @@ public:
     ContextPoolContext& context;
 };
 
-inline float calc_light_radius(float cutoff, float intensity, float const_att, float linear_att, float quad_att)
+enum BufferUsage
+{
+    VERTEX_BUFFER_USAGE,
+    INDEX_BUFFER_USAGE,
+    DRAW_BUFFER_USAGE,
+    DRAW_INFO_BUFFER_USAGE,
+    SHADER_BUFFER_USAGE,
+    PIXEL_BUFFER_USAGE,
+    PARAMETER_BUFFER_USAGE,
+    NUM_BUFFER_USAGES
+};
+
+// One persistent mapped buffer per usage, regions inside it are handed out
+// as StreamedBuffers whose offset is their start in the arena.
+class BufferArena : public StreamedBuffer
+{
+public:
+    BufferArena() : initial_bytes(0), budget(0) {}
+    size_t initial_bytes;
+    size_t budget; // the arena never grows past this
+    std::vector<StreamedBuffer*> regions;
+};
+
+class BufferManager
+{
+public:
+    static const size_t REGION_ALIGNMENT = 256;
+
+    BufferManager(ContextPool& context_pool);
+    ~BufferManager();
+
+    void set_budget(BufferUsage usage, size_t initial_bytes, size_t budget);
+    void create_region(BufferUsage usage, StreamedBuffer& region, size_t size);
+    size_t get_reserved_bytes(BufferUsage usage) const;
+    void advance(size_t frame_num, bool reclaim);
+
+    void fence_copies(ContextPoolContext& context);
+    void wait_for_copies(ContextPoolContext& context);
+    void release_copies(ContextPoolContext& context);
+private:
+    bool grow_arena(BufferArena& arena, size_t required);
+    bool grow_region(BufferArena& arena, StreamedBuffer& region, size_t required);
+    bool copy_range(StreamedBuffer& buffer, size_t from, size_t to, size_t size);
+    void finish_copies(ContextPoolContext& context);
+
+    ContextPool& context_pool;
+    BufferArena arenas[NUM_BUFFER_USAGES];
+    GLsync copy_fence;
+};
+
+// Per frame constants, one slice of a persistently mapped buffer for each
+// frame in flight. A slice is rewritten only after the frame that last used
+// it has retired, so writes never wait on the driver.
+class UniformRing
+{
+public:
+    // Returned by write when the slice is full
+    static const size_t NO_SPACE = ~(size_t)0;
+
+    UniformRing() : buffer(0), data(nullptr), slice_bytes(0), alignment(256), slice(0), pos(0) {}
+
+    void create(ContextPoolContext& context, size_t slice_bytes, size_t alignment);
+    // The frame's slot must have been reclaimed. Slices that overflowed
+    // last frame are grown here, replacing buffer.
+    void begin_frame(ContextPoolContext& context, size_t frame_num);
+    // Returns the offset in buffer to bind the copy at, or NO_SPACE
+    size_t write(const void* data, size_t size);
+    // The frame wrote more than a slice holds and can't be drawn
+    bool overflowed() const { return pos > slice_bytes; }
+
+    unsigned int buffer;
+private:
+    char* data;
+    size_t slice_bytes;
+    size_t alignment;
+    size_t slice;
+    size_t pos; // keeps counting past the end so the slice can be grown to fit
+};
+
+// Distance at which the X3D attenuation 1 / max(c + l*d + q*d^2, 1) brings
+// the light's intensity below LIGHT_THRESHOLD, max_radius when it never does
+static const float LIGHT_THRESHOLD = 1.0f / 256.0f;
+
+inline float calc_light_radius(float cutoff, float intensity, float const_att, float linear_att, float quad_att,
+                               float max_radius)
 {
     Q_UNUSED(cutoff);
-    Q_UNUSED(intensity);
-    Q_UNUSED(const_att);
-    Q_UNUSED(linear_att);
-    Q_UNUSED(quad_att);
-    return 1.0;
+    float k = intensity / LIGHT_THRESHOLD - const_att;
+    float radius = max_radius;
+    if (k <= 0.0f) {
+        radius = 0.0f;
+    } else if (quad_att > 0.0f) {
+        radius = (-linear_att + std::sqrt(linear_att * linear_att + 4.0f * quad_att * k)) / (2.0f * quad_att);
+    } else if (linear_att > 0.0f) {
+        radius = k / linear_att;
+    }
+    return std::min(radius, max_radius);
 }
 
 inline size_t align(size_t val, size_t alignment)
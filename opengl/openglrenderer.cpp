@@ -16,21 +16,40 @@
 #include <QFuture>
 #include <QtConcurrent/QtConcurrentRun>
 #include <QThreadPool>
+#include <QElapsedTimer>
 
 #include "opengloutput.h"
 
 OpenGLRenderer::OpenGLRenderer()
+    : buffer_manager(context_pool)
 {
     frame_num = 0;
     render_type = 0;
+    frame_reclaimable = true;
+    frame_sync_blocking = true;
+    compaction_budget = 1024 * 1024;
+    merged_batches = false;
+    frustum_culling = true;
+    clustered_lighting = false;
+    for (size_t i = 0; i < StreamedBuffer::NUM_FRAMES; ++i) {
+        for (size_t j = 0; j < MAX_RENDER_CONTEXTS; ++j) {
+            frame_fences[i][j] = nullptr;
+            lighting_queries[i][j] = 0;
+        }
+    }
 
     ScopedContext context(context_pool, 0);
 
     context.context.gl->glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_alignment);
+    max_parameters = context.context.has_storage_buffer ? NO_PARAMETERS : MAX_UNIFORM_PARAMETERS;
+    if (context.context.has_storage_buffer) {
+        // Light clusters are bound from the same ring as storage buffers
+        int storage_alignment = 0;
+        context.context.gl->glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storage_alignment);
+        uniform_alignment = std::max(uniform_alignment, storage_alignment);
+    }
 
-    context.context.gl->glGenBuffers(1, &this->global_uniforms);
-    context.context.gl->glBindBuffer(GL_UNIFORM_BUFFER, this->global_uniforms);
-    context.context.gl->glBufferData(GL_UNIFORM_BUFFER, 65536, nullptr, GL_DYNAMIC_DRAW);
+    uniforms.create(context.context, 4 * 1024 * 1024, uniform_alignment);
 }
 
 OpenGLRenderer::~OpenGLRenderer()
@@ -55,50 +74,119 @@ void OpenGLRenderer::render_viewpoint(OpenGLRenderer* renderer, const RenderOupu
     ScopedContext context(renderer->context_pool, context_id);
 
     unsigned int last_vao = 0;
-    unsigned int vao = 0;
 
-    context.context.gl->glBindBufferRange(GL_UNIFORM_BUFFER, 0, renderer->global_uniforms, output.uniform_offset, sizeof(GlobalParameters));
-    context.context.gl->glBindBufferBase(GL_UNIFORM_BUFFER, 1, renderer->transform_buffer.buffer);
+    renderer->buffer_manager.wait_for_copies(context.context);
+
+    context.context.gl->glBindBufferRange(GL_UNIFORM_BUFFER, 0, renderer->uniforms.buffer, output.uniform_offset, sizeof(GlobalParameters));
+    const ShaderBuffer& transforms = renderer->transform_buffer;
+    if (transforms.texture != 0) {
+        context.context.gl->glActiveTexture(GL_TEXTURE0 + ShaderBuffer::TEXTURE_UNIT);
+        context.context.gl->glBindTexture(GL_TEXTURE_BUFFER, transforms.texture);
+    } else if (transforms.buffer != 0) {
+        context.context.gl->glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, transforms.buffer,
+                                              transforms.offset, transforms.max_bytes);
+    }
+
+    const ShaderBuffer& parameters = renderer->parameters;
+    if (parameters.buffer != 0 && context.context.has_storage_buffer) {
+        context.context.gl->glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 3, parameters.buffer,
+                                              parameters.offset, parameters.max_bytes);
+    } else if (parameters.buffer != 0) {
+        // Only the records the uniform block's array covers are reachable
+        context.context.gl->glBindBufferRange(GL_UNIFORM_BUFFER, 4, parameters.buffer, parameters.offset,
+                                              std::min<size_t>(parameters.max_bytes, 65536));
+    }
+
+    if (output.cluster_bytes != 0) {
+        context.context.gl->glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 5, renderer->uniforms.buffer,
+                                              output.cluster_offset, output.cluster_bytes);
+    }
 
-    context.context.gl->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, renderer->draw_calls.buffer);
+    // Culled commands and draw info mirror the layout of the buffers they
+    // were built from, from their start
+    const ComputeCulling& culling = renderer->compute_culling;
+    size_t command_offset = renderer->draw_calls.offset;
+    unsigned int info_buffer = renderer->draw_info.buffer;
+    size_t info_offset = renderer->draw_info.offset;
+    if (culling.active) {
+        context.context.gl->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, culling.culled_commands[renderer->frame_num]);
+        command_offset = 0;
+        info_buffer = culling.culled_info[renderer->frame_num];
+        info_offset = 0;
+        if (culling.compact) {
+            context.context.gl->glBindBuffer(GL_PARAMETER_BUFFER_ARB, culling.draw_counts[renderer->frame_num]);
+        }
+    } else {
+        context.context.gl->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, renderer->draw_calls.buffer);
+    }
     if (renderer->textures.texture != 0) {
         context.context.gl->glActiveTexture(GL_TEXTURE0);
         context.context.gl->glBindTexture(GL_TEXTURE_BUFFER, renderer->textures.texture);
     }
 
+    const TiledLighting& tiled = renderer->tiled_lighting;
+    bool timing = false;
     for (std::vector<ShaderPass>::iterator pass_it = renderer->passes.begin(); pass_it != renderer->passes.end(); ++pass_it) {
-        context.context.setup_for_pass(*pass_it, output);
+        // Lighting passes are timed together, the dispatch stands in for all of them
+        ssize_t lighting_pass = (pass_it - renderer->passes.begin()) - tiled.first_pass;
+        if (timing && lighting_pass == (ssize_t)tiled.num_passes) {
+            context.context.gl->glEndQuery(GL_TIME_ELAPSED);
+            timing = false;
+        }
 
-        for (std::map<std::string, Material>::iterator material_it = renderer->materials.begin(); material_it != renderer->materials.end(); ++material_it) {
-            // TODO make this more efficient
-            if (material_it->second.pass != pass_it->pass_id) {
-                continue;
+        if (tiled.first_pass >= 0 && lighting_pass == 0) {
+            timing = renderer->begin_lighting_timer(context.context, context_id);
+        }
+
+        if (tiled.active && lighting_pass >= 0 && lighting_pass < (ssize_t)tiled.num_passes) {
+            if (lighting_pass == 0) {
+                renderer->dispatch_tiled_lighting(context.context, *pass_it, output);
             }
+            continue;
+        }
 
-            context.context.sso->glBindProgramPipeline(context.context.get_pipeline(material_it->second));
-            //context.context.gl->glBindBufferRange(GL_UNIFORM_BUFFER, 1, material_it->params, 0, sizeof(node));
-            context.context.gl->glBindBufferBase(GL_UNIFORM_BUFFER, 3, material_it->second.frag_params);
-
-            for (std::vector<DrawBatch>::iterator batch_it = material_it->second.batches.begin(); batch_it != material_it->second.batches.end(); ++batch_it) {
-                vao = context.context.get_vao(batch_it->format);
-                if (last_vao != vao) {
-                    last_vao = vao;
-                    context.context.gl->glBindVertexArray(vao);
-                    VertexBuffer& vbo = renderer->get_buffer(batch_it->format);
-                    context.context.vab->glBindVertexBuffer(0, renderer->draw_info.buffer, renderer->draw_info.offset, sizeof(DrawInfoBuffer::DrawInfo));
-                    context.context.vab->glBindVertexBuffer(1, vbo.buffer, vbo.offset, batch_it->format_stride);
-                    context.context.vab->glVertexBindingDivisor(0, 1);
-                    context.context.gl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, renderer->indices.buffer);
-                }
+        if (!pass_it->enabled) {
+            continue;
+        }
 
-                if (batch_it->element_type != 0) {
-                    context.context.indirect->glMultiDrawElementsIndirect(batch_it->primitive_type, batch_it->element_type, (const void*)batch_it->buffer_offset, batch_it->num_draws, batch_it->draw_stride);
-                } else {
-                    context.context.indirect->glMultiDrawArraysIndirect(batch_it->primitive_type, (const void*)batch_it->buffer_offset, batch_it->num_draws, batch_it->draw_stride);
-                }
+        context.context.setup_for_pass(*pass_it, output);
+        renderer->set_occlusion_pass(context.context, *pass_it, 0);
+        renderer->draw_pass(context.context, *pass_it, command_offset, info_buffer, info_offset,
+                            culling.active && culling.compact, last_vao);
+
+        // Draws the last pyramid hid but this frame's depth doesn't are added on top
+        const OcclusionCulling& occlusion = renderer->occlusion_culling;
+        size_t eye = context_id - 1;
+        if (occlusion.enabled && pass_it - renderer->passes.begin() == occlusion.geometry_pass
+                && eye < OcclusionCulling::NUM_EYES) {
+            renderer->build_depth_pyramid(context.context, output, eye);
+            if (renderer->dispatch_late_culling(context.context, output, eye)) {
+                ShaderPass late_pass = *pass_it;
+                late_pass.clear = ShaderPass::DISABLED;
+                context.context.setup_for_pass(late_pass, output);
+                renderer->set_occlusion_pass(context.context, late_pass, 1);
+
+                // Vertex arrays are bound again to pick up the late draw info
+                context.context.gl->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, occlusion.late_commands[eye]);
+                last_vao = 0;
+                renderer->draw_pass(context.context, late_pass, 0, occlusion.late_info[eye], 0, false, last_vao);
+                context.context.gl->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, culling.culled_commands[renderer->frame_num]);
+                last_vao = 0;
             }
         }
     }
+
+    if (timing) {
+        context.context.gl->glEndQuery(GL_TIME_ELAPSED);
+    }
+
+    // Fence the frame so its buffer ranges are only reused once the GPU is done
+    GLsync& fence = renderer->frame_fences[renderer->frame_num][context_id];
+    if (fence != nullptr) {
+        context.context.gl->glDeleteSync(fence);
+    }
+    fence = context.context.gl->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    context.context.gl->glFlush();
 }
 
 void OpenGLRenderer::set_viewpoint_viewport(int, size_t width, size_t height)
@@ -118,10 +206,31 @@ void OpenGLRenderer::set_viewpoint_viewport(int, size_t width, size_t height)
     }
 }
 
-void OpenGLRenderer::set_viewpoint_view(int, const glm::mat4x4 &view)
+void OpenGLRenderer::set_g_buffer_layout(RenderTarget::Layout layout)
 {
-    ScopedContext context(this->context_pool, 0);
+    RenderTarget* targets[] = {&active_viewpoint.left.g_buffer, &active_viewpoint.right.g_buffer};
+    for (size_t i = 0; i < 2; ++i) {
+        RenderTarget& rt = *targets[i];
+        if (rt.layout == layout) {
+            continue;
+        }
+
+        rt.layout = layout;
+        rt.num_attachments = layout == RenderTarget::COMPACT_G_BUFFER ? 4 : 6;
 
+        // Reallocated at the same size in the new formats
+        size_t width = rt.width;
+        size_t height = rt.height;
+        rt.width = 0;
+        rt.height = 0;
+        if (width != 0 && height != 0) {
+            set_render_target_size(rt, width, height);
+        }
+    }
+}
+
+void OpenGLRenderer::set_viewpoint_view(int, const glm::mat4x4 &view)
+{
     // TODO remove duplication
     GlobalParameters left_params;
     left_params.view = view * active_viewpoint.left.view_offset;
@@ -131,24 +240,25 @@ void OpenGLRenderer::set_viewpoint_view(int, const glm::mat4x4 &view)
     left_params.width = active_viewpoint.left.back_buffer.width;
     left_params.height = active_viewpoint.left.back_buffer.height;
     left_params.render_type = this->render_type;
+    left_params.g_buffer_layout = active_viewpoint.left.g_buffer.layout;
+    left_params.inverse_view_projection = glm::inverse(left_params.view_projection);
 
     GlobalParameters right_params;
     right_params.view = view * active_viewpoint.right.view_offset;
     right_params.projection = active_viewpoint.right.projection;
     right_params.view_projection = active_viewpoint.right.projection * right_params.view;
+    active_viewpoint.left.view_projection = left_params.view_projection;
+    active_viewpoint.right.view_projection = right_params.view_projection;
     right_params.position = glm::inverse(right_params.view)[3];
     right_params.width = active_viewpoint.right.back_buffer.width;
     right_params.height = active_viewpoint.right.back_buffer.height;
     right_params.render_type = this->render_type;
-
-    size_t aligned_size = align(sizeof(GlobalParameters), this->uniform_alignment);
-    context.context.gl->glBindBuffer(GL_UNIFORM_BUFFER, this->global_uniforms);
-    char* data = (char*)context.context.gl->glMapBufferRange(GL_UNIFORM_BUFFER, 0, aligned_size * 2, GL_MAP_WRITE_BIT);
-    memcpy(data, &left_params, sizeof(GlobalParameters));
-    memcpy(data + aligned_size, &right_params, sizeof(GlobalParameters));
-    context.context.gl->glUnmapBuffer(GL_UNIFORM_BUFFER);
-
-    active_viewpoint.right.uniform_offset = aligned_size;
+    right_params.g_buffer_layout = active_viewpoint.right.g_buffer.layout;
+    right_params.inverse_view_projection = glm::inverse(right_params.view_projection);
+    active_viewpoint.left.view = left_params.view;
+    active_viewpoint.right.view = right_params.view;
+    active_viewpoint.left.params = left_params;
+    active_viewpoint.right.params = right_params;
 }
 
 void OpenGLRenderer::set_render_target_size(RenderTarget& rt, size_t width, size_t height)
@@ -159,7 +269,8 @@ void OpenGLRenderer::set_render_target_size(RenderTarget& rt, size_t width, size
         rt.height != height)
     {
         if (!rt.initialized) {
-            context.context.gl->glGenTextures(rt.num_attachments, rt.attachments);
+            // Every slot is named so a layout change can add attachments
+            context.context.gl->glGenTextures(RenderTarget::MAX_ATTACHMENTS, rt.attachments);
             if (rt.use_depth) {
                 context.context.gl->glGenTextures(1, &rt.depth);
             }
@@ -174,7 +285,7 @@ void OpenGLRenderer::set_render_target_size(RenderTarget& rt, size_t width, size
             context.context.gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
             context.context.gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
             context.context.gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-            context.context.gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F,
+            context.context.gl->glTexImage2D(GL_TEXTURE_2D, 0, rt.get_format(i),
                                              width, height, 0, GL_RGBA, GL_FLOAT, NULL);
         }
         
@@ -186,7 +297,9 @@ void OpenGLRenderer::set_render_target_size(RenderTarget& rt, size_t width, size
             context.context.gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
             context.context.gl->glTexParameteri(GL_TEXTURE_2D, GL_DEPTH_STENCIL_TEXTURE_MODE, GL_DEPTH_COMPONENT);
             //context.context.gl->glTexParameteri(GL_TEXTURE_2D, GL_DEPTH_TEXTURE_MODE, GL_INTENSITY);
-            context.context.gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+            // Positions are rebuilt from the compact layout's depth, read unfiltered
+            context.context.gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE,
+                                                rt.layout == RenderTarget::COMPACT_G_BUFFER ? GL_NONE : GL_COMPARE_R_TO_TEXTURE);
             context.context.gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
             glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8,
                          width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
@@ -194,8 +307,99 @@ void OpenGLRenderer::set_render_target_size(RenderTarget& rt, size_t width, size
     }
 }
 
+void OpenGLRenderer::draw_pass(ContextPoolContext& context, const ShaderPass& pass, size_t command_offset,
+                               unsigned int info_buffer, size_t info_offset, bool count_buffer,
+                               unsigned int& last_vao)
+{
+    unsigned int vao = 0;
+    for (std::map<std::string, Material>::iterator material_it = materials.begin(); material_it != materials.end(); ++material_it) {
+        // TODO make this more efficient
+        if (material_it->second.pass != pass.pass_id
+                || material_it->second.batch_material != nullptr) {
+            continue;
+        }
+
+        context.sso->glBindProgramPipeline(context.get_pipeline(material_it->second, pass.color_mask));
+        //context.gl->glBindBufferRange(GL_UNIFORM_BUFFER, 1, material_it->params, 0, sizeof(node));
+        const Material& params = material_it->second.get_params_material();
+        if (!params.frag_params.empty()) {
+            context.gl->glBindBufferRange(GL_UNIFORM_BUFFER, 3, uniforms.buffer,
+                                          params.frag_offset, params.frag_params.size());
+        }
+
+        for (std::list<DrawBatch>::iterator batch_it = material_it->second.batches.begin(); batch_it != material_it->second.batches.end(); ++batch_it) {
+            vao = context.get_vao(batch_it->format);
+            if (last_vao != vao) {
+                last_vao = vao;
+                context.gl->glBindVertexArray(vao);
+                VertexBuffer& vbo = get_buffer(batch_it->format);
+                context.vab->glBindVertexBuffer(0, info_buffer, info_offset, sizeof(DrawInfoBuffer::DrawInfo));
+                context.vab->glBindVertexBuffer(1, vbo.buffer, vbo.offset, batch_it->format_stride);
+                context.vab->glVertexBindingDivisor(0, 1);
+                context.gl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices.buffer);
+            }
+
+            const void* commands = (const void*)(command_offset + batch_it->buffer_offset);
+            if (count_buffer) {
+                ptrdiff_t count = batch_it->cull_index * sizeof(GLuint);
+                if (batch_it->element_type != 0) {
+                    context.compute.glMultiDrawElementsIndirectCountARB(batch_it->primitive_type, batch_it->element_type, commands, count, batch_it->num_draws, batch_it->draw_stride);
+                } else {
+                    context.compute.glMultiDrawArraysIndirectCountARB(batch_it->primitive_type, commands, count, batch_it->num_draws, batch_it->draw_stride);
+                }
+            } else if (batch_it->element_type != 0) {
+                context.indirect->glMultiDrawElementsIndirect(batch_it->primitive_type, batch_it->element_type, commands, batch_it->num_draws, batch_it->draw_stride);
+            } else {
+                context.indirect->glMultiDrawArraysIndirect(batch_it->primitive_type, commands, batch_it->num_draws, batch_it->draw_stride);
+            }
+        }
+    }
+}
+
 void OpenGLRenderer::render_viewpoints()
 {
+    // Non-blocking sync never waits for the uniform slice, the frame is
+    // dropped until the GPU has finished with it
+    if (!frame_reclaimable) {
+        reclaim_frame();
+        if (!frame_reclaimable) {
+            ++frame_sync_stats.skipped;
+            return;
+        }
+    }
+
+    {
+        ScopedContext context(this->context_pool, 0);
+        uniforms.begin_frame(context.context, frame_num);
+    }
+
+    active_viewpoint.left.uniform_offset = uniforms.write(&active_viewpoint.left.params, sizeof(GlobalParameters));
+    active_viewpoint.right.uniform_offset = uniforms.write(&active_viewpoint.right.params, sizeof(GlobalParameters));
+    for (auto it = materials.begin(); it != materials.end(); ++it) {
+        Material& material = it->second;
+        if (!material.frag_params.empty()) {
+            material.frag_offset = uniforms.write(material.frag_params.data(), material.frag_params.size());
+        }
+    }
+
+    write_light_clusters(active_viewpoint.left);
+    write_light_clusters(active_viewpoint.right);
+
+    // Offsets past the slice are unusable, the slot is retried with a bigger slice
+    if (uniforms.overflowed()) {
+        ++frame_sync_stats.skipped;
+        return;
+    }
+
+    {
+        ScopedContext context(this->context_pool, 0);
+        prepare_tiled_lighting(context.context);
+        if (dispatch_culling(context.context)) {
+            // Render contexts wait on this before reading the commands
+            buffer_manager.fence_copies(context.context);
+        }
+    }
+
     QFuture<void> left_render;
     if (active_viewpoint.left.enabled) {
         left_render = QtConcurrent::run(render_viewpoint, this, active_viewpoint.left, 1);
@@ -211,9 +415,188 @@ void OpenGLRenderer::render_viewpoints()
 
     right_render.waitForFinished();
 
+    {
+        ScopedContext context(this->context_pool, 0);
+        buffer_manager.release_copies(context.context);
+    }
+
     if (active_viewpoint.output != nullptr) {
         active_viewpoint.output->submit();
     }
 
     ++frame_num %= StreamedBuffer::NUM_FRAMES;
+    reclaim_frame();
+    buffer_manager.advance(frame_num, frame_reclaimable);
+}
+
+void OpenGLRenderer::write_light_clusters(RenderOuputGroup& output)
+{
+    output.cluster_bytes = 0;
+    // Written even with no lights, the clustered pass reads it regardless
+    if (!clustered_lighting || !output.enabled) {
+        return;
+    }
+
+    light_clusters.build(output.view, output.projection, cluster_data);
+    output.cluster_bytes = cluster_data.size() * sizeof(uint32_t);
+    output.cluster_offset = uniforms.write(cluster_data.data(), output.cluster_bytes);
+}
+
+void OpenGLRenderer::reclaim_frame()
+{
+    ScopedContext context(this->context_pool, 0);
+    const auto gl = context.context.gl;
+
+    ++frame_sync_stats.frames;
+
+    // Fences of the frame that last used this slot
+    GLsync* fences = frame_fences[frame_num];
+    bool pending = false;
+    for (size_t i = 0; i < MAX_RENDER_CONTEXTS; ++i) {
+        if (fences[i] == nullptr) {
+            continue;
+        }
+
+        GLenum status = gl->glClientWaitSync(fences[i], 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+            gl->glDeleteSync(fences[i]);
+            fences[i] = nullptr;
+        } else {
+            pending = true;
+        }
+    }
+
+    if (pending && !frame_sync_blocking) {
+        ++frame_sync_stats.deferred;
+        frame_reclaimable = false;
+        return;
+    }
+
+    if (pending && !wait_for_frame()) {
+        // Dropped like a skipped frame, its fences are gone by the next one
+        ++frame_sync_stats.skipped;
+        frame_reclaimable = false;
+        return;
+    }
+
+    frame_reclaimable = true;
+}
+
+bool OpenGLRenderer::wait_for_frame()
+{
+    ScopedContext context(this->context_pool, 0);
+    const auto gl = context.context.gl;
+
+    QElapsedTimer timer;
+    timer.start();
+    GLsync* fences = frame_fences[frame_num];
+    bool failed = false;
+    for (size_t i = 0; i < MAX_RENDER_CONTEXTS; ++i) {
+        if (fences[i] == nullptr) {
+            continue;
+        }
+
+        GLenum status = GL_TIMEOUT_EXPIRED;
+        while (status == GL_TIMEOUT_EXPIRED) {
+            status = gl->glClientWaitSync(fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+        }
+
+        gl->glDeleteSync(fences[i]);
+        fences[i] = nullptr;
+        if (status == GL_WAIT_FAILED) {
+            std::cerr << "Waiting for frame " << frame_num << " failed" << std::endl;
+            failed = true;
+        }
+    }
+
+    uint64_t stall_time = timer.nsecsElapsed();
+    ++frame_sync_stats.stalls;
+    frame_sync_stats.stall_time_ns += stall_time;
+    frame_sync_stats.max_stall_time_ns = std::max(frame_sync_stats.max_stall_time_ns, stall_time);
+    return !failed;
+}
+
+const FrameSyncStats& OpenGLRenderer::get_frame_sync_stats() const
+{
+    return frame_sync_stats;
+}
+
+void OpenGLRenderer::set_frame_sync_blocking(bool blocking)
+{
+    frame_sync_blocking = blocking;
+}
+
+const CullingStats& OpenGLRenderer::get_culling_stats() const
+{
+    return culling_stats;
+}
+
+void OpenGLRenderer::set_frustum_culling(bool culling)
+{
+    frustum_culling = culling;
+}
+
+InstanceHandle OpenGLRenderer::pick_instance(const glm::vec3& from, const glm::vec3& to)
+{
+    std::vector<InstanceHandle> hits;
+    draw_pool.intersect_ray(from, to, hits);
+    return hits.empty() ? InstanceHandle() : hits[0];
+}
+
+const GeometryStats& OpenGLRenderer::get_geometry_stats() const
+{
+    return geometry_stats;
+}
+
+void OpenGLRenderer::reset_geometry_stats()
+{
+    geometry_stats = GeometryStats();
+}
+
+void OpenGLRenderer::set_gpu_culling(bool culling)
+{
+    compute_culling.enabled = culling;
+    // The CPU path rewrites commands without marking their draws
+    compute_culling.updated = true;
+}
+
+void OpenGLRenderer::set_occlusion_culling(bool culling)
+{
+    occlusion_culling.enabled = culling;
+    // Pyramids from before are stale
+    for (size_t i = 0; i < OcclusionCulling::NUM_EYES; ++i) {
+        occlusion_culling.valid[i] = false;
+    }
+    compute_culling.updated = true;
+}
+
+void OpenGLRenderer::set_clustered_lighting(bool clustered)
+{
+    ScopedContext context(this->context_pool, 0);
+    clustered_lighting = clustered && context.context.has_storage_buffer;
+}
+
+void OpenGLRenderer::set_tiled_lighting(bool tiled)
+{
+    tiled_lighting.enabled = tiled;
+}
+
+const LightingStats& OpenGLRenderer::get_lighting_stats() const
+{
+    return lighting_stats;
+}
+
+void OpenGLRenderer::reset_lighting_stats()
+{
+    lighting_stats = LightingStats();
+}
+
+void OpenGLRenderer::set_merged_batches(bool merged)
+{
+    merged_batches = merged;
+    if (merged) {
+        for (auto it = materials.begin(); it != materials.end(); ++it) {
+            merge_material(it->second);
+        }
+    }
 }
@@ -17,11 +17,42 @@ public:
     void set_viewpoint_viewport(int id, size_t width, size_t height);
     void set_viewpoint_view(int id, const glm::mat4x4 &view);
     void render_viewpoints();
+    const FrameSyncStats& get_frame_sync_stats() const;
+    void set_frame_sync_blocking(bool blocking);
+    // Folds materials on the same pipeline and pass into one material's
+    // batches, before any geometry is added. The X3D materials have nothing
+    // to fold: appearances already share x3d-default and index their
+    // parameters per draw, the light materials differ in pass or shader.
+    void set_merged_batches(bool merged);
+    const CullingStats& get_culling_stats() const;
+    const GeometryStats& get_geometry_stats() const;
+    void reset_geometry_stats();
+    void set_frustum_culling(bool culling);
+    // Instance whose world box the segment enters first, null for none
+    InstanceHandle pick_instance(const glm::vec3& from, const glm::vec3& to);
+    void set_gpu_culling(bool culling);
+    // Tests instances against the last frame's depth, needs GPU culling
+    void set_occlusion_culling(bool culling);
+    void set_clustered_lighting(bool clustered);
+    void set_tiled_lighting(bool tiled);
+    void set_g_buffer_layout(RenderTarget::Layout layout);
+    // GPU time of the lighting pass, volumes or tiled, per eye
+    const LightingStats& get_lighting_stats() const;
+    void reset_lighting_stats();
 protected:
     VertexBuffer& get_buffer(const VertexFormat& format);
     IndexBuffer& get_index_buffer();
     PixelBuffer& get_pixel_buffer();
     ShaderBuffer& get_transform_buffer();
+    ShaderBuffer& get_parameter_buffer();
+    // Records the uniform block the shaders fall back to without storage buffers holds
+    static const size_t MAX_UNIFORM_PARAMETERS = 256;
+    static const size_t NO_PARAMETERS = ~(size_t)0;
+
+    // Index of a shader parameter record, identical records share one.
+    // NO_PARAMETERS once the shaders can't index any more.
+    size_t add_parameters(const void* data, size_t size);
+    void release_parameters(size_t index);
     Material* get_material(const size_t& id);
     Material& get_material(const std::string& name);
     void create_material(const std::string& name,
@@ -29,25 +60,94 @@ protected:
                          const std::string& frag, int pass);
     void set_render_target_size(RenderTarget& rt, size_t width, size_t height);
     void write_batches();
+    void advance_buffer(StreamedBuffer& buffer);
+    bool prepare_region(BufferUsage usage, StreamedBuffer& buffer, size_t size);
+    void compact_buffers();
+    void cull_draws();
+    bool dispatch_culling(ContextPoolContext& context);
+    unsigned int get_shader_program(int type, const std::string& filename);
+    void merge_material(Material& material);
+    DrawHandle find_geometry(const GeometryKey& key, const char* vertices, const char* elements, DrawBatch& batch);
+    void add_geometry(const GeometryKey& key, const char* vertices, const char* elements, DrawHandle draw);
+    void write_light_clusters(RenderOuputGroup& output);
 
     static void render_viewpoint(OpenGLRenderer* renderer, const RenderOuputGroup& output, int context_id);
 
     std::map<std::string, Material> materials;
-    unsigned int global_uniforms;
+    DrawPool draw_pool;
+    UniformRing uniforms;
     Viewpoint active_viewpoint;
     ContextPool context_pool;
+    BufferManager buffer_manager;
     std::vector<ShaderPass> passes;
     int render_type;
+    size_t compaction_budget; // bytes moved per frame while compacting
+    bool merged_batches;
+    bool frustum_culling;
+    LightClusters light_clusters;
+    bool clustered_lighting;
+    size_t max_parameters; // records the shaders can index
+    TiledLighting tiled_lighting;
+    LightingStats lighting_stats;
+    OcclusionCulling occlusion_culling;
 private:
+    static const size_t MAX_RENDER_CONTEXTS = 3;
+
+    struct Relocation
+    {
+        DrawBatch* batch;
+        size_t draw;
+        size_t pos;
+        size_t size;
+        bool index;
+    };
+
+    void reclaim_frame();
+    bool wait_for_frame(); // false when a fence wait failed
+    void prepare_tiled_lighting(ContextPoolContext& context);
+    void dispatch_tiled_lighting(ContextPoolContext& context, const ShaderPass& pass, const RenderOuputGroup& output);
+    bool begin_lighting_timer(ContextPoolContext& context, int context_id);
+    // Instances read their draw info from info_buffer at info_offset
+    void draw_pass(ContextPoolContext& context, const ShaderPass& pass, size_t command_offset,
+                   unsigned int info_buffer, size_t info_offset, bool count_buffer, unsigned int& last_vao);
+    void build_depth_pyramid(ContextPoolContext& context, const RenderOuputGroup& output, size_t eye);
+    bool dispatch_late_culling(ContextPoolContext& context, const RenderOuputGroup& output, size_t eye);
+    void set_occlusion_pass(ContextPoolContext& context, const ShaderPass& pass, int late);
+    std::map<std::string, unsigned int> shader_programs;
+    void compact_buffer(StreamedBuffer& buffer, std::vector<Relocation>& relocations, size_t& budget);
     DrawBuffer& get_draw_buffer();
     DrawInfoBuffer& get_draw_info_buffer();
     IndexBuffer indices;
     DrawBuffer draw_calls;
     ShaderBuffer transform_buffer;
+    ShaderBuffer parameters;
+    std::map<ParameterKey, size_t> parameter_cache;
+    std::vector<ParameterKey> parameter_keys;
+    std::vector<size_t> parameter_refs;
+    std::vector<char> parameter_records; // copy of the records, the mapping is write only
     DrawInfoBuffer draw_info;
     PixelBuffer textures;
     size_t frame_num;
+    GLsync frame_fences[StreamedBuffer::NUM_FRAMES][MAX_RENDER_CONTEXTS];
+    bool frame_reclaimable;
+    bool frame_sync_blocking;
+    FrameSyncStats frame_sync_stats;
+    unsigned int lighting_queries[StreamedBuffer::NUM_FRAMES][MAX_RENDER_CONTEXTS];
+    CullingStats culling_stats;
+    ComputeCulling compute_culling;
+    GeometryStats geometry_stats;
+    // Bytes are kept with the draws so a hash match is only shared when they match too
+    struct GeometryEntry
+    {
+        std::vector<char> vertices;
+        std::vector<char> elements;
+        std::vector<DrawHandle> draws;
+    };
+    std::map<GeometryKey, GeometryEntry> geometry_cache;
+    void update_culling_buffers(ContextPoolContext& context);
     int uniform_alignment;
+    std::vector<uint32_t> cluster_data;
+    SpinLock buffers_lock;
     VertexFormatBufferMap buffers;
 };
 
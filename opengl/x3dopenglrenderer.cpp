@@ -16,6 +16,9 @@ using namespace CyberX3D;
 #include <QtGui/QOpenGLFunctions_3_2_Core>
 #include <QtOpenGLExtensions/QOpenGLExtensions>
 #include <QtGui/QOpenGLFramebufferObject>
+#include <QFuture>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrentRun>
 
 class RenderingNodeListener : public Node::NodeListener
 {
@@ -34,25 +37,58 @@ public:
 
     virtual void onUpdated(Node* node)
     {
-
+        renderer->mark_dirty(node);
     }
 
     virtual void onDeleted(Node* node)
     {
-        if (node->isGeometry3DNode() || node->isLightNode()) {
-            /*if (node->isInstanceNode()) {
+        renderer->dirty_nodes.erase(node);
+        renderer->shape_bounds.erase(node);
+        renderer->lod_nodes.erase(node);
+        renderer->transform_parents.erase(node);
+
+        // Descendants go with the node, their ids are dropped so they get new ones
+        auto transform = renderer->transform_ids.find(node);
+        if (transform != renderer->transform_ids.end()) {
+            std::vector<void*> removed;
+            renderer->transforms.remove(transform->second, &removed);
+            for (size_t i = 0; i < removed.size(); ++i) {
+                renderer->transform_ids.erase((Node*)removed[i]);
+            }
+        }
+
+        if (node->isAppearanceNode() && !node->isInstanceNode() && node->getValue() != nullptr) {
+            renderer->release_parameters((size_t)node->getValue() - 1);
+            node->setValue(nullptr);
+        }
 
+        if (node->isLightNode()) {
+            renderer->release_light(node);
+        } else if (node->isShapeNode()) {
+            renderer->release_shape(node);
+        } else if (node->isGeometry3DNode()) {
+            // Draws stay behind with no instances so shared geometry remains valid
+            if (node->getValue() != nullptr) {
+                renderer->draw_pool.remove_instance(PoolHandle::from_value(node->getValue()));
+                node->setValue(nullptr);
             }
-            Draw* batch_id = (Draw*)node->getValue();
-            if (batch_id != nullptr) { renderer->remove_from_batch(*batch_id); delete batch_id; }
-            node->setValue(nullptr);*/
         }
     }
 };
 
+// Rows of an affine transform, the last row is always 0 0 0 1. Same layout
+// TransformHierarchy writes, AFFINE_BYTES long.
 struct X3DTransformNode
 {
-    glm::mat4x4 transform;
+    X3DTransformNode(const glm::mat4x4& transform = glm::mat4x4(1.0))
+    {
+        glm::mat4x4 rows = glm::transpose(transform);
+        for (int i = 0; i < 3; ++i) {
+            this->rows[i] = rows[i];
+        }
+    }
+
+    glm::vec4 rows[3];
 };
 
 struct X3DLightNode
@@ -64,6 +100,9 @@ struct X3DLightNode
     glm::vec4 position = {0.0, 0.0, 0.0, 1.0};
     glm::vec4 direction = {0.0, 0.0, 0.0, 1.0};
     int type;
+    float radius; // distance the light reaches, 0 for directional
+    float cut_off = 0.0f; // spot lights, also fills the std140 array stride
+    float beam_width = 0.0f;
 };
 
 struct X3DMaterialNode
@@ -78,18 +117,20 @@ struct X3DMaterialNode
 
 struct X3DTextureTransformNode
 {
-    float center_scale[4];
-    float translation_rotation[4];
+    // Initialised so identical appearances hash the same
+    float center_scale[4] = {0.0, 0.0, 1.0, 1.0};
+    float translation_rotation[4] = {0.0, 0.0, 0.0, 0.0};
 };
 
 struct X3DTextureNode
 {
-    glm::ivec4 ambient_offset_width_height;
-    glm::ivec4 diffuse_offset_width_height;
-    glm::ivec4 specular_offset_width_height;
-    glm::ivec4 normal_offset_width_height;
-    glm::ivec4 displacement_offset_width_height;
-    glm::ivec4 alpha_offset_width_height;
+    // Zero for untextured, and so identical appearances hash the same
+    glm::ivec4 ambient_offset_width_height = glm::ivec4(0);
+    glm::ivec4 diffuse_offset_width_height = glm::ivec4(0);
+    glm::ivec4 specular_offset_width_height = glm::ivec4(0);
+    glm::ivec4 normal_offset_width_height = glm::ivec4(0);
+    glm::ivec4 displacement_offset_width_height = glm::ivec4(0);
+    glm::ivec4 alpha_offset_width_height = glm::ivec4(0);
     /// etc.
 };
 
@@ -100,6 +141,62 @@ struct X3DAppearanceNode
     X3DTextureNode texture;
 };
 
+// Vertex and element data read from a geometry node, kept apart from the
+// upload so it can be fetched on a worker thread
+struct GeometryData
+{
+    GeometryData(const VertexFormat& format, size_t format_stride, size_t num_vertices, size_t num_elements,
+                 std::vector<char>&& vertex_data, std::vector<char>&& element_data)
+        : format(format), format_stride(format_stride), num_vertices(num_vertices), num_elements(num_elements),
+          vertex_data(std::move(vertex_data)), element_data(std::move(element_data)),
+          key(format, format_stride, this->vertex_data.data(), this->vertex_data.size(),
+              this->element_data.data(), this->element_data.size())
+    {
+
+    }
+
+    VertexFormat format;
+    size_t format_stride;
+    size_t num_vertices;
+    size_t num_elements;
+    std::vector<char> vertex_data;
+    std::vector<char> element_data;
+    GeometryKey key; // hashes the data above, declared last
+};
+
+// One visited node. Packets are gathered without touching GL or the
+// renderer's buffers so subtrees can be walked in parallel, then
+// submitted in scene order.
+struct ScenePacket
+{
+    enum Type
+    {
+        GROUP,
+        TRANSFORM,
+        SHAPE,
+        LIGHT,
+    };
+
+    ScenePacket(Type type, Node *node, Node *parent)
+        : type(type), node(node), parent(parent), local(1.0), update_local(false),
+          update_appearance(false), center(0.0), extent(1.0), bounded(false)
+    {
+
+    }
+
+    Type type;
+    Node *node;
+    Node *parent; // closest Transform above the node, null at the top
+    glm::mat4x4 local; // Transform matrix or the shape's primitive scale
+    bool update_local;
+    bool update_appearance; // the appearance needs the record below
+    X3DAppearanceNode appearance;
+    std::shared_ptr<const GeometryData> geometry; // geometry not uploaded yet
+    glm::vec3 center; // local bounds
+    glm::vec3 extent;
+    bool bounded;
+};
+
 static VertexFormat convert_to_internal(const GeometryRenderInfo::VertexFormat& format)
 {
     VertexFormat new_format;
@@ -129,24 +226,64 @@ X3DOpenGLRenderer::X3DOpenGLRenderer()
                                 GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, GL_LESS, ShaderPass::DISABLED,
                                 GL_ZERO, GL_ZERO, GL_BACK, ShaderPass::DISABLED));
 
+    // Light volumes count the faces behind the scene's depth, a pixel is
+    // inside a volume when its back face is hidden and its front face isn't
+    ShaderPass light_stencil("Light Stencil", 1, 1, 0, false, false, true,
+                             GL_STENCIL_BUFFER_BIT, GL_LESS, ShaderPass::DISABLED,
+                             GL_ZERO, GL_ZERO, ShaderPass::DISABLED, GL_ALWAYS);
+    light_stencil.stencil_front = ShaderPass::StencilOp(ShaderPass::DISABLED, GL_DECR_WRAP);
+    light_stencil.stencil_back = ShaderPass::StencilOp(ShaderPass::DISABLED, GL_INCR_WRAP);
+    light_stencil.copy_depth = true;
+    light_stencil_pass = passes.size();
+    passes.push_back(light_stencil);
+
+    // Back faces in front of the scene light nothing, neither do pixels outside every volume
+    lighting_pass = passes.size();
     passes.push_back(ShaderPass("Lighting", 1, 1, 0, true, false, false,
-                                GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, ShaderPass::DISABLED, GL_FUNC_ADD,
+                                GL_COLOR_BUFFER_BIT, GL_GEQUAL, GL_FUNC_ADD,
+                                GL_ONE, GL_ONE, GL_FRONT, GL_NOTEQUAL));
+
+    passes.push_back(ShaderPass("Full Screen Lighting", 2, 1, 0, true, false, false,
+                                ShaderPass::DISABLED, ShaderPass::DISABLED, GL_FUNC_ADD,
                                 GL_ONE, GL_ONE, GL_FRONT, ShaderPass::DISABLED));
 
+    // Hidden instances are tested against the depth the geometry pass leaves
+    occlusion_culling.geometry_pass = 0;
+
     create_material("x3d-default", ":/shaders/default.vert", ":/shaders/default.frag", 0);
     create_material("x3d-default-light", ":/shaders/default-light.vert", ":/shaders/default-light.frag", 1);
+    create_material("x3d-directional-light", ":/shaders/default-light.vert", ":/shaders/default-light.frag", 2);
+    create_material("x3d-clustered-light", ":/shaders/default-light.vert", ":/shaders/clustered-light.frag", 2);
+
+    // Shade from the light table the light volumes use
+    Material& light_material = get_material("x3d-default-light");
+    get_material("x3d-directional-light").params_material = &light_material.get_batch_material();
+    get_material("x3d-clustered-light").params_material = &light_material.get_batch_material();
+
+    tiled_lighting.first_pass = light_stencil_pass;
+    tiled_lighting.num_passes = passes.size() - light_stencil_pass;
+    tiled_lighting.record_size = sizeof(X3DLightNode);
+    tiled_lighting.lights = &light_material.get_batch_material();
 
     this->node_listener = new RenderingNodeListener(this);
+    this->scene = nullptr;
+    this->full_update = true;
+    this->lights_clustered = false;
+    this->lod_screen_space = false;
 
     this->headlight = new DirectionalLightNode();
     headlight->setAmbientIntensity(0.0);
     headlight->setIntensity(1.0);
+    this->headlight_view = glm::mat4x4(1.0);
 }
 
 X3DOpenGLRenderer::~X3DOpenGLRenderer()
 {
     delete this->headlight;
     delete this->node_listener;
+    for (auto it = unit_primitives.begin(); it != unit_primitives.end(); ++it) {
+        delete it->second;
+    }
 }
 
 void X3DOpenGLRenderer::set_projection(Scalar fov, Scalar aspect, Scalar near, Scalar far)
@@ -165,153 +302,454 @@ void X3DOpenGLRenderer::debug_render_decrease()
     --this->render_type;
 }
 
+void X3DOpenGLRenderer::mark_dirty(Node *node)
+{
+    if (node == nullptr) {
+        full_update = true;
+        return;
+    }
+
+    // Ancestors of a dirty node are already dirty, stop at the first one
+    for (; node != nullptr && dirty_nodes.insert(node).second; node = node->getParentNode()) {
+    }
+}
+
+void X3DOpenGLRenderer::set_lod_screen_space(bool screen_space)
+{
+    lod_screen_space = screen_space;
+}
+
+void X3DOpenGLRenderer::set_stencil_light_volumes(bool stencil)
+{
+    passes[light_stencil_pass].enabled = stencil;
+    passes[lighting_pass].depth_func = stencil ? GL_GEQUAL : ShaderPass::DISABLED;
+    passes[lighting_pass].stencil_func = stencil ? GL_NOTEQUAL : ShaderPass::DISABLED;
+}
+
+void X3DOpenGLRenderer::set_listener(Node *node)
+{
+    if (node != nullptr && node->getNodeListener() != this->node_listener) {
+        node->setNodeListener(this->node_listener);
+    }
+}
+
 void X3DOpenGLRenderer::process_background_node(BackgroundNode *background)
 {
 
 }
 
-void X3DOpenGLRenderer::process_light_node(LightNode *light_node)
+// Primitives are uploaded once at their X3D default size, the node's own
+// size is applied through the instance transform instead.
+static bool get_primitive_scale(Geometry3DNode *geometry, glm::vec3& scale)
 {
-    ScopedContext context(this->context_pool, 0);
-    const auto gl = context.context.gl;
+    if (geometry->isInstanceNode()) {
+        geometry = (Geometry3DNode*)geometry->getReferenceNode();
+    }
+
+    if (geometry->isBoxNode()) {
+        float size[3];
+        ((BoxNode*)geometry)->getSize(size);
+        scale = glm::make_vec3(&size[0]) * 0.5f;
+    } else if (geometry->isSphereNode()) {
+        scale = glm::vec3(((SphereNode*)geometry)->getRadius());
+    } else if (geometry->isConeNode()) {
+        ConeNode *cone = (ConeNode*)geometry;
+        scale = glm::vec3(cone->getBottomRadius(), cone->getHeight() * 0.5f, cone->getBottomRadius());
+    } else if (geometry->isCylinderNode()) {
+        CylinderNode *cylinder = (CylinderNode*)geometry;
+        scale = glm::vec3(cylinder->getRadius(), cylinder->getHeight() * 0.5f, cylinder->getRadius());
+    } else {
+        scale = glm::vec3(1.0f);
+        return false;
+    }
+    return true;
+}
+
+Geometry3DNode* X3DOpenGLRenderer::get_unit_primitive(Geometry3DNode *geometry)
+{
+    // Cones and cylinders tessellate differently per enabled part
+    int key = 0;
+    if (geometry->isBoxNode()) {
+        key = 1;
+    } else if (geometry->isSphereNode()) {
+        key = 2;
+    } else if (geometry->isConeNode()) {
+        ConeNode *cone = (ConeNode*)geometry;
+        key = 3 | (cone->getSide() << 3) | (cone->getBottom() << 4);
+    } else if (geometry->isCylinderNode()) {
+        CylinderNode *cylinder = (CylinderNode*)geometry;
+        key = 4 | (cylinder->getSide() << 3) | (cylinder->getBottom() << 4) | (cylinder->getTop() << 5);
+    } else {
+        return nullptr;
+    }
+
+    std::map<int, Geometry3DNode*>::iterator it = unit_primitives.find(key);
+    if (it != unit_primitives.end()) {
+        return it->second;
+    }
+
+    Geometry3DNode *unit = nullptr;
+    if (geometry->isBoxNode()) {
+        unit = new BoxNode();
+    } else if (geometry->isSphereNode()) {
+        unit = new SphereNode();
+    } else if (geometry->isConeNode()) {
+        ConeNode *cone = new ConeNode();
+        cone->setSide(((ConeNode*)geometry)->getSide());
+        cone->setBottom(((ConeNode*)geometry)->getBottom());
+        unit = cone;
+    } else {
+        CylinderNode *cylinder = new CylinderNode();
+        cylinder->setSide(((CylinderNode*)geometry)->getSide());
+        cylinder->setBottom(((CylinderNode*)geometry)->getBottom());
+        cylinder->setTop(((CylinderNode*)geometry)->getTop());
+        unit = cylinder;
+    }
+
+    unit_primitives[key] = unit;
+    return unit;
+}
+
+static std::shared_ptr<const GeometryData> read_geometry(Geometry3DNode *source)
+{
+    if (source->getNumVertexArrays() == 0) {
+        return nullptr;
+    }
+    if (source->getNumVertexArrays() > 1) {
+        // TODO handle multiple arrays
+        throw;
+    }
+
+    GeometryRenderInfo::VertexArray array;
+    source->getVertexArray(array, 0);
 
+    // Fetched up front so identical geometry can be found before uploading
+    std::vector<char> vertex_data(array.getBufferSize());
+    source->getVertexData(0, vertex_data.data());
+    std::vector<char> element_data(array.getNumElements() * sizeof(int));
+    if (array.getNumElements() > 0) {
+        source->getElementData(0, element_data.data());
+    }
+
+    return std::make_shared<const GeometryData>(convert_to_internal(array.getFormat()), array.getFormat().getSize(),
+                                                array.getNumVertices(), array.getNumElements(),
+                                                std::move(vertex_data), std::move(element_data));
+}
+
+std::shared_ptr<const GeometryData> X3DOpenGLRenderer::get_geometry_data(Geometry3DNode *geometry)
+{
+    {
+        // Unit primitives are tessellated once for every shape using them
+        ScopedSpinLock lock(unit_primitives_lock);
+        Geometry3DNode *unit = get_unit_primitive(geometry);
+        if (unit != nullptr) {
+            std::shared_ptr<const GeometryData>& data = unit_geometry[unit];
+            if (data == nullptr) {
+                data = read_geometry(unit);
+            }
+            return data;
+        }
+    }
+    return read_geometry(geometry);
+}
+
+void X3DOpenGLRenderer::release_light_volume(LightSlot& slot)
+{
+    if (!slot.volume.is_null()) {
+        draw_pool.remove_instance(slot.volume);
+        slot.volume = InstanceHandle();
+    }
+}
+
+void X3DOpenGLRenderer::disable_light(LightSlot& slot)
+{
+    release_light_volume(slot);
+    light_clusters.remove_light(slot.index);
+
+    // Tiled lighting walks the whole table, unused records are skipped by type
+    X3DLightNode node;
+    node.type = -1;
+    node.radius = 0.0f;
+    get_material("x3d-default-light").get_batch_material().set_params(slot.index * sizeof(X3DLightNode),
+                                                                       &node, sizeof(X3DLightNode));
+}
+
+void X3DOpenGLRenderer::release_light(Node *light_node)
+{
+    auto it = light_slots.find(light_node);
+    if (it == light_slots.end()) {
+        return;
+    }
+
+    disable_light(it->second);
+    get_transform_buffer().free(it->second.transform_pos, sizeof(X3DTransformNode));
+    free_lights.push_back(it->second.index);
+    light_slots.erase(it);
+}
+
+void X3DOpenGLRenderer::release_shape(Node *shape_node)
+{
+    // Value is the transform slot + 1, see process_shape_node
+    if (shape_node->getValue() != nullptr) {
+        get_transform_buffer().free((size_t)shape_node->getValue() - 1, sizeof(X3DTransformNode));
+        shape_node->setValue(nullptr);
+    }
+}
+
+void X3DOpenGLRenderer::process_clustered_pass()
+{
+    if (!clustered_lighting) {
+        if (!clustered_pass.is_null()) {
+            draw_pool.remove_instance(clustered_pass);
+            clustered_pass = InstanceHandle();
+        }
+        return;
+    }
+
+    if (!clustered_pass.is_null()) {
+        return;
+    }
+
+    // One full screen draw shades every clustered light
+    Material& material = get_material("x3d-clustered-light");
+    ShaderBuffer& buffer = get_transform_buffer();
+    size_t pos = buffer.allocate(sizeof(X3DTransformNode));
+    {
+        X3DTransformNode transform_node;
+        ScopedBufferWrite write(buffer);
+        memcpy(write.data + pos, &transform_node, sizeof(X3DTransformNode));
+    }
+
+    BoxNode box;
+    DrawInfoBuffer::DrawInfo info(pos / sizeof(X3DTransformNode), material.id, 0, 1);
+    process_geometry_node(&box, info);
+    clustered_pass = PoolHandle::from_value(box.getValue());
+}
+
+void X3DOpenGLRenderer::process_light_node(LightNode *light_node)
+{
+    auto it = light_slots.find(light_node);
     if (!light_node->isOn()) {
-		return;
+        // Keeps its slot so switching it back on reuses it
+        if (it != light_slots.end()) {
+            disable_light(it->second);
+        }
+        light_node->setNodeListener(this->node_listener);
+        return;
     }
 
-    if (light_node->getValue() != nullptr) {
+    if (it != light_slots.end() && !is_dirty(light_node)
+            && (!it->second.volume.is_null() || it->second.clustered)
+            && it->second.clustered == (clustered_lighting && !light_node->isDirectionalLightNode())) {
         return;
     }
 
+    Material& light_material = get_material("x3d-default-light");
+    Material& default_material = light_material.get_batch_material();
+
+    if (it == light_slots.end()) {
+        LightSlot slot;
+        if (!free_lights.empty()) {
+            slot.index = free_lights.back();
+            free_lights.pop_back();
+        } else if (default_material.total_objects < TiledLighting::MAX_LIGHTS) {
+            slot.index = default_material.total_objects++;
+        } else {
+            // The shaders' light arrays are full, retried when the light changes
+            ++lighting_stats.rejected_lights;
+            light_node->setNodeListener(this->node_listener);
+            return;
+        }
+        slot.transform_pos = get_transform_buffer().allocate(sizeof(X3DTransformNode));
+        slot.clustered = false;
+        it = light_slots.insert(std::make_pair(light_node, slot)).first;
+    }
+    LightSlot& slot = it->second;
+
     X3DLightNode node;
-    X3DTransformNode transform;
+    node.radius = 0.0f;
+    glm::mat4x4 transform(1.0);
     light_node->getColor(node.color_intensity);
     node.color_intensity[3] = light_node->getIntensity();
     node.attenuation_ambient_intensity[3] = light_node->getAmbientIntensity();
 
-    Material& default_material = get_material("x3d-default-light");
     float location[3];
+    float radius = 0.0f;
+
+    // The volume's size goes into its transform so every light of a type
+    // shares one unit mesh.
+    Geometry3DNode *volume = nullptr;
+    SphereNode sphere;
+    BoxNode box;
+    ConeNode cone;
 
-    // TODO update light direction, etc.
     if (light_node->isPointLightNode()) {
         PointLightNode *point_light = (PointLightNode *)light_node;
         node.type = 0;
 
         point_light->getAttenuation(node.attenuation_ambient_intensity);
-        SphereNode sphere;
-        sphere.setRadius(calc_light_radius(0, node.color_intensity[3],
-                                           node.attenuation_ambient_intensity[0],
-                                           node.attenuation_ambient_intensity[1],
-                                           node.attenuation_ambient_intensity[2]));
+        radius = calc_light_radius(0, node.color_intensity[3],
+                                   node.attenuation_ambient_intensity[0],
+                                   node.attenuation_ambient_intensity[1],
+                                   node.attenuation_ambient_intensity[2],
+                                   point_light->getRadius());
+        sphere.setRadius(radius);
         point_light->getLocation(location);
 
         node.position = glm::vec4(glm::make_vec3(&location[0]), 1.0);
-        transform.transform = glm::translate(transform.transform, glm::vec3(node.position));
-        DrawInfoBuffer::DrawInfo info = {default_material.total_objects, default_material.id, 0, node.type};
-        sphere.setValue(light_node->getValue());
-        process_geometry_node(&sphere, info);
-        light_node->setValue(sphere.getValue());
+        transform = glm::translate(transform, glm::vec3(node.position));
+        volume = &sphere;
     } else if (light_node->isDirectionalLightNode()) {
         DirectionalLightNode *direction_light = (DirectionalLightNode *)light_node;
         node.type = 1;
 
-        BoxNode box;
-
+        // Drawn as a full screen quad, the transform is unused
         direction_light->getDirection(location);
         node.direction = glm::vec4(glm::make_vec3(&location[0]), 1.0);
-        DrawInfoBuffer::DrawInfo info = {default_material.total_objects, default_material.id, 0, node.type};
-        box.setValue(light_node->getValue());
-        process_geometry_node(&box, info);
-        light_node->setValue(box.getValue());
+        volume = &box;
     } else if (light_node->isSpotLightNode()) {
         SpotLightNode *spot_light = (SpotLightNode *)light_node;
         node.type = 2;
 
-        ConeNode cone;
+        spot_light->getLocation(location);
+        node.position = glm::vec4(glm::make_vec3(&location[0]), 1.0);
+        spot_light->getDirection(location);
+        glm::vec3 direction = glm::normalize(glm::make_vec3(&location[0]));
+        node.direction = glm::vec4(direction, 1.0);
+
+        spot_light->getAttenuation(node.attenuation_ambient_intensity);
+        node.cut_off = spot_light->getCutOffAngle();
+        node.beam_width = std::min(spot_light->getBeamWidth(), node.cut_off);
+        radius = calc_light_radius(spot_light->getCutOffAngle(), node.color_intensity[3],
+                                   node.attenuation_ambient_intensity[0],
+                                   node.attenuation_ambient_intensity[1],
+                                   node.attenuation_ambient_intensity[2],
+                                   spot_light->getRadius());
+
+        // Apex at the light, the open base at its range. Wide cut offs are
+        // clamped so the base stays finite.
         cone.setBottom(false);
+        cone.setHeight(radius);
+        cone.setBottomRadius(radius * std::tan(std::min(spot_light->getCutOffAngle(), 1.4f)));
+
+        // The unit cone points up +Y with its apex at half its height
+        glm::vec3 up = -direction;
+        glm::vec3 side = std::abs(up.y) < 0.99f ? glm::vec3(0.0, 1.0, 0.0) : glm::vec3(1.0, 0.0, 0.0);
+        glm::vec3 x_axis = glm::normalize(glm::cross(side, up));
+        glm::mat4x4 basis(1.0);
+        basis[0] = glm::vec4(x_axis, 0.0);
+        basis[1] = glm::vec4(up, 0.0);
+        basis[2] = glm::vec4(glm::cross(x_axis, up), 0.0);
+        transform = glm::translate(transform, glm::vec3(node.position)) * basis;
+        transform = glm::translate(transform, glm::vec3(0.0, -radius * 0.5f, 0.0));
+        volume = &cone;
+    }
 
-        spot_light->getLocation(location);
+    if (volume == nullptr) {
+        return;
+    }
+    node.radius = radius;
 
-        node.position = glm::vec4(glm::make_vec3(&location[0]), 1.0);
-        //spot_light->getDirection(direction);
-        float attenuation[3];
-        spot_light->getAttenuation(attenuation);
-        cone.setBottomRadius(calc_light_radius(spot_light->getCutOffAngle(), spot_light->getIntensity(),
-                                               attenuation[0], attenuation[1], attenuation[2]));
-        transform.transform = glm::translate(transform.transform, glm::vec3(node.position));
-        DrawInfoBuffer::DrawInfo info = {default_material.total_objects, default_material.id, 0, node.type};
-        cone.setValue(light_node->getValue());
-        process_geometry_node(&cone, info);
-        light_node->setValue(cone.getValue());
-    }
-
-    // TODO update transform
-    gl->glBindBuffer(GL_UNIFORM_BUFFER, default_material.frag_params);
-    void *data = gl->glMapBufferRange(GL_UNIFORM_BUFFER, (default_material.total_objects) * sizeof(X3DLightNode),
-                                sizeof(X3DLightNode), GL_MAP_WRITE_BIT);
-    memcpy(data, &node, sizeof(X3DLightNode));
-    gl->glUnmapBuffer(GL_UNIFORM_BUFFER);
-    ++default_material.total_objects;
-
-    if (light_node->getNodeListener() != nullptr) {
-        light_node->setNodeListener(this->node_listener);
+    // Directional lights cover the whole screen and always keep their volume
+    slot.clustered = clustered_lighting && node.type != 1;
+    if (slot.clustered) {
+        release_light_volume(slot);
+        light_clusters.set_light(slot.index, glm::vec3(node.position), radius);
+    } else {
+        light_clusters.remove_light(slot.index);
+
+        glm::vec3 scale;
+        get_primitive_scale(volume, scale);
+        transform = glm::scale(transform, scale);
+
+        ShaderBuffer& buffer = get_transform_buffer();
+        {
+            X3DTransformNode transform_node(transform);
+            ScopedBufferWrite write(buffer);
+            memcpy(write.data + slot.transform_pos, &transform_node, sizeof(X3DTransformNode));
+        }
+
+        // Full screen volumes skip the stencil test
+        size_t material_id = node.type == 1 ? get_material("x3d-directional-light").id : light_material.id;
+        DrawInfoBuffer::DrawInfo info(slot.transform_pos / sizeof(X3DTransformNode), material_id,
+                                      slot.index, node.type);
+        if (!slot.volume.is_null()) {
+            volume->setValue(slot.volume.to_value());
+        }
+        process_geometry_node(volume, info);
+        slot.volume = PoolHandle::from_value(volume->getValue());
     }
+
+    default_material.set_params(slot.index * sizeof(X3DLightNode), &node, sizeof(X3DLightNode));
+
+    light_node->setNodeListener(this->node_listener);
 }
 
-void X3DOpenGLRenderer::process_geometry_node(Geometry3DNode *geometry, DrawInfoBuffer::DrawInfo& draw_info)
+void X3DOpenGLRenderer::process_geometry_node(Geometry3DNode *geometry, DrawInfoBuffer::DrawInfo& draw_info,
+                                              const GeometryData* prepared)
 {
     if (geometry != nullptr) {
         if (geometry->isInstanceNode()) {
             if (geometry->getValue() != nullptr) {
-                DrawInstance* instance = (DrawInstance*)geometry->getValue();
-                instance->update(draw_info);
+                InstanceHandle instance = PoolHandle::from_value(geometry->getValue());
+                draw_pool.update_instance(instance, draw_info);
             } else {
                 Node *reference = geometry->getReferenceNode();
-                Draw *draw = (Draw*)reference->getValue();
+                DrawHandle draw = draw_pool.get_draw(PoolHandle::from_value(reference->getValue()));
 
                 // TODO instance declared before reference?
                 // process_geometry_node(reference, material);
 
-                DrawInstance& instance = draw->add_instance(draw_info);
-                geometry->setValue(&instance);
-                geometry->setNodeListener(this->node_listener);
+                InstanceHandle instance = draw_pool.add_instance(draw, draw_info);
+                if (!instance.is_null()) {
+                    geometry->setValue(instance.to_value());
+                    geometry->setNodeListener(this->node_listener);
+                }
             }
         } else if (geometry->getValue() != nullptr) {
-            Draw* draw = (Draw*)geometry->getValue();
-            DrawInstance* instance = draw->get_base_instance();
-            instance->update(draw_info);
-        } else if (geometry->getNumVertexArrays() > 0) {
-            if (geometry->getNumVertexArrays() > 1) {
-                // TODO handle multiple arrays
-                throw;
+            InstanceHandle instance = PoolHandle::from_value(geometry->getValue());
+            draw_pool.update_instance(instance, draw_info);
+        } else {
+            std::shared_ptr<const GeometryData> fetched;
+            if (prepared == nullptr) {
+                fetched = get_geometry_data(geometry);
+                prepared = fetched.get();
             }
-
-            GeometryRenderInfo::VertexArray array;
-            geometry->getVertexArray(array, 0);
-            VertexFormat format = convert_to_internal(array.getFormat());
-
-            VertexBuffer& vbo = get_buffer(format);
-            size_t vbo_pos = vbo.allocate(array.getBufferSize());
-
-            char* data = (char*)vbo.data + vbo_pos;
-            geometry->getVertexData(0, data);
-
-            IndexBuffer& ebo = get_index_buffer();
-            size_t ebo_pos = 0;
-            if (array.getNumElements() > 0) {
-                ebo_pos = ebo.allocate(array.getNumElements() * sizeof(int));
-
-                data = (char*)ebo.data + ebo_pos;
-                geometry->getElementData(0, data);
+            if (prepared == nullptr) {
+                return;
+            }
+            const GeometryData& data = *prepared;
+
+            Material& material = get_material(draw_info[1])->get_batch_material();
+            DrawBatch& batch = material.get_batch(data.format, data.format_stride,
+                                                  GL_TRIANGLES, data.num_elements > 0 ? GL_UNSIGNED_INT : 0);
+
+            DrawHandle draw = find_geometry(data.key, data.vertex_data.data(), data.element_data.data(), batch);
+            if (draw.is_null()) {
+                VertexBuffer& vbo = get_buffer(data.format);
+                size_t vbo_pos = vbo.allocate(data.vertex_data.size());
+
+                {
+                    ScopedBufferWrite write(vbo);
+                    memcpy(write.data + vbo_pos, data.vertex_data.data(), data.vertex_data.size());
+                }
+
+                IndexBuffer& ebo = get_index_buffer();
+                size_t ebo_pos = 0;
+                if (data.num_elements > 0) {
+                    ebo_pos = ebo.allocate(data.element_data.size());
+
+                    ScopedBufferWrite write(ebo);
+                    memcpy(write.data + ebo_pos, data.element_data.data(), data.element_data.size());
+                }
+
+                draw = draw_pool.add_draw(batch, data.num_vertices, data.num_elements,
+                                          vbo_pos / data.format_stride, ebo_pos / sizeof(int));
+                add_geometry(data.key, data.vertex_data.data(), data.element_data.data(), draw);
             }
 
-            Material& material = *get_material(draw_info[1]);
-            DrawBatch& batch = material.get_batch(format, array.getFormat().getSize(),
-                                                  GL_TRIANGLES, array.getNumElements() > 0 ? GL_UNSIGNED_INT : 0);
-            Draw& draw = batch.add_draw(array.getNumVertices(), array.getNumElements(),
-                                        vbo_pos / array.getFormat().getSize(), ebo_pos / sizeof(int));
-            draw.add_instance(draw_info); // base instance
-            geometry->setValue((void*)&draw);
+            InstanceHandle instance = draw_pool.add_instance(draw, draw_info);
+            geometry->setValue(instance.to_value());
             if (geometry->getParentNode() != nullptr) {
                 geometry->setNodeListener(this->node_listener);
             }
@@ -348,7 +786,8 @@ void X3DOpenGLRenderer::process_texture_node(TextureNode *base_texture, glm::ive
                 info[0] =  pos / 4;
                 texture->setTextureName(pos + 1);
 
-                memcpy(buffer.data + pos, texture->getImage(), num_bytes);
+                ScopedBufferWrite write(buffer);
+                memcpy(write.data + pos, texture->getImage(), num_bytes);
 
                 //texture->getRepeatS();
                 //texture->getRepeatT();
@@ -357,17 +796,43 @@ void X3DOpenGLRenderer::process_texture_node(TextureNode *base_texture, glm::ive
     }
 }
 
-void X3DOpenGLRenderer::process_apperance_node(AppearanceNode *appearance, DrawInfoBuffer::DrawInfo& info)
+bool X3DOpenGLRenderer::read_appearance(AppearanceNode *appearance, X3DAppearanceNode& node)
 {
-    ScopedContext context(this->context_pool, 0);
-    const auto gl = context.context.gl;
+    if (appearance == nullptr || appearance->isInstanceNode() ||
+        (appearance->getValue() && !is_dirty(appearance))) {
+        return false;
+    }
 
-    Material& default_material = get_material("x3d-default");
+    // Textures go through the pixel buffer, they are left for submission
+    if (appearance->getCommonSurfaceShaderNodes() == nullptr) {
+        TextureTransformNode *transform = appearance->getTextureTransformNodes();
+        if (transform != nullptr) {
+            transform->getTranslation(node.tex_transform.translation_rotation);
+            transform->getCenter(node.tex_transform.center_scale);
+            node.tex_transform.translation_rotation[2] = transform->getRotation();
+            transform->getScale(&node.tex_transform.center_scale[2]);
+        }
 
-    info[1] = default_material.id;
-    if (appearance != nullptr) {
-        X3DAppearanceNode node;
+        MaterialNode *material_node = appearance->getMaterialNodes();
+        if (material_node != nullptr) {
+            material_node->getDiffuseColor(&node.material.diffuse_color[0]);
+            node.material.diffuse_color[3] = 1 - material_node->getTransparency();
+            material_node->getSpecularColor(node.material.specular_shininess);
+            node.material.specular_shininess[3] = material_node->getShininess();
+            material_node->getEmissiveColor(node.material.emissive_ambient_intensity);
+            node.material.emissive_ambient_intensity[3] = material_node->getAmbientIntensity();
+        }
+    }
+    return true;
+}
+
+void X3DOpenGLRenderer::process_apperance_node(AppearanceNode *appearance, DrawInfoBuffer::DrawInfo& info,
+                                               const X3DAppearanceNode* prepared)
+{
+    Material& material = get_material("x3d-default");
 
+    info[1] = material.id;
+    if (appearance != nullptr) {
         if (appearance->isInstanceNode()) {
             Node *reference = appearance->getReferenceNode();
             if ((size_t)reference->getValue() == 0) {
@@ -378,11 +843,18 @@ void X3DOpenGLRenderer::process_apperance_node(AppearanceNode *appearance, DrawI
             return;
         }
 
-        if (appearance->getValue()) {
+        if (appearance->getValue() && !is_dirty(appearance)) {
             info[2] = (int)(size_t)appearance->getValue() - 1;
             return;
         }
 
+        X3DAppearanceNode node;
+        if (prepared != nullptr) {
+            node = *prepared;
+        } else {
+            read_appearance(appearance, node);
+        }
+
         CommonSurfaceShaderNode *shader = appearance->getCommonSurfaceShaderNodes();
         if (shader != nullptr) {
             process_texture_node((TextureNode*)shader->getAlphaTextureField()->getValue(), node.texture.alpha_offset_width_height);
@@ -397,24 +869,6 @@ void X3DOpenGLRenderer::process_apperance_node(AppearanceNode *appearance, DrawI
             //process_texture_node((TextureNode*)shader->getReflectionTextureField()->getValue());
             //process_texture_node((TextureNode*)shader->getEnvironmentTextureField()->getValue(), node.texture.);
         } else {
-            TextureTransformNode *transform = appearance->getTextureTransformNodes();
-            if (transform != nullptr) {
-                transform->getTranslation(node.tex_transform.translation_rotation);
-                transform->getCenter(node.tex_transform.center_scale);
-                node.tex_transform.translation_rotation[2] = transform->getRotation();
-                transform->getScale(&node.tex_transform.center_scale[2]);
-            }
-
-            MaterialNode *material = appearance->getMaterialNodes();
-            if (material != nullptr) {
-                material->getDiffuseColor(&node.material.diffuse_color[0]);
-                node.material.diffuse_color[3] = 1 - material->getTransparency();
-                material->getSpecularColor(node.material.specular_shininess);
-                node.material.specular_shininess[3] = material->getShininess();
-                material->getEmissiveColor(node.material.emissive_ambient_intensity);
-                node.material.emissive_ambient_intensity[3] = material->getAmbientIntensity();
-            }
-
             ImageTextureNode *texture = appearance->getImageTextureNodes();
             if (texture == nullptr) {
                 MultiTextureNode *multi_texture = appearance->getMultiTextureNodes();
@@ -427,60 +881,391 @@ void X3DOpenGLRenderer::process_apperance_node(AppearanceNode *appearance, DrawI
             }
         }
 
-        if (default_material.total_objects >= 600) {
-            // TODO too many objects, convert to SSBO and instance any nodes
-            throw;
+        // Identical appearances share one record, an updated appearance
+        // takes the record matching its new contents. Out of records it
+        // keeps its old one, or draws with the first.
+        size_t index = add_parameters(&node, sizeof(node));
+        if (index == NO_PARAMETERS) {
+            info[2] = appearance->getValue() != nullptr ? (int)(size_t)appearance->getValue() - 1 : 0;
+        } else {
+            if (appearance->getValue() != nullptr) {
+                release_parameters((size_t)appearance->getValue() - 1);
+            }
+            appearance->setValue((void*)(index + 1));
+            info[2] = index;
+        }
+        set_listener(appearance);
+        set_listener(appearance->getMaterialNodes());
+        set_listener(appearance->getTextureTransformNodes());
+        set_listener(appearance->getImageTextureNodes());
+    }
+}
+
+void X3DOpenGLRenderer::read_shape(ShapeNode *shape, ScenePacket& packet)
+{
+    packet.update_local = shape->getValue() == nullptr || is_dirty(shape);
+
+    // Unit primitives span -1 to 1, their size is part of the transform
+    glm::vec3 scale;
+    Geometry3DNode *geometry = shape->getGeometry3D();
+    if (geometry != nullptr && get_primitive_scale(geometry, scale)) {
+        packet.local = glm::scale(packet.local, scale);
+        packet.bounded = true;
+    } else if (geometry != nullptr) {
+        float box_center[3];
+        float size[3];
+        geometry->getBoundingBoxCenter(box_center);
+        geometry->getBoundingBoxSize(size);
+
+        // Negative size means the box was never computed
+        if (size[0] >= 0 && size[1] >= 0 && size[2] >= 0) {
+            packet.center = glm::make_vec3(&box_center[0]);
+            packet.extent = glm::make_vec3(&size[0]) * 0.5f;
+            packet.bounded = true;
         }
+    }
 
-        gl->glBindBuffer(GL_UNIFORM_BUFFER, default_material.frag_params);
-        void *data = gl->glMapBufferRange(GL_UNIFORM_BUFFER, default_material.total_objects * sizeof(node),
-                                    sizeof(node), GL_MAP_WRITE_BIT);
-        memcpy(data, &node, sizeof(node));
-        gl->glUnmapBuffer(GL_UNIFORM_BUFFER);
+    packet.update_appearance = read_appearance(shape->getAppearanceNodes(), packet.appearance);
 
-        info[2] = default_material.total_objects;
-        ++default_material.total_objects;
-        appearance->setValue((void*)default_material.total_objects);
-        appearance->setNodeListener(this->node_listener);
+    if (geometry != nullptr && !geometry->isInstanceNode() && geometry->getValue() == nullptr) {
+        packet.geometry = get_geometry_data(geometry);
     }
 }
 
-void X3DOpenGLRenderer::process_shape_node(ShapeNode *shape, bool selected)
+void X3DOpenGLRenderer::process_shape_node(const ScenePacket& packet, TransformHierarchy::Index parent)
 {
+    ShapeNode *shape = (ShapeNode *)packet.node;
     DrawInfoBuffer::DrawInfo info;
-    if (shape->getValue()) {
-        info[0] = (int)((size_t)shape->getValue() / sizeof(X3DTransformNode));
-    } else {
-        X3DTransformNode node;
-        shape->setNodeListener(this->node_listener);
+    ShaderBuffer& buffer = get_transform_buffer();
 
-        float matrix[4][4];
-        shape->getTransformMatrix(matrix);
-        node.transform = glm::make_mat4x4(&matrix[0][0]);
+    // Offset + 1 so the first transform is not mistaken for an unset value
+    bool added = shape->getValue() == nullptr;
+    if (added) {
+        shape->setValue((void*)(buffer.allocate(sizeof(X3DTransformNode)) + 1));
+    }
+    size_t pos = (size_t)shape->getValue() - 1;
+    info[0] = pos / sizeof(X3DTransformNode);
+
+    // The world matrix is written by the hierarchy update
+    TransformHierarchy::Index id = get_transform_index(shape, parent);
+    if (added || packet.update_local) {
+        set_listener(shape);
+        transforms.set_local(id, packet.local);
+        transforms.set_output(id, pos);
+    }
 
-        ShaderBuffer& buffer = get_transform_buffer();
-        size_t pos = buffer.allocate(sizeof(X3DTransformNode));
-        memcpy(buffer.data + pos, &node, sizeof(X3DTransformNode));
-        info[0] = pos / sizeof(X3DTransformNode);
-        shape->setValue((void*)pos);
+    if (packet.bounded) {
+        ShapeBounds& bounds = shape_bounds[shape];
+        bounds.center = packet.center;
+        bounds.extent = packet.extent;
+    } else {
+        shape_bounds.erase(shape);
     }
-    process_apperance_node(shape->getAppearanceNodes(), info);
-    process_geometry_node(shape->getGeometry3D(), info);
+
+    process_apperance_node(shape->getAppearanceNodes(), info,
+                           packet.update_appearance ? &packet.appearance : nullptr);
+    process_geometry_node(shape->getGeometry3D(), info, packet.geometry.get());
 }
 
-void X3DOpenGLRenderer::process_node(SceneGraph *sg, Node *root)
+void X3DOpenGLRenderer::update_shape_bounds(ShapeNode *shape, const glm::mat4x4& transform)
 {
-    if (root == nullptr || sg == nullptr) {
+    Geometry3DNode *geometry = shape->getGeometry3D();
+    if (geometry == nullptr || geometry->getValue() == nullptr) {
+        return;
+    }
+
+    std::map<Node*, ShapeBounds>::const_iterator it = shape_bounds.find(shape);
+    if (it == shape_bounds.end()) {
         return;
     }
+    const glm::vec3& center = it->second.center;
+    const glm::vec3& extent = it->second.extent;
+
+    glm::vec3 world_extent;
+    for (int i = 0; i < 3; ++i) {
+        world_extent[i] = std::fabs(transform[0][i]) * extent.x
+                + std::fabs(transform[1][i]) * extent.y
+                + std::fabs(transform[2][i]) * extent.z;
+    }
+
+    draw_pool.set_bounds(PoolHandle::from_value(geometry->getValue()),
+                         glm::vec3(transform * glm::vec4(center, 1.0)), world_extent);
+}
+
+TransformHierarchy::Index X3DOpenGLRenderer::get_transform_index(Node *node, TransformHierarchy::Index parent)
+{
+    // Nodes moved under another Transform keep their id and take their subtree along
+    std::map<Node*, TransformHierarchy::Index>::iterator it = transform_ids.find(node);
+    if (it != transform_ids.end()) {
+        transforms.set_parent(it->second, parent);
+        return it->second;
+    }
+
+    TransformHierarchy::Index id = transforms.add(parent, node);
+    transform_ids[node] = id;
+    return id;
+}
+
+// Level for the distance, a LOD only leaves its current level once the
+// distance is past the range between them by the hysteresis margin
+static int select_lod_level(LODNode *lod, float distance, int current, int num_levels)
+{
+    static const float HYSTERESIS = 0.05f;
+
+    int num_ranges = std::min(lod->getNRanges(), num_levels - 1);
+    int coarser = 0;
+    int finer = 0;
+    for (int i = 0; i < num_ranges; ++i) {
+        coarser += distance >= lod->getRange(i) * (1.0f + HYSTERESIS);
+        finer += distance >= lod->getRange(i) * (1.0f - HYSTERESIS);
+    }
+
+    if (current < coarser) {
+        return coarser;
+    } else if (current > finer) {
+        return finer;
+    }
+    return current;
+}
+
+void X3DOpenGLRenderer::select_lod_levels()
+{
+    // Ranges are taken as authored for a 1080 pixel high view with a 45
+    // degree field of view when compared in screen space
+    static const float REFERENCE_FOCAL = 540.0f / 0.41421356f;
+
+    // Both eyes share one level, the closer eye picks it
+    const RenderOuputGroup* groups[] = {&active_viewpoint.left, &active_viewpoint.right};
+    for (auto it = lod_nodes.begin(); it != lod_nodes.end(); ++it) {
+        LODNode *lod = (LODNode *)it->first;
+        LodState& state = it->second;
+        int num_levels = lod->getNChildNodes();
+        if (num_levels == 0) {
+            continue;
+        }
+
+        // Ranges are in the LOD's own coordinates, the eyes are brought into them
+        glm::mat4x4 to_local(1.0);
+        std::map<Node*, TransformHierarchy::Index>::const_iterator parent = transform_ids.find(state.parent);
+        if (parent != transform_ids.end()) {
+            to_local = glm::inverse(transforms.get_world(parent->second));
+        }
+        float center[3];
+        lod->getCenter(center);
+
+        float distance = -1.0f;
+        for (size_t i = 0; i < 2; ++i) {
+            if (!groups[i]->enabled) {
+                continue;
+            }
+
+            glm::vec4 eye = to_local * glm::inverse(groups[i]->view)[3];
+            float eye_distance = glm::length(glm::vec3(eye) - glm::make_vec3(&center[0]));
+            float focal = groups[i]->projection[1][1] * groups[i]->back_buffer.height * 0.5f;
+            if (lod_screen_space && focal > 0.0f) {
+                eye_distance *= REFERENCE_FOCAL / focal;
+            }
+            if (distance < 0.0f || eye_distance < distance) {
+                distance = eye_distance;
+            }
+        }
+        if (distance < 0.0f) {
+            continue;
+        }
+
+        int level = select_lod_level(lod, distance, std::min(state.level, num_levels - 1), num_levels);
+        if (level != state.level) {
+            Node *shown = lod->getChildNode(state.level);
+            if (shown != nullptr) {
+                hide_subtree(shown);
+            }
+            state.level = level;
+            Node *selected = lod->getChildNode(level);
+            if (selected != nullptr) {
+                mark_subtree(selected);
+            }
+        }
+    }
+}
+
+void X3DOpenGLRenderer::mark_subtree(Node *node)
+{
+    // Shapes and lights rebuild their own parts, their fields are left alone
+    mark_dirty(node);
+    if (!node->isShapeNode() && !node->isLightNode()) {
+        for (Node *child = node->getChildNodes(); child != nullptr; child = child->next()) {
+            mark_subtree(child);
+        }
+    }
+}
+
+void X3DOpenGLRenderer::hide_subtree(Node *node)
+{
+    if (node->isLightNode()) {
+        release_light(node);
+    } else if (node->isShapeNode()) {
+        Geometry3DNode *geometry = ((ShapeNode *)node)->getGeometry3D();
+        if (geometry != nullptr && geometry->getValue() != nullptr) {
+            draw_pool.remove_instance(PoolHandle::from_value(geometry->getValue()));
+            geometry->setValue(nullptr);
+        }
+    } else {
+        for (Node *child = node->getChildNodes(); child != nullptr; child = child->next()) {
+            hide_subtree(child);
+        }
+    }
+}
+
+bool X3DOpenGLRenderer::is_moved(Node *node, Node *parent) const
+{
+    std::map<Node*, Node*>::const_iterator it = transform_parents.find(node);
+    return it != transform_parents.end() && it->second != parent;
+}
+
+void X3DOpenGLRenderer::gather_nodes(const Subtree& subtree, std::vector<ScenePacket>& packets,
+                                     std::vector<Subtree>* subtrees)
+{
+    Node *parent = subtree.parent;
+
+    // Only subtrees marked dirty by the listener, never visited or moved
+    // under another Transform are walked
+    for (Node *node = subtree.first; node != nullptr; node = subtree.single ? nullptr : node->next()) {
+        bool added = node->getNodeListener() == nullptr;
+        if (!full_update && !added && !is_dirty(node) && !is_moved(node, parent)) {
+            continue;
+        }
 
-    for (Node *node = root; node != nullptr; node = node->next()) {
         if (node->isLightNode()) {
-            process_light_node((LightNode *)node);
+            packets.push_back(ScenePacket(ScenePacket::LIGHT, node, parent));
         } else if (node->isShapeNode()) {
-            process_shape_node((ShapeNode *)node, sg->getSelectedShapeNode() == node);
+            packets.push_back(ScenePacket(ScenePacket::SHAPE, node, parent));
+            read_shape((ShapeNode *)node, packets.back());
         } else {
-            process_node(sg, node->getChildNodes());
+            Node *child_parent = parent;
+            if (node->isTransformNode()) {
+                packets.push_back(ScenePacket(ScenePacket::TRANSFORM, node, parent));
+                if (added || is_dirty(node)) {
+                    float matrix[4][4];
+                    ((TransformNode *)node)->getSFMatrix(matrix);
+                    packets.back().local = glm::make_mat4x4(&matrix[0][0]);
+                    packets.back().update_local = true;
+                }
+                child_parent = node;
+            } else {
+                packets.push_back(ScenePacket(ScenePacket::GROUP, node, parent));
+            }
+
+            Subtree children = {node->getChildNodes(), child_parent, false};
+            if (node->isLODNode()) {
+                // Levels not shown have no draws, they are walked again once selected
+                std::map<Node*, LodState>::const_iterator lod = lod_nodes.find(node);
+                children.first = node->getChildNode(lod != lod_nodes.end() ? lod->second.level : 0);
+                children.single = true;
+            }
+
+            // Children are handed out when splitting, their packets follow the head's
+            if (subtrees != nullptr) {
+                subtrees->push_back(children);
+            } else {
+                gather_nodes(children, packets, nullptr);
+            }
+        }
+    }
+}
+
+void X3DOpenGLRenderer::gather_scene(Node *root, std::vector<ScenePacket>& packets)
+{
+    size_t num_threads = std::max(QThreadPool::globalInstance()->maxThreadCount(), 1);
+
+    // The top levels are walked here until there are enough subtrees to share out
+    std::vector<Subtree> subtrees;
+    Subtree top = {root, nullptr, false};
+    gather_nodes(top, packets, &subtrees);
+    for (int depth = 1; depth < 3 && subtrees.size() < num_threads && !subtrees.empty(); ++depth) {
+        std::vector<Subtree> next;
+        for (size_t i = 0; i < subtrees.size(); ++i) {
+            gather_nodes(subtrees[i], packets, &next);
+        }
+        subtrees.swap(next);
+    }
+
+    if (subtrees.size() < 2 || num_threads == 1) {
+        for (size_t i = 0; i < subtrees.size(); ++i) {
+            gather_nodes(subtrees[i], packets, nullptr);
+        }
+        return;
+    }
+
+    // Subtrees are independent, a Transform's packet is always gathered before its children's
+    size_t chunk = (subtrees.size() + num_threads - 1) / num_threads;
+    std::vector<std::vector<ScenePacket>> results(num_threads);
+    std::vector<QFuture<void>> futures;
+    for (size_t i = 1; i < num_threads && i * chunk < subtrees.size(); ++i) {
+        const Subtree* first = subtrees.data() + i * chunk;
+        size_t count = std::min(chunk, subtrees.size() - i * chunk);
+        std::vector<ScenePacket>* result = &results[i];
+        futures.push_back(QtConcurrent::run([this, first, count, result]() {
+            for (size_t j = 0; j < count; ++j) {
+                gather_nodes(first[j], *result, nullptr);
+            }
+        }));
+    }
+    for (size_t j = 0; j < chunk; ++j) {
+        gather_nodes(subtrees[j], packets, nullptr);
+    }
+
+    for (size_t i = 0; i < futures.size(); ++i) {
+        futures[i].waitForFinished();
+        packets.insert(packets.end(), results[i + 1].begin(), results[i + 1].end());
+    }
+}
+
+void X3DOpenGLRenderer::submit_packets(const std::vector<ScenePacket>& packets)
+{
+    for (size_t i = 0; i < packets.size(); ++i) {
+        const ScenePacket& packet = packets[i];
+
+        TransformHierarchy::Index parent = TransformHierarchy::NONE;
+        if (packet.parent != nullptr) {
+            parent = transform_ids[packet.parent];
+        }
+
+        // Moved nodes are processed as changed so lights pick up their new place
+        std::map<Node*, Node*>::iterator moved = transform_parents.find(packet.node);
+        if (moved == transform_parents.end()) {
+            transform_parents[packet.node] = packet.parent;
+        } else if (moved->second != packet.parent) {
+            moved->second = packet.parent;
+            mark_dirty(packet.node);
+        }
+
+        switch (packet.type) {
+        case ScenePacket::LIGHT:
+            process_light_node((LightNode *)packet.node);
+            break;
+        case ScenePacket::SHAPE:
+            process_shape_node(packet, parent);
+            break;
+        case ScenePacket::TRANSFORM: {
+            set_listener(packet.node);
+            TransformHierarchy::Index id = get_transform_index(packet.node, parent);
+            if (packet.update_local) {
+                transforms.set_local(id, packet.local);
+            }
+            break;
+        }
+        case ScenePacket::GROUP:
+            set_listener(packet.node);
+            if (packet.node->isLODNode()) {
+                std::map<Node*, LodState>::iterator lod = lod_nodes.find(packet.node);
+                if (lod == lod_nodes.end()) {
+                    LodState state = {packet.parent, 0};
+                    lod_nodes[packet.node] = state;
+                } else {
+                    lod->second.parent = packet.parent;
+                }
+            }
+            break;
         }
     }
 }
@@ -489,6 +1274,19 @@ void X3DOpenGLRenderer::render(SceneGraph *sg)
 {
     ScopedContext context(context_pool, 0);
 
+    if (sg != this->scene) {
+        this->scene = sg;
+        full_update = true;
+        reset_geometry_stats();
+    }
+
+    // Lights move between volumes and clusters when the mode changes
+    if (clustered_lighting != lights_clustered) {
+        lights_clustered = clustered_lighting;
+        full_update = true;
+    }
+    process_clustered_pass();
+
     ViewpointNode *view = sg->getViewpointNode();
     if (view == nullptr) {
         if ((view = sg->getDefaultViewpointNode()) == nullptr) {
@@ -510,12 +1308,37 @@ void X3DOpenGLRenderer::render(SceneGraph *sg)
 
     if (nav_info != nullptr &&
         nav_info->getHeadlight()) {
-        glm::vec4 direction = -glm::inverse(view_mat)[2];
-        headlight->setDirection(direction.x, direction.y, direction.z);
-        process_light_node(headlight);
-	}
+        // The headlight follows the camera, so it only changes with the view
+        if (full_update || view_mat != headlight_view
+                || light_slots.find(headlight) == light_slots.end()) {
+            glm::vec4 direction = -glm::inverse(view_mat)[2];
+            headlight->setDirection(direction.x, direction.y, direction.z);
+            mark_dirty(headlight);
+            process_light_node(headlight);
+            headlight_view = view_mat;
+        }
+    }
 
-    process_node(sg, sg->getNodes());
+    // Scene nodes are read in parallel, GL and buffer writes stay on this thread
+    select_lod_levels();
+    std::vector<ScenePacket> packets;
+    gather_scene(sg->getNodes(), packets);
+    submit_packets(packets);
+    dirty_nodes.clear();
+    full_update = false;
+
+    {
+        ScopedBufferWrite write(get_transform_buffer());
+        transforms.update(write.data);
+    }
+
+    const std::vector<TransformHierarchy::Index>& moved = transforms.get_updated();
+    for (size_t i = 0; i < moved.size(); ++i) {
+        Node *node = (Node *)transforms.get_value(moved[i]);
+        if (node->isShapeNode()) {
+            update_shape_bounds((ShapeNode *)node, transforms.get_world(moved[i]));
+        }
+    }
 
     write_batches();
 
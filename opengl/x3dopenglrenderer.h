@@ -4,6 +4,9 @@
 #include "x3d/x3drenderer.h"
 #include "opengl/openglrenderer.h"
 #include <map>
+#include <set>
+#include <memory>
+#include <vector>
 
 namespace CyberX3D
 {
@@ -18,6 +21,9 @@ namespace CyberX3D
 }
 
 class RenderingNodeListener;
+struct ScenePacket;
+struct GeometryData;
+struct X3DAppearanceNode;
 
 class X3DOpenGLRenderer : public X3DRenderer, public OpenGLRenderer
 {
@@ -28,20 +34,104 @@ public:
     void set_projection(Scalar fovy, Scalar aspect, Scalar zNear, Scalar zFar);
     bool get_ray(Scalar x, Scalar y, const Scalar (&model)[4][4], Scalar (&from)[3], Scalar (&to)[3]);
     void render(CyberX3D::SceneGraph *sg);
+    void mark_dirty(CyberX3D::Node *node);
+    // LOD ranges scaled by the view's focal length in pixels instead of
+    // compared to the plain distance
+    void set_lod_screen_space(bool screen_space);
+    // Light volumes shade only the pixels a stencil pass finds inside them,
+    // otherwise every back face fragment is shaded
+    void set_stencil_light_volumes(bool stencil);
 
     void debug_render_increase();
     void debug_render_decrease();
 private:
     void process_texture_node(CyberX3D::TextureNode *texture, glm::ivec4& info);
-    void process_apperance_node(CyberX3D::AppearanceNode *apperance, DrawInfoBuffer::DrawInfo& info);
-    void process_geometry_node(CyberX3D::Geometry3DNode *geometry, DrawInfoBuffer::DrawInfo& info);
+    bool read_appearance(CyberX3D::AppearanceNode *appearance, X3DAppearanceNode& node);
+    void process_apperance_node(CyberX3D::AppearanceNode *apperance, DrawInfoBuffer::DrawInfo& info,
+                                const X3DAppearanceNode* prepared = nullptr);
+    void process_geometry_node(CyberX3D::Geometry3DNode *geometry, DrawInfoBuffer::DrawInfo& info,
+                               const GeometryData* prepared = nullptr);
+    CyberX3D::Geometry3DNode* get_unit_primitive(CyberX3D::Geometry3DNode *geometry);
+    std::shared_ptr<const GeometryData> get_geometry_data(CyberX3D::Geometry3DNode *geometry);
     void process_background_node(CyberX3D::BackgroundNode *background);
     void process_light_node(CyberX3D::LightNode *light);
-    void process_shape_node(CyberX3D::ShapeNode *shape, bool selected);
-    void process_node(CyberX3D::SceneGraph *sg, CyberX3D::Node *root);
+    void process_clustered_pass();
+    void read_shape(CyberX3D::ShapeNode *shape, ScenePacket& packet);
+    void process_shape_node(const ScenePacket& packet, TransformHierarchy::Index parent);
+    void update_shape_bounds(CyberX3D::ShapeNode *shape, const glm::mat4x4& transform);
+
+    // Sibling list walked by one worker and the Transform it sits under,
+    // a LOD's selected level is walked on its own
+    struct Subtree
+    {
+        CyberX3D::Node *first;
+        CyberX3D::Node *parent;
+        bool single;
+    };
+    void gather_nodes(const Subtree& subtree, std::vector<ScenePacket>& packets, std::vector<Subtree>* subtrees);
+    void gather_scene(CyberX3D::Node *root, std::vector<ScenePacket>& packets);
+    void submit_packets(const std::vector<ScenePacket>& packets);
+    TransformHierarchy::Index get_transform_index(CyberX3D::Node *node, TransformHierarchy::Index parent);
+    bool is_dirty(CyberX3D::Node *node) const { return dirty_nodes.count(node) != 0; }
+    bool is_moved(CyberX3D::Node *node, CyberX3D::Node *parent) const;
+    void set_listener(CyberX3D::Node *node);
+
+    // Parameter index and transform slot of a light, the volume is null
+    // while the light is clustered or off
+    struct LightSlot
+    {
+        size_t index;
+        size_t transform_pos;
+        InstanceHandle volume;
+        bool clustered;
+    };
+    void release_light_volume(LightSlot& slot);
+    void disable_light(LightSlot& slot);
+    void release_light(CyberX3D::Node *node);
+    void release_shape(CyberX3D::Node *node);
+
+    // Level shown by a LOD node and the Transform it sits under
+    struct LodState
+    {
+        CyberX3D::Node *parent;
+        int level;
+    };
+    void select_lod_levels();
+    void mark_subtree(CyberX3D::Node *node);
+    void hide_subtree(CyberX3D::Node *node);
+
+    // Indices in passes, recorded as the constructor adds them
+    size_t light_stencil_pass;
+    size_t lighting_pass;
+
     friend class RenderingNodeListener;
     RenderingNodeListener* node_listener;
     CyberX3D::DirectionalLightNode* headlight;
+    glm::mat4x4 headlight_view; // view the headlight direction was last set from
+    CyberX3D::SceneGraph* scene; // geometry stats are reset when it changes
+    std::set<CyberX3D::Node*> dirty_nodes; // updated nodes and their ancestors
+    bool full_update; // walk the whole scene next frame
+    TransformHierarchy transforms; // Transform and Shape nodes
+    std::map<CyberX3D::Node*, TransformHierarchy::Index> transform_ids;
+    std::map<CyberX3D::Node*, CyberX3D::Node*> transform_parents; // closest Transform when last submitted
+    std::map<int, CyberX3D::Geometry3DNode*> unit_primitives;
+    std::map<CyberX3D::Geometry3DNode*, std::shared_ptr<const GeometryData>> unit_geometry;
+    SpinLock unit_primitives_lock; // gathering workers share the unit primitives
+
+    // Local bounds of each shape, read while gathering and placed in the
+    // world when the shape's transform moves
+    struct ShapeBounds
+    {
+        glm::vec3 center;
+        glm::vec3 extent;
+    };
+    std::map<CyberX3D::Node*, ShapeBounds> shape_bounds;
+    std::map<CyberX3D::Node*, LightSlot> light_slots;
+    std::vector<size_t> free_lights;
+    InstanceHandle clustered_pass; // full screen draw shading the clustered lights
+    bool lights_clustered; // mode the lights were last processed in
+    std::map<CyberX3D::Node*, LodState> lod_nodes;
+    bool lod_screen_space;
 };
 
 #endif // X3DOPENGLRENDERER_H
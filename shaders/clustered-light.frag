@@ -0,0 +1,220 @@
+#version 150 
+#extension GL_ARB_separate_shader_objects: require
+#extension GL_ARB_explicit_attrib_location: require
+#extension GL_ARB_explicit_uniform_location: require
+#extension GL_ARB_shading_language_420pack: require
+#ifndef MATERIAL_UNIFORM_BUFFER
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
+
+struct X3DLightNode
+{
+    vec4 color_intensity;
+    vec4 attenuation_ambient_intensity;
+    vec4 position;
+    vec4 direction;
+    int type;
+    float radius;
+    float cut_off;      // spot lights, in radians
+    float beam_width;
+};
+
+layout(std140, binding = 0) uniform GlobalParameters
+{
+    mat4 view;
+    mat4 projection;
+    mat4 view_projection;
+    vec4 position;
+    int width;
+    int height;
+    int render_type;
+    int g_buffer_layout;
+    mat4 inverse_view_projection;
+};
+
+layout(std140, binding = 3) uniform ShaderParameters
+{
+    X3DLightNode lights[768];
+};
+
+// Must match LightClusters
+const uint GRID_X = 16u;
+const uint GRID_Y = 9u;
+const uint GRID_Z = 24u;
+const uint NUM_CLUSTERS = GRID_X * GRID_Y * GRID_Z;
+
+#ifndef MATERIAL_UNIFORM_BUFFER
+// Offset and count per cluster followed by the light indices
+layout(std430, binding = 5) readonly buffer LightClusters
+{
+    uint clusters[];
+};
+
+uint read_clusters(uint i)
+{
+    return clusters[i];
+}
+#else
+// Clustered lighting is only turned on with storage buffers, every
+// cluster is empty so the shader still builds without them
+uint read_clusters(uint i)
+{
+    return 0u;
+}
+#endif
+
+layout(binding = 1) uniform sampler2D in_rt0;
+layout(binding = 2) uniform sampler2D in_rt1;
+layout(binding = 3) uniform sampler2D in_rt2;
+layout(binding = 4) uniform sampler2D in_rt3;
+layout(binding = 8) uniform sampler2D in_depth;
+
+layout(location = 1) flat in int draw_id;
+
+layout(location = 0) out vec4 rt0;
+
+// Same terms as default-light.frag, emissive is left to the light volumes
+
+vec3 x3d_light_ambient(float light_ambient_intensity, vec3 mat_color,
+                       float mat_ambient_intensity)
+{
+    return light_ambient_intensity * mat_color * mat_ambient_intensity;
+}
+
+vec3 x3d_light_diffuse(float intensity, vec3 mat_color, vec3 normal,
+                       vec3 light_normal)
+{
+    return intensity * mat_color * dot(normal, light_normal);
+}
+
+vec3 x3d_light_specular(float intensity, float shininess, vec3 spec_color,
+                        vec3 normal, vec3 light_normal, vec3 eye_normal)
+{
+    vec3 lv = normalize(light_normal + eye_normal);
+    return intensity * spec_color * pow(dot(normal, lv),
+                                        shininess * 128);
+}
+
+float x3d_light_attenuation(float d, vec3 a)
+{
+    return 1.0 / max(a[0] + (a[1] * d) + (a[2] * d * d), 1.0);
+}
+
+// Full inside the beam width, falling off linearly to the cut off angle.
+// A beam wider than the cut off is treated as the cut off.
+float x3d_spot_factor(vec3 light_normal, vec3 spot_direction, float cut_off, float beam_width)
+{
+    float angle = acos(clamp(dot(light_normal, spot_direction), -1.0, 1.0));
+    if (angle >= cut_off) {
+        return 0.0;
+    } else if (angle <= beam_width) {
+        return 1.0;
+    }
+    return (angle - cut_off) / (beam_width - cut_off);
+}
+
+uint get_cluster(vec3 world_position)
+{
+    float near = projection[3][2] / (projection[2][2] - 1.0);
+    float far = projection[3][2] / (projection[2][2] + 1.0);
+    float depth = -(view * vec4(world_position, 1.0)).z;
+    float slice = log(max(depth, near) / near) * float(GRID_Z) / log(far / near);
+
+    uvec3 cell = uvec3(gl_FragCoord.xy / vec2(width, height) * vec2(GRID_X, GRID_Y), slice);
+    cell = min(cell, uvec3(GRID_X, GRID_Y, GRID_Z) - 1u);
+    return (cell.z * GRID_Y + cell.y) * GRID_X + cell.x;
+}
+
+// RenderTarget::Layout
+const int COMPACT_G_BUFFER = 1;
+
+vec3 decode_normal(vec2 encoded)
+{
+    vec3 normal = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+    float fold = max(-normal.z, 0.0);
+    normal.x += normal.x >= 0.0 ? -fold : fold;
+    normal.y += normal.y >= 0.0 ? -fold : fold;
+    return normalize(normal);
+}
+
+struct GBufferSample
+{
+    vec3 position;
+    vec3 normal; // zero where nothing was drawn
+    vec3 color;
+    float ambient_intensity;
+    vec3 specular_color;
+    vec3 emissive;
+};
+
+GBufferSample read_g_buffer(ivec2 pixel)
+{
+    vec4 rt0 = texelFetch(in_rt0, pixel, 0);
+    vec4 rt1 = texelFetch(in_rt1, pixel, 0);
+    vec4 rt2 = texelFetch(in_rt2, pixel, 0);
+    vec4 rt3 = texelFetch(in_rt3, pixel, 0);
+
+    GBufferSample g;
+    g.emissive = rt3.rgb;
+    if (g_buffer_layout == COMPACT_G_BUFFER) {
+        float depth = texelFetch(in_depth, pixel, 0).r;
+        vec2 ndc = (vec2(pixel) + 0.5) / vec2(width, height) * 2.0 - 1.0;
+        vec4 world = inverse_view_projection * vec4(ndc, depth * 2.0 - 1.0, 1.0);
+        g.position = world.xyz / world.w;
+        g.normal = depth < 1.0 ? decode_normal(rt2.xy) : vec3(0.0);
+        g.color = rt0.rgb;
+        g.ambient_intensity = rt0.a;
+        g.specular_color = rt1.rgb;
+    } else {
+        g.position = rt0.xyz;
+        g.normal = rt1.xyz;
+        g.color = rt2.rgb;
+        g.ambient_intensity = rt2.a;
+        g.specular_color = vec3(rt0.a, rt1.a, rt3.a);
+    }
+    return g;
+}
+
+void main()
+{
+    GBufferSample g = read_g_buffer(ivec2(gl_FragCoord.xy));
+    vec4 pos = vec4(g.position, 1.0);
+    vec4 norm = vec4(g.normal, 0.0);
+    vec4 color = vec4(g.color, 1.0);
+    float ambient_intensity = g.ambient_intensity;
+    float shininess = 0.1;
+    vec3 specular_color = g.specular_color;
+    vec3 eye_normal = normalize(position.xyz - pos.xyz);
+
+    uint cluster = get_cluster(pos.xyz);
+    uint first = NUM_CLUSTERS * 2u + read_clusters(cluster * 2u);
+    uint count = read_clusters(cluster * 2u + 1u);
+
+    vec3 result = vec3(0.0);
+    for (uint i = 0u; i < count; ++i) {
+        X3DLightNode light = lights[read_clusters(first + i)];
+
+        vec3 light_direction = pos.xyz - light.position.xyz;
+        float distance = length(light_direction);
+        vec3 light_normal = normalize(light_direction);
+
+        float attenuation = x3d_light_attenuation(distance, light.attenuation_ambient_intensity.xyz);
+        vec3 ambient = x3d_light_ambient(light.attenuation_ambient_intensity.w, color.rgb, ambient_intensity);
+        vec3 diffuse = x3d_light_diffuse(light.color_intensity.a, color.rgb, norm.xyz, light_normal);
+        vec3 specular = x3d_light_specular(light.color_intensity.a, shininess, specular_color, norm.xyz, light_normal, eye_normal);
+
+        float spoti = 1.0;
+        if (light.type == 2) {
+            spoti = x3d_spot_factor(light_normal, light.direction.xyz, light.cut_off, light.beam_width);
+        }
+
+        result += (attenuation * spoti * light.color_intensity.rgb) * (ambient + diffuse + specular);
+    }
+
+    rt0 = vec4(result, 1.0);
+
+    // Light volumes draw the debug views
+    if (render_type != 0) {
+        rt0 = vec4(0.0);
+    }
+}
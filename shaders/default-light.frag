@@ -11,6 +11,9 @@ struct X3DLightNode
     vec4 position;
     vec4 direction;
     int type;
+    float radius;
+    float cut_off;      // spot lights, in radians
+    float beam_width;
 };
 
 layout(std140, binding = 0) uniform GlobalParameters
@@ -22,17 +25,20 @@ layout(std140, binding = 0) uniform GlobalParameters
     int width;
     int height;
     int render_type;
+    int g_buffer_layout;
+    mat4 inverse_view_projection;
 };
 
 layout(std140, binding = 3) uniform ShaderParameters
 {
-    X3DLightNode lights[256];
+    X3DLightNode lights[768];
 };
 
 layout(binding = 1) uniform sampler2D in_rt0;
 layout(binding = 2) uniform sampler2D in_rt1;
 layout(binding = 3) uniform sampler2D in_rt2;
 layout(binding = 4) uniform sampler2D in_rt3;
+layout(binding = 8) uniform sampler2D in_depth;
 
 layout(location = 1) flat in int draw_id;
 
@@ -66,6 +72,19 @@ float x3d_light_attenuation(float d, vec3 a)
     return 1.0 / max(a[0] + (a[1] * d) + (a[2] * d * d), 1.0);
 }
 
+// Full inside the beam width, falling off linearly to the cut off angle.
+// A beam wider than the cut off is treated as the cut off.
+float x3d_spot_factor(vec3 light_normal, vec3 spot_direction, float cut_off, float beam_width)
+{
+    float angle = acos(clamp(dot(light_normal, spot_direction), -1.0, 1.0));
+    if (angle >= cut_off) {
+        return 0.0;
+    } else if (angle <= beam_width) {
+        return 1.0;
+    }
+    return (angle - cut_off) / (beam_width - cut_off);
+}
+
 vec4 x3d_light(vec3 mat_emissive, float attenuation, float spoti,
                vec3 light_color, vec3 ambient, vec3 diffuse, vec3 specular)
 {
@@ -74,18 +93,68 @@ vec4 x3d_light(vec3 mat_emissive, float attenuation, float spoti,
                              * (ambient + diffuse + specular)), 1.0);
 }
 
+// RenderTarget::Layout
+const int COMPACT_G_BUFFER = 1;
+
+vec3 decode_normal(vec2 encoded)
+{
+    vec3 normal = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+    float fold = max(-normal.z, 0.0);
+    normal.x += normal.x >= 0.0 ? -fold : fold;
+    normal.y += normal.y >= 0.0 ? -fold : fold;
+    return normalize(normal);
+}
+
+struct GBufferSample
+{
+    vec3 position;
+    vec3 normal; // zero where nothing was drawn
+    vec3 color;
+    float ambient_intensity;
+    vec3 specular_color;
+    vec3 emissive;
+};
+
+GBufferSample read_g_buffer(ivec2 pixel)
+{
+    vec4 rt0 = texelFetch(in_rt0, pixel, 0);
+    vec4 rt1 = texelFetch(in_rt1, pixel, 0);
+    vec4 rt2 = texelFetch(in_rt2, pixel, 0);
+    vec4 rt3 = texelFetch(in_rt3, pixel, 0);
+
+    GBufferSample g;
+    g.emissive = rt3.rgb;
+    if (g_buffer_layout == COMPACT_G_BUFFER) {
+        float depth = texelFetch(in_depth, pixel, 0).r;
+        vec2 ndc = (vec2(pixel) + 0.5) / vec2(width, height) * 2.0 - 1.0;
+        vec4 world = inverse_view_projection * vec4(ndc, depth * 2.0 - 1.0, 1.0);
+        g.position = world.xyz / world.w;
+        g.normal = depth < 1.0 ? decode_normal(rt2.xy) : vec3(0.0);
+        g.color = rt0.rgb;
+        g.ambient_intensity = rt0.a;
+        g.specular_color = rt1.rgb;
+    } else {
+        g.position = rt0.xyz;
+        g.normal = rt1.xyz;
+        g.color = rt2.rgb;
+        g.ambient_intensity = rt2.a;
+        g.specular_color = vec3(rt0.a, rt1.a, rt3.a);
+    }
+    return g;
+}
+
 void main()
 {
     X3DLightNode light = lights[draw_id];
 
-    vec2 texcoord = gl_FragCoord.xy / vec2(width, height);
-    vec4 pos = texture(in_rt0, texcoord);
-    vec4 norm = texture(in_rt1, texcoord);
-    vec4 color = texture(in_rt2, texcoord);
-    float ambient_intensity = color.a;
+    GBufferSample g = read_g_buffer(ivec2(gl_FragCoord.xy));
+    vec4 pos = vec4(g.position, 1.0);
+    vec4 norm = vec4(g.normal, 0.0);
+    vec4 color = vec4(g.color, 1.0);
+    float ambient_intensity = g.ambient_intensity;
     float shininess = 0.1;
-    vec4 emissive = texture(in_rt3, texcoord);
-    vec3 specular_color = vec3(pos.a, norm.a, emissive.a);
+    vec4 emissive = vec4(g.emissive, 1.0);
+    vec3 specular_color = g.specular_color;
 
     vec3 light_direction = pos.xyz - light.position.xyz;
     float distance = length(light_direction);
@@ -102,9 +171,9 @@ void main()
     vec3 diffuse = x3d_light_diffuse(light.color_intensity.a, color.rgb, norm.xyz, light_normal);
     vec3 specular = x3d_light_specular(light.color_intensity.a, shininess, specular_color, norm.xyz, light_normal, eye_normal);
 
-    float spoti = 1;
+    float spoti = 1.0;
     if (light.type == 2) {
-        // TODO calculate spoti;
+        spoti = x3d_spot_factor(light_normal, light.direction.xyz, light.cut_off, light.beam_width);
     }
 
     rt0 = x3d_light(emissive.rgb, attenuation, spoti, light.color_intensity.rgb, ambient, diffuse, specular);
@@ -114,7 +183,7 @@ void main()
         rt0 = vec4(pos.xyz, 1.0);
     } else if (render_type == 2) {
         rt0 = vec4(norm.xyz, 1.0);
-    } else if (render_type == 3) {
+    } else if (render_type == 3 || render_type == 6) {
         rt0 = vec4(color.rgb, 1.0);
     } else if (render_type == 4) {
         rt0 = vec4(specular_color.rgb, 1.0);
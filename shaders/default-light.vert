@@ -3,6 +3,9 @@
 #extension GL_ARB_explicit_attrib_location: require
 #extension GL_ARB_explicit_uniform_location: require
 #extension GL_ARB_shading_language_420pack : enable
+#ifndef TRANSFORM_TEXTURE_BUFFER
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
 
 layout(location = 0) in vec4 draw_info;
 layout(location = 1) in vec3 position;
@@ -18,11 +21,34 @@ layout(std140, binding = 0) uniform GlobalParameters
     int height;
 };
 
-layout(std140, binding = 1) uniform ObjectParameters
+// Rows of each affine transform, three per transform
+#ifdef TRANSFORM_TEXTURE_BUFFER
+layout(binding = 7) uniform samplerBuffer transforms;
+
+vec4 get_transform_row(int index)
+{
+    return texelFetch(transforms, index);
+}
+#else
+layout(std430, binding = 1) readonly buffer Transforms
 {
-    mat4 transforms[256];
+    vec4 transforms[];
 };
 
+vec4 get_transform_row(int index)
+{
+    return transforms[index];
+}
+#endif
+
+mat4 get_transform(int id)
+{
+    return transpose(mat4(get_transform_row(id * 3),
+                          get_transform_row(id * 3 + 1),
+                          get_transform_row(id * 3 + 2),
+                          vec4(0.0, 0.0, 0.0, 1.0)));
+}
+
 layout(location = 0) out gl_PerVertex
 {
     vec4 gl_Position;
@@ -34,8 +60,8 @@ layout(location = 1) flat out int draw_id;
 
 void main()
 {
-    draw_id = int(draw_info[0]);
-    mat4 transform = transforms[draw_id];
+    draw_id = int(draw_info[2]);
+    mat4 transform = get_transform(int(draw_info[0]));
     if (int(draw_info[3]) == 1) {
         gl_Position = vec4(position, 1.0);
     } else {
@@ -3,14 +3,29 @@
 #extension GL_ARB_explicit_attrib_location: require
 #extension GL_ARB_explicit_uniform_location: require
 #extension GL_ARB_shading_language_420pack: require
+#ifndef MATERIAL_UNIFORM_BUFFER
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
 
 layout(std140, binding = 0) uniform GlobalParameters
 {
     mat4 view;
     mat4 projection;
     mat4 view_projection;
+    vec4 position;
+    int width;
+    int height;
+    int render_type;
+    int g_buffer_layout;
 };
 
+// RenderTarget::Layout
+const int COMPACT_G_BUFFER = 1;
+
+// OcclusionCulling::RENDER_TYPE, early draws are shown green and late draws red
+const int OCCLUSION_VIEW = 6;
+uniform int occlusion_pass;
+
 struct X3DTextureTransformNode
 {
     vec4 center_scale;
@@ -41,10 +56,17 @@ struct X3DAppearanceNode
     X3DTextureNode texture;
 };
 
-layout(std140, binding = 3) uniform ShaderParameters
+#ifdef MATERIAL_UNIFORM_BUFFER
+layout(std140, binding = 4) uniform MaterialParameters
 {
     X3DAppearanceNode apperances[256];
 };
+#else
+layout(std430, binding = 3) readonly buffer MaterialParameters
+{
+    X3DAppearanceNode apperances[];
+};
+#endif
 
 layout(binding = 0) uniform samplerBuffer textures;
 
@@ -70,14 +92,41 @@ vec4 get_texel(ivec4 o_w_h, vec2 tex_coord)
     }
 }
 
+// Octahedral projection folded onto the upper half, 0 0 is straight down z
+vec2 encode_normal(vec3 normal)
+{
+    normal /= abs(normal.x) + abs(normal.y) + abs(normal.z);
+    if (normal.z < 0.0) {
+        vec2 signs = vec2(normal.x >= 0.0 ? 1.0 : -1.0, normal.y >= 0.0 ? 1.0 : -1.0);
+        normal.xy = (1.0 - abs(normal.yx)) * signs;
+    }
+    return normal.xy;
+}
+
 void main()
 {
-    // Be wasteful for now
     X3DMaterialNode material = apperances[draw_id].material;
     vec4 texel = get_texel(apperances[draw_id].texture.diffuse_offset_width_height, vertex_texcoord);
+    vec3 normal = normalize(vertex_normal);
+    vec3 albedo = material.diffuse_color.rgb + texel.rgb;
+    if (render_type == OCCLUSION_VIEW) {
+        float luminance = 0.25 + 0.75 * dot(albedo, vec3(0.299, 0.587, 0.114));
+        albedo = occlusion_pass != 0 ? vec3(luminance, 0.0, 0.0) : vec3(0.0, luminance, 0.0);
+    }
+
+    if (g_buffer_layout == COMPACT_G_BUFFER) {
+        // Position is rebuilt from depth
+        rt0 = vec4(albedo, material.emissive_ambient_intensity.a);
+        rt1 = material.specular_shininess;
+        rt2 = vec4(encode_normal(normal), 0.0, 0.0);
+        rt3 = vec4(material.emissive_ambient_intensity.rgb, 0.0);
+        return;
+    }
+
+    // Be wasteful for now
     rt0 = vec4(vertex_position, material.specular_shininess.r);
-    rt1 = vec4(normalize(vertex_normal), material.specular_shininess.g);
-    rt2 = vec4(material.diffuse_color.rgb + texel.rgb, material.emissive_ambient_intensity.a);
+    rt1 = vec4(normal, material.specular_shininess.g);
+    rt2 = vec4(albedo, material.emissive_ambient_intensity.a);
     rt3 = vec4(material.emissive_ambient_intensity.rgb, material.specular_shininess.b);
 }
 
@@ -0,0 +1,7 @@
+TARGET = bvh
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+include(../../opengl/opengl.pri)
+
+SOURCES += main.cpp
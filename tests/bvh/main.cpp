@@ -0,0 +1,212 @@
+// Checks the bounding volume hierarchy behind DrawPool: bounds changes made
+// while culling is off stay bounded, and a tree updated in place answers
+// frustum, ray and nearest queries like one built from scratch.
+
+#include "opengl/openglhelper.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    if (!condition) {
+        std::printf("FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+struct Box
+{
+    int id;
+    glm::vec3 center;
+    glm::vec3 extent;
+};
+
+static Box random_box(int id, std::mt19937& random)
+{
+    std::uniform_real_distribution<float> position(-50.0f, 50.0f);
+    std::uniform_real_distribution<float> size(0.1f, 2.0f);
+    Box box = { id, glm::vec3(position(random), position(random), position(random)),
+                glm::vec3(size(random), size(random), size(random)) };
+    return box;
+}
+
+// Instance ids are kept in the draw info so pools can be compared
+static int get_id(const DrawPool& pool, InstanceHandle instance)
+{
+    DrawInfoBuffer::DrawInfo info;
+    return pool.get_instance_info(instance, info) ? info.x : -1;
+}
+
+// Ids of the instances visible, hit by each ray and nearest each point
+struct Queries
+{
+    std::vector<int> visible;
+    std::vector<std::vector<int>> hits;
+    std::vector<int> nearest;
+};
+
+static Queries run_queries(DrawPool& pool, const std::vector<InstanceHandle>& instances,
+                           const glm::mat4x4& view_projection, int seed)
+{
+    Queries result;
+    pool.cull(&view_projection, 1);
+    for (size_t i = 0; i < instances.size(); ++i) {
+        if (pool.is_visible(instances[i].index)) {
+            result.visible.push_back(get_id(pool, instances[i]));
+        }
+    }
+    std::sort(result.visible.begin(), result.visible.end());
+
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<float> position(-60.0f, 60.0f);
+    for (int i = 0; i < 32; ++i) {
+        glm::vec3 from(position(random), position(random), position(random));
+        glm::vec3 to(position(random), position(random), position(random));
+
+        // Hits are compared as a set, equal distances may come in either order
+        std::vector<InstanceHandle> hits;
+        pool.intersect_ray(from, to, hits);
+        result.hits.push_back(std::vector<int>());
+        for (size_t j = 0; j < hits.size(); ++j) {
+            result.hits.back().push_back(get_id(pool, hits[j]));
+        }
+        std::sort(result.hits.back().begin(), result.hits.back().end());
+
+        result.nearest.push_back(get_id(pool, pool.find_nearest(from, 10.0f)));
+    }
+    return result;
+}
+
+static void test_culling_off()
+{
+    static const int NUM_INSTANCES = 200;
+
+    Material material;
+    DrawBatch& batch = material.get_batch(VertexFormat(), 32, 0, 0);
+    DrawPool pool;
+    DrawHandle draw = pool.add_draw(batch, 36, 0, 0, 0);
+
+    std::mt19937 random(1);
+    std::vector<InstanceHandle> instances;
+    std::vector<Box> boxes;
+    for (int i = 0; i < NUM_INSTANCES; ++i) {
+        instances.push_back(pool.add_instance(draw, DrawInfoBuffer::DrawInfo(i, 0, 0, 0)));
+        boxes.push_back(random_box(i, random));
+    }
+
+    // Every instance moves every frame and nothing queries the tree
+    size_t most_pending = 0;
+    for (int frame = 0; frame < 1000; ++frame) {
+        for (int i = 0; i < NUM_INSTANCES; ++i) {
+            glm::vec3 offset(std::sin(frame * 0.01f + i), 0.0f, 0.0f);
+            pool.set_bounds(instances[i], boxes[i].center + offset, boxes[i].extent);
+        }
+        pool.cull(nullptr, 0);
+        most_pending = std::max(most_pending, pool.num_pending_bounds());
+    }
+    check(most_pending <= (size_t)NUM_INSTANCES, "pending bounds grow with culling off");
+
+    glm::mat4x4 view_projection = glm::perspective(1.0f, 1.0f, 0.1f, 200.0f)
+            * glm::lookAt(glm::vec3(0.0f, 0.0f, 80.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    pool.cull(&view_projection, 1);
+    check(pool.num_pending_bounds() == 0, "pending bounds left after culling");
+}
+
+static void test_incremental()
+{
+    Material material;
+    DrawBatch& batch = material.get_batch(VertexFormat(), 32, 0, 0);
+    DrawPool pool;
+    DrawHandle draw = pool.add_draw(batch, 36, 0, 0, 0);
+
+    std::mt19937 random(2);
+    std::vector<InstanceHandle> instances;
+    std::vector<Box> boxes;
+    int next_id = 0;
+    for (; next_id < 300; ++next_id) {
+        Box box = random_box(next_id, random);
+        instances.push_back(pool.add_instance(draw, DrawInfoBuffer::DrawInfo(box.id, 0, 0, 0)));
+        pool.set_bounds(instances.back(), box.center, box.extent);
+        boxes.push_back(box);
+    }
+
+    // Few enough changes a round that most rounds update the tree in place
+    for (int round = 0; round < 40; ++round) {
+        // Added before removing so freed slots are not taken straight back
+        for (int i = 0; i < 8; ++i) {
+            Box box = random_box(next_id++, random);
+            instances.push_back(pool.add_instance(draw, DrawInfoBuffer::DrawInfo(box.id, 0, 0, 0)));
+            pool.set_bounds(instances.back(), box.center, box.extent);
+            boxes.push_back(box);
+        }
+        for (int i = 0; i < 8; ++i) {
+            size_t pos = random() % instances.size();
+            pool.remove_instance(instances[pos]);
+            instances[pos] = instances.back();
+            instances.pop_back();
+            boxes[pos] = boxes.back();
+            boxes.pop_back();
+        }
+        for (int i = 0; i < 30; ++i) {
+            size_t pos = random() % instances.size();
+            boxes[pos].center += glm::vec3(5.0f, -3.0f, 2.0f);
+            pool.set_bounds(instances[pos], boxes[pos].center, boxes[pos].extent);
+        }
+
+        glm::vec3 eye(std::cos(round * 0.5f) * 80.0f, 10.0f, std::sin(round * 0.5f) * 80.0f);
+        glm::mat4x4 view_projection = glm::perspective(0.3f, 1.5f, 0.1f, 150.0f)
+                * glm::lookAt(eye, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+        Material fresh_material;
+        DrawBatch& fresh_batch = fresh_material.get_batch(VertexFormat(), 32, 0, 0);
+        DrawPool fresh;
+        DrawHandle fresh_draw = fresh.add_draw(fresh_batch, 36, 0, 0, 0);
+        std::vector<InstanceHandle> fresh_instances;
+        for (size_t i = 0; i < boxes.size(); ++i) {
+            fresh_instances.push_back(fresh.add_instance(fresh_draw, DrawInfoBuffer::DrawInfo(boxes[i].id, 0, 0, 0)));
+            fresh.set_bounds(fresh_instances.back(), boxes[i].center, boxes[i].extent);
+        }
+
+        Queries updated = run_queries(pool, instances, view_projection, round);
+        Queries built = run_queries(fresh, fresh_instances, view_projection, round);
+        check(updated.visible == built.visible, "visible instances differ from a fresh tree");
+        check(updated.hits == built.hits, "ray hits differ from a fresh tree");
+        check(updated.nearest == built.nearest, "nearest instance differs from a fresh tree");
+    }
+}
+
+static void test_emptied()
+{
+    // The last item erased and another inserted in the same update
+    BoundingVolumeHierarchy bvh;
+    bvh.set(0, glm::vec3(0.0f), glm::vec3(1.0f));
+    bvh.update();
+    bvh.remove(0);
+    bvh.set(1, glm::vec3(10.0f), glm::vec3(1.0f));
+    bvh.update();
+
+    float distance;
+    check(bvh.query_nearest(glm::vec3(0.0f), 100.0f, distance) == 1, "item inserted into an emptied tree is lost");
+    check(bvh.size() == 1, "emptied tree counts items wrong");
+}
+
+int main()
+{
+    test_culling_off();
+    test_incremental();
+    test_emptied();
+
+    if (failures > 0) {
+        return 1;
+    }
+    std::printf("bvh: all passed\n");
+    return 0;
+}
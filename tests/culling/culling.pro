@@ -0,0 +1,9 @@
+TARGET = culling
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+include(../../opengl/opengl.pri)
+
+RESOURCES += ../../x3d-compositor.qrc
+
+SOURCES += main.cpp
@@ -0,0 +1,354 @@
+// Runs cull.comp on random draws and instances and checks the commands and
+// draw info it builds against the same culling done on the CPU, with and
+// without compaction. Needs a 4.3 context, headless with Mesa's llvmpipe:
+//   QT_QPA_PLATFORM=offscreen LIBGL_ALWAYS_SOFTWARE=1 ./culling
+
+#include "opengl/openglhelper.h"
+
+#include <QGuiApplication>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions_4_3_Core>
+#include <QFile>
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static_assert(sizeof(CullInstance) == 48, "CullInstance differs from its std430 layout");
+static_assert(sizeof(CullDraw) == 32, "CullDraw differs from its std430 layout");
+
+static const uint32_t NUM_BATCHES = 3;
+static const uint32_t UNWRITTEN = 0xdeadbeef;
+
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    if (!condition) {
+        std::printf("FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+// Slots as DrawPool hands them out, each draw followed by its instances
+struct Scene
+{
+    std::vector<CullInstance> instances;
+    std::vector<CullDraw> draws;
+    std::vector<DrawInfoBuffer::DrawInfo> infos;
+    std::vector<uint32_t> visible; // per slot, instances in view for draws
+    uint32_t command_words;
+};
+
+// The unit cube, planes pointing inwards
+static const glm::vec4 planes[6] = {
+    glm::vec4(1, 0, 0, 1), glm::vec4(-1, 0, 0, 1),
+    glm::vec4(0, 1, 0, 1), glm::vec4(0, -1, 0, 1),
+    glm::vec4(0, 0, 1, 1), glm::vec4(0, 0, -1, 1)
+};
+
+static bool is_visible(const CullInstance& instance)
+{
+    if (!instance.bounded) {
+        return true;
+    }
+
+    for (size_t i = 0; i < 6; ++i) {
+        glm::vec3 normal(planes[i]);
+        float dist = glm::dot(normal, instance.center) + planes[i].w;
+        float radius = glm::dot(glm::abs(normal), instance.extent);
+        if (dist + radius < 0.0f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Positions are in quarters so the GPU and CPU tests round the same way
+static Scene build_scene(std::mt19937& random)
+{
+    Scene scene;
+    CullInstance no_instance = CullInstance();
+    no_instance.draw = CullInstance::NONE;
+
+    std::vector<std::vector<uint32_t>> batches(NUM_BATCHES);
+    for (int i = 0; i < 200; ++i) {
+        // Freed slots have neither
+        if (random() % 8 == 0) {
+            scene.instances.push_back(no_instance);
+            scene.draws.push_back(CullDraw());
+            scene.visible.push_back(0);
+            continue;
+        }
+
+        uint32_t slot = scene.draws.size();
+        uint32_t batch = random() % NUM_BATCHES;
+        bool elements = batch != 0;
+        CullDraw draw = CullDraw();
+        draw.count = 3 + random() % 30;
+        draw.first = random() % 100;
+        draw.base_vertex = elements ? random() % 100 : 0;
+        draw.info_first = scene.infos.size();
+        draw.stride = elements ? 5 : 4;
+        draw.batch = batch;
+        batches[batch].push_back(slot);
+        scene.instances.push_back(no_instance);
+        scene.draws.push_back(draw);
+        scene.visible.push_back(0);
+
+        uint32_t num_instances = random() % 7;
+        for (uint32_t j = 0; j < num_instances; ++j) {
+            CullInstance instance = CullInstance();
+            instance.draw = slot;
+            instance.info = scene.infos.size();
+            if (random() % 5 != 0) {
+                for (int axis = 0; axis < 3; ++axis) {
+                    instance.center[axis] = ((int)(random() % 25) - 12) * 0.25f;
+                }
+                instance.extent = glm::vec3((1 + random() % 3) * 0.25f);
+                instance.bounded = 1;
+            } else {
+                instance.extent = glm::vec3(1e30f);
+            }
+
+            scene.visible[slot] += is_visible(instance);
+            scene.instances.push_back(instance);
+            scene.draws.push_back(CullDraw());
+            scene.visible.push_back(0);
+            scene.infos.push_back(DrawInfoBuffer::DrawInfo((int)scene.infos.size(), (int)slot, (int)j, 7));
+        }
+    }
+
+    // Each batch's commands are contiguous, in the order of its draws
+    scene.command_words = 0;
+    for (uint32_t batch = 0; batch < NUM_BATCHES; ++batch) {
+        uint32_t batch_command = scene.command_words;
+        for (size_t i = 0; i < batches[batch].size(); ++i) {
+            CullDraw& draw = scene.draws[batches[batch][i]];
+            draw.batch_command = batch_command;
+            draw.command = scene.command_words;
+            scene.command_words += draw.stride;
+        }
+    }
+    return scene;
+}
+
+struct Result
+{
+    std::vector<uint32_t> commands;
+    std::vector<DrawInfoBuffer::DrawInfo> infos;
+    std::vector<uint32_t> draw_counts;
+};
+
+static GLuint create_buffer(QOpenGLFunctions_4_3_Core* gl, GLuint binding, size_t size, const void* data)
+{
+    GLuint buffer;
+    gl->glGenBuffers(1, &buffer);
+    gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    gl->glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(size, 16), nullptr, GL_DYNAMIC_COPY);
+    if (size > 0) {
+        gl->glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, data);
+    }
+    gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
+    return buffer;
+}
+
+static void read_buffer(QOpenGLFunctions_4_3_Core* gl, GLuint buffer, size_t size, void* data)
+{
+    gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    gl->glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, data);
+}
+
+// The early stages, as dispatch_culling runs them without pyramids
+static Result run(QOpenGLFunctions_4_3_Core* gl, GLuint program, const Scene& scene, bool compact)
+{
+    size_t num_slots = scene.draws.size();
+    std::vector<uint32_t> zeros(std::max<size_t>(num_slots, NUM_BATCHES), 0);
+    std::vector<uint32_t> commands(scene.command_words, UNWRITTEN);
+    std::vector<DrawInfoBuffer::DrawInfo> infos(scene.infos.size(), DrawInfoBuffer::DrawInfo(-1));
+
+    GLuint buffers[] = {
+        create_buffer(gl, 0, num_slots * sizeof(CullInstance), scene.instances.data()),
+        create_buffer(gl, 1, num_slots * sizeof(CullDraw), scene.draws.data()),
+        create_buffer(gl, 2, scene.infos.size() * sizeof(DrawInfoBuffer::DrawInfo), scene.infos.data()),
+        create_buffer(gl, 3, commands.size() * sizeof(uint32_t), commands.data()),
+        create_buffer(gl, 4, num_slots * sizeof(uint32_t), zeros.data()),
+        create_buffer(gl, 5, NUM_BATCHES * sizeof(uint32_t), zeros.data()),
+        create_buffer(gl, 6, num_slots * sizeof(uint32_t), zeros.data()),
+        create_buffer(gl, 7, num_slots * sizeof(uint32_t), zeros.data()),
+        create_buffer(gl, 8, infos.size() * sizeof(DrawInfoBuffer::DrawInfo), infos.data())
+    };
+
+    gl->glUseProgram(program);
+    gl->glProgramUniform4fv(program, 0, 6, &planes[0][0]);
+    gl->glProgramUniform1ui(program, 12, 1);
+    gl->glProgramUniform1ui(program, 13, num_slots);
+    gl->glProgramUniform1i(program, 15, compact);
+    gl->glProgramUniform1ui(program, 20, 0);
+
+    gl->glProgramUniform1ui(program, 14, 0);
+    gl->glDispatchCompute((num_slots + 63) / 64, 1, 1);
+    gl->glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    gl->glProgramUniform1ui(program, 14, 1);
+    gl->glDispatchCompute((num_slots + 63) / 64, 1, 1);
+    gl->glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    gl->glUseProgram(0);
+
+    Result result;
+    result.commands.resize(commands.size());
+    result.infos.resize(infos.size());
+    result.draw_counts.resize(NUM_BATCHES);
+    read_buffer(gl, buffers[3], result.commands.size() * sizeof(uint32_t), result.commands.data());
+    read_buffer(gl, buffers[8], result.infos.size() * sizeof(DrawInfoBuffer::DrawInfo), result.infos.data());
+    read_buffer(gl, buffers[5], NUM_BATCHES * sizeof(uint32_t), result.draw_counts.data());
+    gl->glDeleteBuffers(sizeof(buffers) / sizeof(buffers[0]), buffers);
+    return result;
+}
+
+static bool check_command(const uint32_t* command, const CullDraw& draw, uint32_t visible)
+{
+    bool same = command[0] == draw.count && command[1] == visible && command[2] == draw.first
+            && command[draw.stride - 1] == draw.info_first;
+    return same && (draw.stride == 4 || command[3] == draw.base_vertex);
+}
+
+// Draw info of the draw's visible instances, packed from its first in any order
+static void check_infos(const Scene& scene, const Result& result, uint32_t slot)
+{
+    const CullDraw& draw = scene.draws[slot];
+    std::vector<int> expected;
+    for (uint32_t i = slot + 1; i < scene.instances.size() && scene.instances[i].draw == slot; ++i) {
+        if (is_visible(scene.instances[i])) {
+            expected.push_back(scene.infos[scene.instances[i].info].x);
+        }
+    }
+
+    std::vector<int> culled;
+    for (size_t i = 0; i < expected.size(); ++i) {
+        const DrawInfoBuffer::DrawInfo& info = result.infos[draw.info_first + i];
+        check(info.y == (int)slot && info.w == 7, "culled draw info was not copied whole");
+        culled.push_back(info.x);
+    }
+
+    std::sort(expected.begin(), expected.end());
+    std::sort(culled.begin(), culled.end());
+    check(culled == expected, "culled draw info differs from the visible instances");
+}
+
+static void test_commands(QOpenGLFunctions_4_3_Core* gl, GLuint program, const Scene& scene)
+{
+    Result result = run(gl, program, scene, false);
+    for (uint32_t slot = 0; slot < scene.draws.size(); ++slot) {
+        const CullDraw& draw = scene.draws[slot];
+        if (draw.stride == 0) {
+            continue;
+        }
+
+        check(check_command(&result.commands[draw.command], draw, scene.visible[slot]),
+              "command differs from the draw's");
+        check_infos(scene, result, slot);
+    }
+}
+
+static void test_compact(QOpenGLFunctions_4_3_Core* gl, GLuint program, const Scene& scene)
+{
+    Result result = run(gl, program, scene, true);
+    for (uint32_t batch = 0; batch < NUM_BATCHES; ++batch) {
+        // Draws with instances in view, keyed by their first draw info
+        std::vector<uint32_t> expected;
+        uint32_t batch_command = UNWRITTEN;
+        for (uint32_t slot = 0; slot < scene.draws.size(); ++slot) {
+            const CullDraw& draw = scene.draws[slot];
+            if (draw.stride != 0 && draw.batch == batch) {
+                batch_command = draw.batch_command;
+                if (scene.visible[slot] > 0) {
+                    expected.push_back(slot);
+                }
+            }
+        }
+
+        check(result.draw_counts[batch] == expected.size(), "compacted draw count differs");
+        if (result.draw_counts[batch] != expected.size()) {
+            continue;
+        }
+
+        std::vector<uint32_t> written;
+        for (size_t i = 0; i < expected.size(); ++i) {
+            const CullDraw& draw = scene.draws[expected[i]];
+            const uint32_t* command = &result.commands[batch_command + i * draw.stride];
+            for (size_t j = 0; j < expected.size(); ++j) {
+                const CullDraw& match = scene.draws[expected[j]];
+                if (command[draw.stride - 1] == match.info_first) {
+                    check(check_command(command, match, scene.visible[expected[j]]),
+                          "compacted command differs from the draw's");
+                    written.push_back(expected[j]);
+                }
+            }
+        }
+
+        std::sort(written.begin(), written.end());
+        check(written == expected, "compacted commands are not the visible draws");
+        for (size_t i = 0; i < expected.size(); ++i) {
+            check_infos(scene, result, expected[i]);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    QGuiApplication app(argc, argv);
+
+    QSurfaceFormat format;
+    format.setVersion(4, 3);
+    format.setProfile(QSurfaceFormat::CoreProfile);
+
+    QOpenGLContext context;
+    context.setFormat(format);
+    QOffscreenSurface surface;
+    surface.setFormat(format);
+    surface.create();
+    if (!context.create() || !context.makeCurrent(&surface)) {
+        std::printf("FAIL: no OpenGL context\n");
+        return 1;
+    }
+
+    QOpenGLFunctions_4_3_Core* gl = context.versionFunctions<QOpenGLFunctions_4_3_Core>();
+    if (gl == nullptr || !gl->initializeOpenGLFunctions()) {
+        std::printf("FAIL: compute shaders need OpenGL 4.3\n");
+        return 1;
+    }
+
+    QFile file(":/shaders/cull.comp");
+    if (!file.open(QIODevice::ReadOnly)) {
+        std::printf("FAIL: cull.comp not found\n");
+        return 1;
+    }
+
+    QByteArray source = file.readAll();
+    const char* sources[] = {source.constData()};
+    GLuint program = gl->glCreateShaderProgramv(GL_COMPUTE_SHADER, 1, sources);
+    GLint linked = GL_FALSE;
+    gl->glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (linked != GL_TRUE) {
+        char log[4096];
+        gl->glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+        std::printf("FAIL: cull.comp did not link\n%s\n", log);
+        return 1;
+    }
+
+    std::mt19937 random(7);
+    for (int round = 0; round < 8; ++round) {
+        Scene scene = build_scene(random);
+        test_commands(gl, program, scene);
+        test_compact(gl, program, scene);
+    }
+    gl->glDeleteProgram(program);
+
+    if (failures > 0) {
+        return 1;
+    }
+    std::printf("culling: all passed\n");
+    return 0;
+}
@@ -1,12 +1,10 @@
-QT += gui gui-private core-private compositor openglextensions
-CONFIG += c++11
+QT += compositor
+
+include(opengl/opengl.pri)
 
 LIBS += -L ../openvr/lib/linux64
 
 HEADERS += \
-    opengl/opengloutput.h \
-    opengl/openglrenderer.h \
-    opengl/openglhelper.h \
     opengl/x3dopenglrenderer.h \
     compositor/wayland/qwindowcompositor.h \
     x3d/x3dscene.h \
@@ -15,9 +13,6 @@ HEADERS += \
     output/openvroutput.h
 
 SOURCES += main.cpp \
-    opengl/opengloutput.cpp \
-    opengl/openglrenderer.cpp \
-    opengl/openglhelper.cpp \
     opengl/x3dopenglrenderer.cpp \
     compositor/wayland/qwindowcompositor.cpp \
     x3d/x3dscene.cpp \
@@ -4,6 +4,7 @@
 namespace CyberX3D
 {
     class SceneGraph;
+    class Node;
 }
 
 typedef float Scalar;
@@ -16,6 +17,9 @@ public:
     virtual bool get_ray(Scalar x, Scalar y, const Scalar (&model)[4][4], Scalar (&from)[3], Scalar (&to)[3]) = 0;
     virtual void render(CyberX3D::SceneGraph *sg) = 0;
 
+    // Node and its ancestors are processed next frame, the whole scene for null
+    virtual void mark_dirty(CyberX3D::Node *node) = 0;
+
     virtual void debug_render_increase() = 0;
     virtual void debug_render_decrease() = 0;
 };
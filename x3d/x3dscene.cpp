@@ -121,6 +121,7 @@ void X3DScene::load(const QString& filename)
     addToPhysics(m_root->getTransformNodes());
     nodes.clear();
     physics.restart();
+    m_renderer->mark_dirty(nullptr);
 }
 
 void X3DScene::add_texture(int texture_id, float real_width, float real_height,
@@ -164,10 +165,12 @@ void X3DScene::add_texture(int texture_id, float real_width, float real_height,
         nodes[data].texture_node = texture;
         nodes[data].bounded_node = box;
         m_root->addNode(transform);
+        m_renderer->mark_dirty(transform);
         addToPhysics(transform);
         nodes[data].bt_rigid_body = (btRigidBody *)transform->getValue();
     } else if (found->second.texture_node != NULL){
         found->second.texture_node->setTextureName(texture_id);
+        m_renderer->mark_dirty(found->second.texture_node);
     }
 }
 